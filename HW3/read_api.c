@@ -21,6 +21,7 @@
 #include "read_api.h"
 
 #define NUM_FD 100
+#define FAT_READ_SECTORS 32 //Maximum number of FAT sectors paged in on a single miss
 
 /**
 * Structure representing a long directory entry name
@@ -108,6 +109,10 @@ dirEnt * cwd_entries;     //Represents current working directory
 int fd_base[NUM_FD];        //Stores the first cluster number of a file at a given file descriptor
 dirEnt fd_dirEnt[NUM_FD]; //Stores the dirENTs opened by a file descriptor
 
+int fat_num_sec;            //Number of sectors occupied by a single FAT
+char * fat_table;           //In-memory copy of the first FAT, paged in by sector
+char * fat_sec_loaded;      //Nonzero for each FAT sector that has been read into fat_table
+
 /**
 * Given a valid cluster number N, where is the offset in the FAT?
 * NOTE: Given the return value FATOffset:
@@ -131,29 +136,49 @@ int offset_in_FAT(int clus_nbr)  {
     return FATOffset;
 }
 
+/**
+* Get a pointer to a sector of the in-memory FAT, reading it from the
+* volume first if it has not been paged in yet. On a miss, the following
+* unloaded sectors are read in with the same call so chain walks do not
+* fault on every sector.
+* @param sec The sector index relative to the start of the FAT
+* @return A pointer to the cached copy of that sector
+*/
+char * fat_sector(int sec)  {
+    int bps = bpb_struct.BPB_BytsPerSec;
+    if (!fat_sec_loaded[sec])   {
+        int count = 0;
+        while (count < FAT_READ_SECTORS && sec + count < fat_num_sec &&
+            !fat_sec_loaded[sec + count])
+            count ++;
+        lseek(fat_fd, (bpb_struct.BPB_RsvdSecCnt + sec) * bps, SEEK_SET);
+        read(fat_fd, fat_table + sec * bps, count * bps);
+        memset(fat_sec_loaded + sec, 1, count);
+    }
+    return fat_table + sec * bps;
+}
+
 /**
 * Given a FAT cluster, return the FAT entry at that cluster
 * @param cluster The cluster number
-* @return The value in the FAT
+* @return The value in the FAT, or an end of chain marker if the
+*   cluster lies outside of the FAT
 */
 int value_in_FAT(int cluster)    {
     int offset = offset_in_FAT(cluster);
-    //Calculate the sector number and offset in that sector
-    int FATSecNum = bpb_struct.BPB_RsvdSecCnt + 
-        (offset / bpb_struct.BPB_BytsPerSec);
-    int FATEntOffset = offset % bpb_struct.BPB_BytsPerSec;
+    int FATSecNum = offset / bpb_struct.BPB_BytsPerSec;
+    if (cluster < 0 || FATSecNum >= fat_num_sec)
+        return fsys_type == 0x01 ? 0xFFFF : 0x0FFFFFFF;
 
-    //Now lseek to the sector and load it into an array
-    char sec_buffer[bpb_struct.BPB_BytsPerSec];
-    lseek(fat_fd, FATSecNum * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-    read(fat_fd, sec_buffer, bpb_struct.BPB_BytsPerSec);
+    //Page in the sector if needed, then locate the value in the table
+    if (!fat_sec_loaded[FATSecNum])
+        fat_sector(FATSecNum);
 
-    //Locate the value in the FAT buffer
     int val_FAT;
     if (fsys_type == 0x01)
-        val_FAT = *((unsigned short int *) &sec_buffer[FATEntOffset]);
+        val_FAT = *((unsigned short int *) &fat_table[offset]);
     else
-        val_FAT = (*((unsigned int *) &sec_buffer[FATEntOffset])) & 0x0FFFFFFF;
+        val_FAT = (*((unsigned int *) &fat_table[offset])) & 0x0FFFFFFF;
 
     return val_FAT;
 }
@@ -289,6 +314,11 @@ int init_fat()   {
     root_sec = bpb_struct.BPB_RsvdSecCnt +
         (bpb_struct.BPB_NumFATs * FATSz);
     data_sec = root_sec + RootDirSectors;
+
+    //Set up the in-memory FAT. Sectors are paged in on first use
+    fat_num_sec = FATSz;
+    fat_table = (char *) malloc(FATSz * bpb_struct.BPB_BytsPerSec);
+    fat_sec_loaded = (char *) calloc(FATSz, sizeof(char));
    
     //Load in root directory
     if (fsys_type == 0x01)  {   //FAT16
@@ -16,13 +16,43 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "fat_api.h"
 
 #define NUM_FD 100
+#define FAT_READ_SECTORS 32 //Maximum number of FAT sectors paged in on a single miss
+#define CACHE_DEFAULT_KB 4096   //Block cache budget used when FAT_CACHE_KB is not set
+#define CACHE_GATHER_MAX 64     //Most cache blocks loaded or written back with one vectored call
+#define DIR_READ_CLUSTERS 8     //Directory clusters find_dirEnt_match reads with one call
+#define DIR_CACHE_BUCKETS 256   //Number of hash buckets in the directory cache
+#define DIR_CACHE_MAX_ENTRIES (1 << 20) //Directory entries the directory cache may hold
+#define DENTRY_BUCKETS 1024     //Number of hash buckets in the path cache
+#define DENTRY_MAX 4096         //Paths the path cache may hold before it is emptied
+#define READAHEAD_DEFAULT_KB 256    //Readahead window of a sequential reader unless FAT_READAHEAD_KB is set
+#define DIRENT_DEFAULT_DELAY_MS 1000    //Age at which deferred dirEnt updates are written
+#define ASYNC_DEFAULT_THREADS 4 //Worker threads per volume unless FAT_ASYNC_THREADS is set
+#define ASYNC_MAX_THREADS 64
+#define JOURNAL_MAGIC 0x4C4E524A    //"JRNL", starts a committed journal transaction
+#define JOURNAL_GATHER_MAX 256      //Most pieces written to the journal with one vectored call
+#define CHECK_MAX_THREADS 64        //Most threads fat_check runs
+#define CHECK_SEGMENT_SECTORS 256   //FAT sectors a fat_check thread scans at a time
+#define DEFRAG_COPY_CLUSTERS 256    //Clusters fat_defrag gathers into one write
+#define DEFRAG_BATCH_CLUSTERS 16384 //Clusters fat_defrag moves between two syncs
+#define DEFRAG_MAX_DEPTH 128        //Directories nested deeper are not defragmented
+#define FORMAT_ROOT_ENTRIES 512     //Root directory entries of a FAT16 volume made by fat_mkfs
 
 /**
 * Structure representing a long directory entry name
@@ -94,29 +124,324 @@ typedef struct __attribute__((__packed__)) FAT32_BS_EBR_Structure   {
 } EBR_FAT32;
 
 /**
-* Global variables
+* FAT32 FSInfo sector, which caches the free cluster count and a hint for
+* where to start looking for free clusters
 */
+typedef struct __attribute__((__packed__)) FAT32_FSInfo_Structure   {
+    int FSI_LeadSig;            //0x41615252
+    char FSI_Reserved1[480];
+    int FSI_StrucSig;           //0x61417272
+    int FSI_Free_Count;         //Last known free cluster count, 0xFFFFFFFF if unknown
+    int FSI_Nxt_Free;           //Cluster at which to start looking for free clusters
+    char FSI_Reserved2[12];
+    int FSI_TrailSig;           //0xAA550000
+} FSInfo;
 
-int fat_fd = -1;
-char fsys_type = 0;         //0x01 for FAT16, 0x02 for FAT32
-BPB_Structure bpb_struct;   //Stores the bios partition block once the volume is loaded
-EBR_FAT16 ebr_fat16;        //Stores the extended boot record for FAT16 volumes
-EBR_FAT32 ebr_fat32;        //Stores the extended boot record for FAT32 volumes
-int root_sec;               //Sector of the Root directory
-int data_sec;               //Sector of the data section after Root
-int CountofClusters;        //Stores the number of clusters after cluster 2
-dirEnt * root_entries;    //Stores the dirENTRY values in the root directory
-dirEnt * cwd_entries;     //Represents current working directory
-char cwd_path[1024];
-int cwd_cluster;            //Stores the cluster that the current working directory was read from
+/**
+* A run of clusters that are contiguous on the volume
+*/
+typedef struct extent   {
+    int file_index;     //Index of the first cluster of the run within the file
+    int cluster;        //Cluster number of the first cluster of the run
+    int length;         //Number of clusters in the run
+} extent;
+
+/**
+* Cached map from cluster indices within a file to cluster numbers on the
+* volume. It is built lazily from the cluster chain and only ever covers a
+* prefix of the chain.
+*/
+typedef struct extent_map   {
+    extent * extents;   //Runs in file order
+    int count;          //Number of runs in extents
+    int capacity;       //Number of runs extents has room for
+    int last;           //Run used by the previous lookup
+} extent_map;
+
+/**
+* A block of the volume held in the block cache. Blocks in the data region
+* are one cluster long; blocks before it (the FAT16 root directory) are one
+* sector long. The FAT itself is cached separately in fat_table.
+*/
+typedef struct cache_block  {
+    int sector;                     //First sector of the block on the volume
+    int nsec;                       //Number of sectors in the block
+    int dirty;                      //1 if the block must be written back
+    char * data;                    //Contents of the block
+    struct cache_block * hash_next; //Next block in the same hash bucket
+    struct cache_block * lru_prev;  //Neighbour that was used more recently
+    struct cache_block * lru_next;  //Neighbour that was used less recently
+} cache_block;
+
+/**
+* Decoded name of a directory entry, chained into its directory's name index
+*/
+typedef struct dir_name {
+    int name;           //Offset in the directory's name arena of the long name if the
+                        //entry has a valid one, otherwise of the 8.3 name
+    int index;          //Index of the short entry in the directory's entries
+    int next;           //Next name in the same bucket, or -1
+} dir_name;
+
+/**
+* A long name being assembled from the long name entries before a short entry
+*/
+typedef struct lfn_state    {
+    char name[256];         //Characters decoded so far, placed by ordinal
+    int len;                //Length of the name once its last part has been seen
+    int next_ord;           //Ordinal expected next, 0 once complete, -1 if no valid name is being built
+    unsigned char checksum; //Checksum of the short name the parts belong to
+} lfn_state;
+
+/**
+* A directory held in the directory cache, with a hash index of the decoded
+* names of its entries
+*/
+typedef struct dir_cache    {
+    int cluster;                    //First cluster of the directory, 0 for the FAT16 root
+    dirEnt * entries;               //Entries as read by read_cluster_dirEnt
+    int num_entries;                //Number of entries before the end of the directory
+    dir_name * names;               //Decoded names, one per short entry
+    int num_names;                  //Number of decoded names
+    char * arena;                   //The decoded names, each NUL terminated, back to back
+    int * buckets;                  //First name in each hash bucket, or -1
+    int nbuckets;                   //Number of hash buckets, a power of two
+    struct dir_cache * hash_next;   //Next directory in the same cache bucket
+    struct dir_cache * lru_prev;    //Neighbour that was used more recently
+    struct dir_cache * lru_next;    //Neighbour that was used less recently
+} dir_cache;
+
+/**
+* A resolved path in the path cache
+*/
+typedef struct dentry   {
+    char * key;             //Starting directory cluster and the path, as built by dentry_key
+    dirEnt entry;           //The directory entry the path names
+    int parent_cluster;     //First cluster of the directory holding the entry
+    struct dentry * next;   //Next path in the same bucket
+} dentry;
+
+/**
+* A read or write queued by fat_read_async or fat_write_async
+*/
+typedef struct async_request    {
+    int write;                      //1 for a write, 0 for a read
+    int fildes;                     //The file descriptor
+    void * buf;                     //The buffer to read into or write from
+    int nbytes;                     //The number of bytes to transfer
+    int offset;                     //The offset in the file
+    fat_async_callback done;        //Called with the result once the request completes
+    void * arg;                     //Passed to done
+    struct async_request * next;    //Next request in the queue
+} async_request;
+
+/**
+* State shared by the threads of fat_check. Each thread reads directories
+* off the stack until the walk is over, then scans runs of FAT sectors.
+*/
+typedef struct check_state  {
+    fat_volume * vol;               //The volume being checked
+    fat_check_report * report;      //The counts, each updated atomically
+    unsigned int * claimed;         //One bit per cluster, set once a chain has reached it
+    pthread_mutex_t lock;           //Guards the directory stack and busy
+    pthread_cond_t cond;            //Signalled when a directory is pushed or the walk is over
+    int * stack;                    //First clusters of directories still to be read, 0 for the root
+    int stack_count;                //Number of directories on stack
+    int stack_capacity;             //Number of directories stack has room for
+    int busy;                       //Number of threads reading a directory
+    int next_segment;               //First FAT sector of the next run to scan
+} check_state;
+
+/**
+* A fragmented file to be moved by fat_defrag
+*/
+typedef struct defrag_file  {
+    off_t entry_pos;                //Volume offset of its short directory entry
+    int parent_cluster;             //First cluster of the directory holding it
+    int cluster;                    //First cluster of its chain
+    int clusters;                   //Number of clusters in its chain
+    int extents;                    //Number of runs of contiguous clusters in its chain
+    int target;                     //First cluster of the run it was copied to, or 0
+} defrag_file;
+
+/**
+* The files fat_defrag looks at
+*/
+typedef struct defrag_plan  {
+    defrag_file * files;            //Fragmented files that are not open
+    int count;                      //Number of files
+    int capacity;                   //Number of files there is room for
+    fat_defrag_report * report;     //Counts of every file looked at
+} defrag_plan;
 
-int fd_base[NUM_FD];        //Stores the first cluster number of a file at a given file descriptor
-dirEnt fd_dirEnt[NUM_FD];   //Stores the dirENTs opened by a file descriptor
-char * fd_path[NUM_FD];    //Stores the paths to the file opened by each file descriptor
-int fd_parent_cluster[NUM_FD];  //Stores the cluster number of the parent directory for an opened file
+/**
+* Header of a transaction in the metadata journal. It is followed by count
+* journal_records, then the bytes of each record in the same order. A
+* transaction counts as committed only if the checksum matches, so a torn
+* write is ignored. Transactions follow one another until the volume has
+* been flushed, and a later one overrides an earlier one.
+*/
+typedef struct journal_header   {
+    unsigned int magic;             //JOURNAL_MAGIC
+    unsigned int count;             //Number of records
+    unsigned long long bytes;       //Total length of the records' bytes
+    unsigned int checksum;          //FNV-1a hash of the records and their bytes
+    unsigned int reserved;
+} journal_header;
+
+/**
+* A range of the volume whose new contents are held by the journal
+*/
+typedef struct journal_record   {
+    long long offset;               //Byte offset on the volume
+    int length;                     //Number of bytes
+    int reserved;
+} journal_record;
+
+/**
+* Cluster chain access for one FAT type, generated from fat_chain.h. A
+* volume picks fat_ops16 or fat_ops32 at mount time so chain walks do not
+* test the volume type.
+*/
+typedef struct fat_ops  {
+    int entry_bytes;        //Width of a FAT entry
+    int eoc_min;            //Smallest end of chain value
+    int eoc;                //End of chain value written to the FAT
+    int (*next)(fat_volume * vol, int cluster);
+    int (*chain_length)(fat_volume * vol, int cluster);
+    int (*chain_run)(fat_volume * vol, int cluster, int max, int * next);
+    int (*set_entry)(fat_volume * vol, int cluster, int value);
+    void (*set_run)(fat_volume * vol, int start, int length);
+    int (*free_chain)(fat_volume * vol, int cluster);
+} fat_ops;
 
-int available_clusters;     //Stores the number of available clusters
-int readDir_cluster;        //Stores the cluster number read by the current call to OS_readDir
+/**
+* State of a mounted FAT volume.
+*
+* Locking: lock is held shared by fat_open, fat_read and fat_readDir and
+* exclusively by every call that changes the volume. Shared holders may
+* still page in the FAT, fill the block, directory and path caches, and
+* claim descriptors, so those are guarded by fat_lock, cache_lock,
+* dir_lock and fd_lock. An opened file's extent map is guarded by its
+* entry in fd_mutex. Locks are taken in the order lock, fd_mutex,
+* dir_lock, cache_lock, fat_lock. async_lock only guards the queue of
+* asynchronous requests and is never held while one runs. Reads of a
+* read-only volume and queued asynchronous requests hold a reference in
+* fd_users instead, which fat_close waits on before the descriptor goes.
+*/
+struct fat_volume   {
+    pthread_rwlock_t lock;       //Shared for lookups and reads, exclusive for changes
+    pthread_mutex_t fat_lock;    //Guards paging in FAT sectors
+    pthread_mutex_t cache_lock;  //Guards the block cache
+    pthread_mutex_t dir_lock;    //Guards the directory and path caches
+    pthread_mutex_t fd_lock;     //Guards claiming file descriptors
+    pthread_mutex_t fd_mutex[NUM_FD];   //Guards the extent map of each opened file
+    int fd_users[NUM_FD];        //References on each descriptor that its close must wait for
+    char fd_closing[NUM_FD];     //1 while a close waits for the references of the descriptor
+    pthread_cond_t fd_idle;      //Signalled under fd_lock when a closing descriptor loses its last reference
+    struct fat_volume * next;    //Next mounted volume
+    int read_only;               //1 if mounted by fat_mount_readonly; its reads take no locks
+
+    pthread_mutex_t async_lock;  //Guards the queue of asynchronous requests
+    pthread_cond_t async_cond;   //Signalled when a request is queued or the workers must stop
+    async_request * async_head;  //Oldest queued request, run first
+    async_request * async_tail;  //Newest queued request
+    pthread_t async_threads[ASYNC_MAX_THREADS]; //Workers running queued requests
+    int async_nthreads;          //Number of workers started, 0 until the first request
+    int async_stop;              //1 once the workers must exit after draining the queue
+    char async_busy[NUM_FD];     //1 while a worker runs a request of the descriptor
+
+    int fat_fd;
+    int journal_fd;              //Metadata journal beside the image, or -1 if FAT_JOURNAL is not set
+    off_t journal_end;           //Length of the committed transactions not yet known to be on the image
+    int journal_pending;         //Read-only mounts: 1 if journal transactions not on the image were applied
+                                 //to a private mapping of it, 2 if they could not be
+    char * volume_map;           //The whole volume mapped into memory, or NULL to use fat_fd
+    off_t volume_size;           //Size of the mapping in bytes
+    char fsys_type;              //0x01 for FAT16, 0x02 for FAT32
+    const fat_ops * fat;         //Chain access code for fsys_type
+    BPB_Structure bpb_struct;    //Stores the bios partition block once the volume is loaded
+    EBR_FAT16 ebr_fat16;         //Stores the extended boot record for FAT16 volumes
+    EBR_FAT32 ebr_fat32;         //Stores the extended boot record for FAT32 volumes
+    int root_sec;                //Sector of the Root directory
+    int data_sec;                //Sector of the data section after Root
+    int CountofClusters;         //Stores the number of clusters after cluster 2
+    char cwd_path[1024];
+    int cwd_cluster;             //Stores the cluster that the current working directory was read from
+
+    int fd_base[NUM_FD];         //Stores the first cluster number of a file at a given file descriptor
+    dirEnt fd_dirEnt[NUM_FD];    //Stores the dirENTs opened by a file descriptor
+    int fd_parent_cluster[NUM_FD]; //Stores the cluster number of the parent directory for an opened file
+    extent_map fd_extents[NUM_FD]; //Stores the cached cluster runs of the file opened by a file descriptor
+    off_t fd_dirEnt_pos[NUM_FD]; //Volume offset of the dirENT of an opened file, or -1 if not found yet
+    int fd_dirEnt_dirty[NUM_FD]; //Nonzero if fd_dirEnt has changes not yet written to the volume
+    long fd_dirty_since[NUM_FD]; //Time in ms at which fd_dirEnt became dirty
+    long dirEnt_delay_ms;        //Age after which OS_write persists a dirty dirENT
+    pthread_mutex_t flush_lock;  //Guards flush_due and flush_stop
+    pthread_cond_t flush_cond;   //Signalled when a dirENT update is deferred or the flusher must stop
+    pthread_t flush_thread;      //Writes deferred dirENT updates once they are dirEnt_delay_ms old
+    int flush_running;           //1 if flush_thread was started
+    int flush_stop;              //1 once fat_unmount stops flush_thread
+    long flush_due;              //Time in ms at which the oldest deferred update is due, 0 if none
+    int fd_next_offset[NUM_FD];  //File offset just past the last read, to detect sequential reads
+    int fd_seq_reads[NUM_FD];    //Number of reads in a row that continued the previous one
+    int fd_ra_end[NUM_FD];       //Cluster index of the file up to which readahead was issued
+    int readahead_clusters;      //Clusters to read ahead of a sequential reader, 0 if disabled
+
+    int available_clusters;      //Stores the number of available clusters, kept in step with free_bitmap
+
+    int fat_num_sec;             //Number of sectors occupied by a single FAT
+    int fat_copies;              //Number of FATs kept in step; 1 if FAT32 mirroring is off
+    int fat_first_sec;           //Sector of the first FAT kept, the active one if mirroring is off
+    char * fat_table;            //In-memory copy of the first FAT, paged in by sector
+    char * fat_sec_loaded;       //Nonzero for each FAT sector that has been read into fat_table
+    char * fat_sec_dirty;        //Nonzero for each FAT sector that must be written back
+    int fat_dirty_lo;            //Lowest dirty FAT sector, or fat_num_sec if none are dirty
+    int fat_dirty_hi;            //One past the highest dirty FAT sector
+
+    unsigned int * free_bitmap;  //One bit per cluster, set if the cluster is free
+    int free_bitmap_words;       //Number of words in free_bitmap
+    int next_free_hint;          //Cluster at which the next search for a free cluster starts
+    int simd_level;              //Widest FAT scanning kernels to use: 0 scalar, 1 SSE2, 2 AVX2
+
+    FSInfo fsinfo;               //FSInfo sector as last read from or written to the volume
+    int fsinfo_valid;            //1 if the volume has an FSInfo sector with valid signatures
+    int fat_flush_count;         //Number of times dirty FAT sectors have been written back
+    int mount_free_count;        //Free cluster count that was trusted at mount time
+    pthread_t verify_thread;     //Background thread validating the FSInfo free count
+    int verify_done;             //0 while verify_thread runs, 1 once its result is ready, 2 otherwise
+    int verify_free_count;       //Free cluster count found by verify_thread
+    int verify_flush_count;      //fat_flush_count when verify_thread finished
+
+    cache_block ** cache_buckets; //Hash table of cached blocks keyed by first sector
+    int cache_nbuckets;          //Number of buckets, a power of two
+    cache_block * cache_mru;     //Most recently used block
+    cache_block * cache_lru;     //Least recently used block, evicted first
+    int cache_count;             //Number of blocks in the cache
+    int cache_max_blocks;        //Number of blocks allowed by the memory budget
+
+    dir_cache * dcache_buckets[DIR_CACHE_BUCKETS]; //Cached directories keyed by first cluster
+    dir_cache * dcache_mru;      //Most recently used directory
+    dir_cache * dcache_lru;      //Least recently used directory, evicted first
+    int dcache_entries;          //Total number of entries held by cached directories
+
+    dentry * dentry_buckets[DENTRY_BUCKETS]; //Resolved paths keyed by dentry_key
+    int dentry_count;            //Number of paths in the path cache
+};
+
+/**
+* An open directory stream. Only one cluster of entries is held at a time.
+*/
+struct fat_dir  {
+    fat_volume * vol;       //The volume the directory is on
+    int cluster;            //Next cluster to read, 0 for the FAT16 root, -1 past the end
+    int root_read;          //Entries of the FAT16 root read so far
+    dirEnt * buf;           //The entries of the cluster being returned
+    int count;              //Number of entries in buf
+    int index;              //Next entry of buf to look at
+    int done;               //1 once the end of the directory has been seen
+    lfn_state lfn;          //Long name being built from the entries before a short one
+};
 
 /**
 * Get the current time and store the date in date and the time in
@@ -140,1059 +465,5173 @@ void get_date_time(short int * date, short int * tim)  {
 }
 
 /**
-* Given a valid cluster number N, where is the offset in the FAT?
-* NOTE: Given the return value FATOffset:
-*   FATSecNum = BPB_RsvdSecCnt + (FATOffset / BPB_BytsPerSec);
-*   FATEntOffset = FATOffset % BPB_BytsPerSec
-* @param clus_nbr The cluster number
-* @return The index in the FAT for that cluster number
+* Get the free cluster bits of groups of 32 FAT entries, one bit per entry
+* that is zero. This is the portable version of the kernels below.
+* @param entries The first entry of the first group
+* @param fat16 1 if the entries are 16 bits wide, 0 if they are 32
+* @param ngroups The number of groups
+* @param masks Where the bits of each group are stored
 */
-int offset_in_FAT(int clus_nbr)  {
-    int FATOffset;
-    if (fsys_type == 0x01)  //If FAT16
-        FATOffset = clus_nbr * 2;
-    else
-        FATOffset = clus_nbr * 4;
-
-    return FATOffset;
+void scan_free_scalar(const char * entries, int fat16, int ngroups, unsigned int * masks)  {
+    const unsigned short int * entries16 = (const unsigned short int *) entries;
+    const unsigned int * entries32 = (const unsigned int *) entries;
+    int g, i;
+    for (g = 0; g < ngroups; g ++) {
+        unsigned int bits = 0;
+        if (fat16)  {
+            for (i = 0; i < 32; i ++)
+                bits |= (unsigned int) (entries16[g * 32 + i] == 0) << i;
+        } else  {
+            for (i = 0; i < 32; i ++)
+                bits |= (unsigned int) ((entries32[g * 32 + i] & 0x0FFFFFFF) == 0) << i;
+        }
+        masks[g] = bits;
+    }
 }
 
 /**
-* Given a FAT cluster, return the FAT entry at that cluster
-* @param cluster The cluster number
-* @return The value in the FAT
-*/
-int value_in_FAT(int cluster)    {
-    int offset = offset_in_FAT(cluster);
-    //Calculate the sector number and offset in that sector
-    int FATSecNum = bpb_struct.BPB_RsvdSecCnt + 
-        (offset / bpb_struct.BPB_BytsPerSec);
-    int FATEntOffset = offset % bpb_struct.BPB_BytsPerSec;
-
-    //Now lseek to the sector and load it into an array
-    char sec_buffer[bpb_struct.BPB_BytsPerSec];
-    lseek(fat_fd, FATSecNum * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-    read(fat_fd, sec_buffer, bpb_struct.BPB_BytsPerSec);
-
-    //Locate the value in the FAT buffer
-    int val_FAT;
-    if (fsys_type == 0x01)
-        val_FAT = *((unsigned short int *) &sec_buffer[FATEntOffset]);
-    else
-        val_FAT = (*((unsigned int *) &sec_buffer[FATEntOffset])) & 0x0FFFFFFF;
-
-    return val_FAT;
+* Count the end-of-chain markers and the links to the following cluster
+* among the entries of a range of clusters. This is the portable version of
+* the kernels below, which also use it for their leftover entries.
+* @param table The in-memory FAT
+* @param fat16 1 if the entries are 16 bits wide, 0 if they are 32
+* @param first The first cluster of the range
+* @param last One past the last cluster of the range
+* @param ends Incremented for every end-of-chain marker
+* @param links Incremented for every cluster whose next cluster is itself + 1
+*/
+void scan_chains_scalar(const char * table, int fat16, int first, int last, int * ends, int * links)   {
+    const unsigned short int * entries16 = (const unsigned short int *) table;
+    const unsigned int * entries32 = (const unsigned int *) table;
+    int cluster;
+    if (fat16)  {
+        for (cluster = first; cluster < last; cluster ++)  {
+            unsigned int next = entries16[cluster];
+            *ends += next >= 0xFFF8;
+            *links += next == (unsigned int) cluster + 1;
+        }
+    } else  {
+        for (cluster = first; cluster < last; cluster ++)  {
+            unsigned int next = entries32[cluster] & 0x0FFFFFFF;
+            *ends += next >= 0x0FFFFFF8;
+            *links += next == (unsigned int) cluster + 1;
+        }
+    }
 }
 
+#ifdef __SSE2__
 /**
-* Find the first open cluster by searching the FAT
-* @return The cluster number, or -1 on failure
+* scan_free_scalar using SSE2, 16 bytes of entries per compare
 */
-int find_free_cluster() {
-   int i;
-   for (i = 0; i < CountofClusters; i ++)   {
-        if (value_in_FAT(i) == 0)
-            return i;
-   }
-
-   return -1;
+void scan_free_sse2(const char * entries, int fat16, int ngroups, unsigned int * masks)    {
+    const __m128i * p = (const __m128i *) entries;
+    __m128i zero = _mm_setzero_si128();
+    __m128i value_bits = _mm_set1_epi32(0x0FFFFFFF);
+    int g, k;
+    for (g = 0; g < ngroups; g ++) {
+        unsigned int bits = 0;
+        if (fat16)  {
+            for (k = 0; k < 2; k ++, p += 2)    {
+                __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128(p), zero);
+                __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128(p + 1), zero);
+                bits |= (unsigned int) _mm_movemask_epi8(_mm_packs_epi16(a, b)) << (16 * k);
+            }
+        } else  {
+            for (k = 0; k < 8; k ++, p ++)  {
+                __m128i v = _mm_and_si128(_mm_loadu_si128(p), value_bits);
+                bits |= (unsigned int) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << (4 * k);
+            }
+        }
+        masks[g] = bits;
+    }
 }
 
-
-/*
-* Set the FAT table entry for a given cluster to a specified value
-* @return 1 on success, -1 on failure
+/**
+* Add up the 32 bit lanes of a vector
+* @param v The vector
+* @return The sum
 */
-int set_cluster_value(int cluster, int value)   {
-    if (cluster < 0 || cluster >= CountofClusters)
-        return -1;
-    int offset;
-    if (fsys_type == 0x02 && cluster == 0)
-        offset = offset_in_FAT(ebr_fat32.BPB_RootClus);
-    offset = offset_in_FAT(cluster);
-    
-    int FATSecNum = bpb_struct.BPB_RsvdSecCnt + 
-        (offset / bpb_struct.BPB_BytsPerSec);
-    int FATEntOffset = offset % bpb_struct.BPB_BytsPerSec;
-    
-    if (fsys_type == 0x01)   {
-        lseek(fat_fd, FATSecNum * bpb_struct.BPB_BytsPerSec + 
-            FATEntOffset, SEEK_SET);
-        unsigned short int val = (unsigned short int) (value & 0xFFFF);
-        write(fat_fd, (void*)(&val), sizeof(unsigned short int)); 
-    } else if (fsys_type == 0x02)    {
-        unsigned int curr_entry = value_in_FAT(cluster); //Need to keep first 4 bits same if FAT32
-        unsigned int new_entry = (curr_entry & 0xF0000000) | (value & 0x0FFFFFFF);
-        lseek(fat_fd, FATSecNum * bpb_struct.BPB_BytsPerSec + 
-            FATEntOffset, SEEK_SET);
-        write(fat_fd, (void*)&new_entry, sizeof(unsigned int));
-    }
-
-    return 1;
+int sum_lanes_sse2(__m128i v)   {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+    return _mm_cvtsi128_si32(v);
 }
 
 /**
-* Given a cluster number, how many clusters does it chain to?
-* @param cluster The cluster number to be checked
-* @return The number of clusters in the chain
+* scan_chains_scalar using SSE2, 16 bytes of entries per compare. Matches
+* are counted in vector lanes by subtracting the all-ones compare results,
+* and only added up once at the end.
 */
-int cluster_chain_length(int cluster)   {
-    int count = 1;
-    int curr = cluster;
-    int flag = 1;
-    while(flag) {
-        int next = value_in_FAT(curr);
-        if (fsys_type == 0x01 && next >= 0xFFF8)  {
-            flag = 0;
-            continue;
-        } 
-        if (fsys_type == 0x02 && next >= 0x0FFFFFF8)  {
-            flag = 0;
-            continue;
+void scan_chains_sse2(const char * table, int fat16, int first, int last, int * ends, int * links)  {
+    int cluster = first;
+    __m128i end_count = _mm_setzero_si128(), link_count = _mm_setzero_si128();
+    if (fat16)  {
+        //Compared as signed after flipping the sign bit, since SSE2 has no
+        //unsigned 16 bit compare. madd folds pairs of 16 bit results into
+        //32 bit lanes, which cannot overflow
+        __m128i flip = _mm_set1_epi16((short) 0x8000);
+        __m128i eoc = _mm_set1_epi16(0xFFF7 ^ 0x8000);
+        __m128i ones = _mm_set1_epi16(1);
+        __m128i step = _mm_set1_epi16(8);
+        __m128i next = _mm_add_epi16(_mm_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8), _mm_set1_epi16((short) first));
+        for (; cluster + 8 <= last; cluster += 8)   {
+            __m128i v = _mm_loadu_si128((const __m128i *) (table + cluster * 2));
+            __m128i end = _mm_cmpgt_epi16(_mm_xor_si128(v, flip), eoc);
+            __m128i link = _mm_cmpeq_epi16(v, next);
+            end_count = _mm_sub_epi32(end_count, _mm_madd_epi16(end, ones));
+            link_count = _mm_sub_epi32(link_count, _mm_madd_epi16(link, ones));
+            next = _mm_add_epi16(next, step);
+        }
+    } else  {
+        __m128i value_bits = _mm_set1_epi32(0x0FFFFFFF);
+        __m128i eoc = _mm_set1_epi32(0x0FFFFFF7);
+        __m128i step = _mm_set1_epi32(4);
+        __m128i next = _mm_add_epi32(_mm_setr_epi32(1, 2, 3, 4), _mm_set1_epi32(first));
+        for (; cluster + 4 <= last; cluster += 4)   {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (table + cluster * 4)), value_bits);
+            end_count = _mm_sub_epi32(end_count, _mm_cmpgt_epi32(v, eoc));
+            link_count = _mm_sub_epi32(link_count, _mm_cmpeq_epi32(v, next));
+            next = _mm_add_epi32(next, step);
         }
-        curr = next;
-        count ++;
     }
-
-    return count;
+    *ends += sum_lanes_sse2(end_count);
+    *links += sum_lanes_sse2(link_count);
+    scan_chains_scalar(table, fat16, cluster, last, ends, links);
 }
 
 /**
-* Read in directory entries from a cluster and follow the cluster chain
-* @param cluster The cluster number to be read
-* @return The list of directory entries in a cluster
+* scan_free_scalar using AVX2, 32 bytes of entries per compare. Only called
+* when the processor supports AVX2.
 */
-dirEnt * read_cluster_dirEnt(int cluster)    {
-    int curr = cluster;
-    int sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-
-    readDir_cluster = cluster;
-
-    //cluster number of 0 is the root directory
-    if (curr == 0)  {
-        if (fsys_type == 0x01)  {
-            sector = root_sec;
-        } else if (fsys_type == 0x02)   {
-            curr = ebr_fat32.BPB_RootClus;
-            readDir_cluster = curr;
-            sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
+__attribute__((target("avx2")))
+void scan_free_avx2(const char * entries, int fat16, int ngroups, unsigned int * masks)    {
+    const __m256i * p = (const __m256i *) entries;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i value_bits = _mm256_set1_epi32(0x0FFFFFFF);
+    int g, k;
+    for (g = 0; g < ngroups; g ++) {
+        if (fat16)  {
+            __m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256(p), zero);
+            __m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256(p + 1), zero);
+            //packs works within 128 bit lanes, so put the quarters back in order
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+            masks[g] = (unsigned int) _mm256_movemask_epi8(packed);
+            p += 2;
+        } else  {
+            unsigned int bits = 0;
+            for (k = 0; k < 4; k ++, p ++)  {
+                __m256i v = _mm256_and_si256(_mm256_loadu_si256(p), value_bits);
+                bits |= (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << (8 * k);
+            }
+            masks[g] = bits;
         }
     }
-    
-    int chain_length = cluster_chain_length(cluster);
-    
-    int num_entries = chain_length * bpb_struct.BPB_SecPerClus * 
-        bpb_struct.BPB_BytsPerSec / sizeof(dirEnt);
+}
 
-    dirEnt * entries = (dirEnt *) malloc(sizeof(dirEnt) * num_entries);
-    dirEnt curr_entry;
-    lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-    int entry_count = 0;    //Tracks the number of entries read in
-    int cluster_count = 0;  //Tracks the number of entries in the current cluster
-    while(entry_count < num_entries)    {
-        read(fat_fd, (char*)&curr_entry, sizeof(dirEnt));
-        if (curr_entry.dir_name[0] != 0xE5) {   //Store non-free entries
-            entries[entry_count] = curr_entry;
-            if(((char*)&entries[entry_count])[0] == 0)  //First byte 0 means no more
-                break;
-            entry_count ++;
+/**
+* scan_chains_scalar using AVX2, 32 bytes of entries per compare. Only
+* called when the processor supports AVX2.
+*/
+__attribute__((target("avx2")))
+void scan_chains_avx2(const char * table, int fat16, int first, int last, int * ends, int * links)  {
+    int cluster = first;
+    __m256i end_count = _mm256_setzero_si256(), link_count = _mm256_setzero_si256();
+    if (fat16)  {
+        __m256i flip = _mm256_set1_epi16((short) 0x8000);
+        __m256i eoc = _mm256_set1_epi16(0xFFF7 ^ 0x8000);
+        __m256i ones = _mm256_set1_epi16(1);
+        __m256i step = _mm256_set1_epi16(16);
+        __m256i next = _mm256_add_epi16(_mm256_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8,
+            9, 10, 11, 12, 13, 14, 15, 16), _mm256_set1_epi16((short) first));
+        for (; cluster + 16 <= last; cluster += 16) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (table + cluster * 2));
+            __m256i end = _mm256_cmpgt_epi16(_mm256_xor_si256(v, flip), eoc);
+            __m256i link = _mm256_cmpeq_epi16(v, next);
+            end_count = _mm256_sub_epi32(end_count, _mm256_madd_epi16(end, ones));
+            link_count = _mm256_sub_epi32(link_count, _mm256_madd_epi16(link, ones));
+            next = _mm256_add_epi16(next, step);
         }
-        cluster_count ++;
-        //If we've read past the end of the cluster, we need to follow the chain
-        if ((cluster_count * sizeof(dirEnt)) >= 
-            (bpb_struct.BPB_BytsPerSec * bpb_struct.BPB_SecPerClus))    {
-            curr = value_in_FAT(curr);
-            if (fsys_type == 0x01 && curr >= 0xFFF8)
-                break;
-            if (fsys_type == 0x02 && curr >= 0x0FFFFFF8)
-                break;
-            sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-            lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-            cluster_count = 0;
+    } else  {
+        __m256i value_bits = _mm256_set1_epi32(0x0FFFFFFF);
+        __m256i eoc = _mm256_set1_epi32(0x0FFFFFF7);
+        __m256i step = _mm256_set1_epi32(8);
+        __m256i next = _mm256_add_epi32(_mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8), _mm256_set1_epi32(first));
+        for (; cluster + 8 <= last; cluster += 8)   {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (table + cluster * 4)), value_bits);
+            end_count = _mm256_sub_epi32(end_count, _mm256_cmpgt_epi32(v, eoc));
+            link_count = _mm256_sub_epi32(link_count, _mm256_cmpeq_epi32(v, next));
+            next = _mm256_add_epi32(next, step);
         }
     }
-
-    return entries;
+    *ends += sum_lanes_sse2(_mm_add_epi32(_mm256_castsi256_si128(end_count), _mm256_extracti128_si256(end_count, 1)));
+    *links += sum_lanes_sse2(_mm_add_epi32(_mm256_castsi256_si128(link_count), _mm256_extracti128_si256(link_count, 1)));
+    scan_chains_scalar(table, fat16, cluster, last, ends, links);
 }
+#endif
 
 /**
-* Initialize the FAT volume and load all relevant data
+* Find the widest FAT scanning kernels this processor can run. Setting
+* FAT_SIMD to 0 or 1 limits them to the scalar or SSE2 versions.
+* @return 0 for scalar, 1 for SSE2, 2 for AVX2
 */
-int init_fat()   {
-    char * basedir = getenv("FAT_FS_PATH");   //Directory of FAT16 volume
-    if (basedir == NULL)    {
-        return -1;
-    }
-
-    fat_fd = open(basedir, O_RDWR, 0);    //Store the file descriptor
-    
-    if (fat_fd == -1)   {
-        return -1;
-    }
-
-    //Read in the BPB_Structure
-    read(fat_fd, (char*)&bpb_struct, sizeof(BPB_Structure));
-    read(fat_fd, (char*)&ebr_fat16, sizeof(EBR_FAT16)); //Load EBR for FAT16
-    lseek(fat_fd, sizeof(BPB_Structure), SEEK_SET);    //Reset offset for FAT32
-    read(fat_fd, (char*)&ebr_fat32, sizeof(EBR_FAT32)); //Load EBR for FAT32
-
-    //Determine FAT16 or FAT32
-    //Number of sectors occupied by root directory
-    int RootDirSectors = ((bpb_struct.BPB_RootEntCnt * 32) + 
-        (bpb_struct.BPB_BytsPerSec -1)) / bpb_struct.BPB_BytsPerSec;
-    
+int detect_simd_level() {
+    int level = 0;
+#ifdef __SSE2__
+    level = 1;
+    if (__builtin_cpu_supports("avx2"))
+        level = 2;
+#endif
+    char * limit = getenv("FAT_SIMD");
+    if (limit != NULL && atoi(limit) < level)
+        level = atoi(limit) < 0 ? 0 : atoi(limit);
+    return level;
+}
 
-    int FATSz, TotSec;
-    if (bpb_struct.BPB_FATSz16 != 0)
-        FATSz = bpb_struct.BPB_FATSz16;
+/**
+* Get the free cluster bits of groups of 32 FAT entries with the widest
+* kernel the volume may use
+* @param vol The volume
+* @param entries The first entry of the first group
+* @param ngroups The number of groups
+* @param masks Where the bits of each group are stored
+*/
+void scan_free(fat_volume * vol, const char * entries, int ngroups, unsigned int * masks)  {
+    int fat16 = vol->fsys_type == 0x01;
+#ifdef __SSE2__
+    if (vol->simd_level >= 2)
+        scan_free_avx2(entries, fat16, ngroups, masks);
+    else if (vol->simd_level == 1)
+        scan_free_sse2(entries, fat16, ngroups, masks);
     else
-        FATSz = ebr_fat32.BPB_FATSz32;
+#endif
+        scan_free_scalar(entries, fat16, ngroups, masks);
+}
 
-    if (bpb_struct.BPB_TotSec16 != 0)
-        TotSec = bpb_struct.BPB_TotSec16;
+/**
+* Count the end-of-chain markers and the links to the following cluster in
+* the in-memory FAT with the widest kernel the volume may use. The whole
+* FAT must have been paged in.
+* @param vol The volume
+* @param ends Set to the number of end-of-chain markers
+* @param links Set to the number of clusters whose next cluster is itself + 1
+*/
+void scan_chains(fat_volume * vol, int * ends, int * links)    {
+    int fat16 = vol->fsys_type == 0x01;
+    int last = vol->CountofClusters + 2;
+    *ends = 0;
+    *links = 0;
+#ifdef __SSE2__
+    if (vol->simd_level >= 2)
+        scan_chains_avx2(vol->fat_table, fat16, 2, last, ends, links);
+    else if (vol->simd_level == 1)
+        scan_chains_sse2(vol->fat_table, fat16, 2, last, ends, links);
     else
-        TotSec = bpb_struct.BPB_TotSec32;
-
-    int DataSec = TotSec - (bpb_struct.BPB_RsvdSecCnt + 
-        (bpb_struct.BPB_NumFATs * FATSz) + RootDirSectors);
-    CountofClusters = DataSec / bpb_struct.BPB_SecPerClus;
-
-    if (CountofClusters < 4085) {   //Volume is FAT12 - exit
-        return -1;
-    } else if (CountofClusters < 65525) {   //Volume is FAT16
-        fsys_type = 0x01;
-    } else  {   //Volume is FAT32
-        fsys_type = 0x02;
-    }
-
-    //Initialize more global variables
-    root_sec = bpb_struct.BPB_RsvdSecCnt +
-        (bpb_struct.BPB_NumFATs * FATSz);
-    data_sec = root_sec + RootDirSectors;
-  
-    //Load in root directory
-    if (fsys_type == 0x01)  {   //FAT16
-        cwd_cluster = 0;
-        root_entries = (dirEnt *) malloc(sizeof(dirEnt) *
-            bpb_struct.BPB_RootEntCnt);
-        lseek(fat_fd, root_sec * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-        int entry_count = 0;
-        while (entry_count < bpb_struct.BPB_RootEntCnt)  {
-            read(fat_fd, (char*)&(root_entries[entry_count]), sizeof(dirEnt));
-            if (((char*)&root_entries[entry_count])[0] == 0)    //First byte 0 means no more to read
-                break;
-            entry_count ++;
-        }
-    } else if (fsys_type == 0x02)   {   //FAT32
-        //Root is read like any other cluster
-        cwd_cluster = ebr_fat32.BPB_RootClus;
-        root_entries = read_cluster_dirEnt(ebr_fat32.BPB_RootClus);
-    }
-
-    //Initialize cwd to root
-    cwd_entries = root_entries;
-    strcpy(cwd_path, "/");
-
-    //Free all file descriptors except for 0, 1 (Those are stdin, stdout by convention)
-    int i;
-    for (i = 0; i < NUM_FD; i ++)    {
-        fd_base[i] = -1;
-    }
-
-    fd_base[0] = 0;
-    fd_base[1] = 0;
+#endif
+        scan_chains_scalar(vol->fat_table, fat16, 2, last, ends, links);
+}
 
-    //Initialize number of empty clusters
-    available_clusters = 0;
-    for (i = 0; i < CountofClusters; i ++)  {
-         if (value_in_FAT(i) == 0)
-            available_clusters ++;
+/**
+* Clear the bits of scanned free cluster masks that do not belong to a data
+* cluster. Entries 0 and 1 are reserved and the last FAT sector may describe
+* clusters past the end of the volume.
+* @param vol The volume
+* @param group The index of the first mask, 32 clusters per mask
+* @param ngroups The number of masks
+* @param masks The masks
+*/
+void clip_free_masks(fat_volume * vol, int group, int ngroups, unsigned int * masks)    {
+    int end = vol->CountofClusters + 2;
+    int g;
+    for (g = 0; g < ngroups; g ++) {
+        int first = (group + g) * 32;
+        if (first == 0)
+            masks[g] &= ~3u;
+        if (first + 32 > end)
+            masks[g] &= first >= end ? 0 : (1u << (end - first)) - 1;
     }
-
-    return 1;
 }
 
 /**
-* Get the first element in the path
-* For example, /home/grimshaw/data -> home
-* @param dest The pointer in which the element should be placed
-* @param path The path to be analyzed
-* @return The first element in the path
+* Set the free cluster bitmap bits for every free cluster described by
+* a run of freshly paged in FAT sectors. Bits for clusters whose FAT
+* sector has not been paged in yet are always clear.
+* @param vol The volume
+* @param sec The first sector index relative to the start of the FAT
+* @param count The number of sectors in the run
 */
-char * getFirstElement(char * dest, const char * path)   {
-    if (path == NULL || strlen(path) == 0)
-        return NULL;
-
-    char * slash1 = strchr(path, '/');
-    if (slash1 == NULL) {
-        strcpy(dest, path);
-        return dest;
-    }
-        
+void mark_free_clusters(fat_volume * vol, int sec, int count)   {
+    int entsize = vol->fat->entry_bytes;
+    int per_sec = vol->bpb_struct.BPB_BytsPerSec / entsize;
+    int group = sec * per_sec / 32;     //A group of 32 entries never spans two FAT sectors
+    int ngroups = count * per_sec / 32;
+    if (group + ngroups > vol->free_bitmap_words)
+        ngroups = vol->free_bitmap_words - group;
+    if (ngroups <= 0)
+        return;
+
+    //The bits of these sectors are all clear, so they can be overwritten
+    scan_free(vol, vol->fat_table + group * 32 * entsize, ngroups, vol->free_bitmap + group);
+    clip_free_masks(vol, group, ngroups, vol->free_bitmap + group);
+}
 
-    if (slash1 - path == 0)    {
-        char * slash2 = strchr(slash1 + 1, '/');
-        if (slash2 == NULL) {
-            strcpy(dest, path + 1);
-            return dest;
+/**
+* Get a pointer to a sector of the in-memory FAT, reading it from the
+* volume first if it has not been paged in yet. On a miss, the following
+* unloaded sectors are read in with the same call so chain walks do not
+* fault on every sector. When the volume is mapped, fat_table is the
+* mapped FAT and paging in only fills in the free cluster bitmap.
+* Readers holding the volume lock shared may page in concurrently, so the
+* loaded flags are published under fat_lock.
+* @param vol The volume
+* @param sec The sector index relative to the start of the FAT
+* @return A pointer to the cached copy of that sector
+*/
+char * fat_sector(fat_volume * vol, int sec)  {
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    if (!__atomic_load_n(&vol->fat_sec_loaded[sec], __ATOMIC_ACQUIRE))   {
+        pthread_mutex_lock(&vol->fat_lock);
+        int count = 0;
+        while (count < FAT_READ_SECTORS && sec + count < vol->fat_num_sec &&
+            !vol->fat_sec_loaded[sec + count])
+            count ++;
+        if (count > 0)  {
+            if (vol->volume_map == NULL) {   //When mapped, fat_table already points at the FAT
+                pread(vol->fat_fd, vol->fat_table + sec * bps, count * bps,
+                    (off_t)(vol->fat_first_sec + sec) * bps);
+            }
+            mark_free_clusters(vol, sec, count);
+            int i;
+            for (i = 0; i < count; i ++)
+                __atomic_store_n(&vol->fat_sec_loaded[sec + i], 1, __ATOMIC_RELEASE);
         }
-        strncpy(dest, slash1 + 1, slash2 - slash1 - 1);
-        dest[slash2-slash1 - 1] = '\0';
-        return dest;
+        pthread_mutex_unlock(&vol->fat_lock);
     }
-    strncpy(dest, path, slash1-path);
-    dest[slash1-path] = '\0';
-    return dest;
+    return vol->fat_table + sec * bps;
 }
 
 /**
-* Get the remaining elements in the path
-* For example, /home/grimshaw/data -> grimshaw/data
-* @param dest The point in which the remaining elements should be placed
-* @param path The path to be analyzed
-* @return A pointer to dest
+* Mark a range of FAT sectors as needing to be written back
+* @param vol The volume
+* @param first_sec The first sector index relative to the start of the FAT
+* @param last_sec The last sector index, inclusive
 */
-char * getRemaining(char * dest, const char * path)  {
-    if (path == NULL || strlen(path) == 0)
-        return NULL;
-
-    char * slash1 = strchr(path, '/');
-    if (slash1 == NULL)  {
-        return NULL;
-    }
+void mark_fat_dirty(fat_volume * vol, int first_sec, int last_sec)  {
+    memset(vol->fat_sec_dirty + first_sec, 1, last_sec - first_sec + 1);
+    if (first_sec < vol->fat_dirty_lo)
+        vol->fat_dirty_lo = first_sec;
+    if (last_sec >= vol->fat_dirty_hi)
+        vol->fat_dirty_hi = last_sec + 1;
+}
 
-    if (slash1 - path == 0) {
-        slash1 = strchr(slash1 + 1, '/');
-    }
+#define FAT_BITS 16
+#define FAT_ENTRY unsigned short int
+#define FAT_VALUE_MASK 0xFFFF
+#define FAT_EOC_MIN 0xFFF8
+#define FAT_EOC 0xFFFF
+#include "fat_chain.h"
 
-    if (slash1 == NULL) {
-        return NULL;
-    }
+#define FAT_BITS 32
+#define FAT_ENTRY unsigned int
+#define FAT_VALUE_MASK 0x0FFFFFFF
+#define FAT_EOC_MIN 0x0FFFFFF8
+#define FAT_EOC 0x0FFFFFFF
+#include "fat_chain.h"
 
-    int num_cpy = strlen(path) - (slash1 + 1 - path);
-    strncpy(dest, slash1 + 1, num_cpy);
-    dest[num_cpy] = '\0';
-    return dest;
+/**
+* Given a FAT cluster, return the FAT entry at that cluster
+* @param vol The volume
+* @param cluster The cluster number
+* @return The value in the FAT, or an end of chain marker if the
+*   cluster lies outside of the FAT
+*/
+int value_in_FAT(fat_volume * vol, int cluster)    {
+    return vol->fat->next(vol, cluster);
 }
 
 /**
-* Separate a path to a file into the filename and the pathname
-* @param filename Where the filename will be stored
-* @param pathname Where the pathname will be stored
-* @param path The path to be split up
+* Does a FAT entry end a cluster chain?
+* @param vol The volume
+* @param next The value of the entry
+* @return 1 if it is an end of chain marker or no cluster at all, 0 otherwise
 */
-void separate_path(char * filename, char * pathname, const char * path) {
-    char * buff = malloc(sizeof(char) * strlen(path));
-    char * pathbuff = malloc(sizeof(char) * strlen(path));
-    char * filebuff = malloc(sizeof(char) * strlen(path));
-
-    pathbuff = getRemaining(pathbuff, path);
-    filebuff = getFirstElement(filebuff, path);
+int end_of_chain(fat_volume * vol, int next)    {
+    return next < 2 || next >= vol->fat->eoc_min;
+}
 
-    while(pathbuff != NULL && strlen(pathbuff) != 0) {
-        buff = pathbuff;
-        filebuff = getFirstElement(filebuff, buff);
-        pathbuff = getRemaining(pathbuff, buff);
+/**
+* Find an open cluster using the free cluster bitmap. The search starts at
+* next_free_hint, just past the last cluster handed out (next fit), and
+* wraps around to the start of the data region. FAT sectors are paged in
+* as the search reaches them, which fills in their bitmap bits.
+* @param vol The volume
+* @return The cluster number, or -1 on failure
+*/
+int find_free_cluster(fat_volume * vol) {
+    int per_sec = vol->bpb_struct.BPB_BytsPerSec / vol->fat->entry_bytes;
+    int start = vol->next_free_hint / 32;
+    int i;
+    for (i = 0; i <= vol->free_bitmap_words; i ++)   {
+        int word = (start + i) % vol->free_bitmap_words;
+        int sec = word * 32 / per_sec;  //A word never spans two FAT sectors
+        if (!vol->fat_sec_loaded[sec])
+            fat_sector(vol, sec);
+        unsigned int bits = vol->free_bitmap[word];
+        if (i == 0) //Ignore clusters before the hint in the first word
+            bits &= ~0u << (vol->next_free_hint % 32);
+        if (bits == 0)
+            continue;
+        int cluster = word * 32 + __builtin_ctz(bits);
+        vol->next_free_hint = cluster + 1;
+        if (vol->next_free_hint >= vol->CountofClusters + 2)
+            vol->next_free_hint = 2;
+        return cluster;
     }
 
-    free(buff);
-    pathbuff = malloc(sizeof(char) * strlen(path));
-    int pathlen = strstr(path, filebuff) - path;
-    strncpy(pathbuff, path, pathlen);
-    pathbuff[pathlen] = '\0';
-    strcpy(pathname, pathbuff);
-    strcpy(filename, filebuff);
+    return -1;
 }
 
 /**
-* Translate an 8.3 formatted filename into an 11 character string
-* @param dest The place for the translated name to be stored
-* @param source The 8.3 formatted filename
+* Find a run of free clusters for a file that needs want more clusters.
+* Starting at the next-fit hint, the first run of at least want clusters is
+* taken; if there is none, the longest run seen is used instead. Runs do
+* not wrap around the end of the volume.
+* @param vol The volume
+* @param want The number of clusters wanted
+* @param length Set to the number of clusters in the run, at most want
+* @return The first cluster of the run, or -1 if none are free
 */
-void fill_dir_name(char * dest, const char * source)    {
-    char * period = strchr(source, '.');
-    if (period != NULL) {
-        if (period - source < 8)    {
-            strncpy(dest, source, period-source);
-            int i;
-            for (i = period - source; i < 8; i ++)
-                dest[i] = 0x20;  //Pad end of string
-        } else  {
-            strncpy(dest, source, 8);
-        }
-        if (strlen(period + 1) < 3) {
-            strncpy(dest+8, period + 1, strlen(period + 1));
-            int i;
-            for (i = 8 + strlen(period+1); i < 11; i ++)
-                dest[i] = 0x20;
-        } else  {
-            strncpy(dest + 8, period + 1, 3);
+int find_free_run(fat_volume * vol, int want, int * length)   {
+    int per_sec = vol->bpb_struct.BPB_BytsPerSec / vol->fat->entry_bytes;
+    int best = -1, best_len = 0;
+    int start = -1, len = 0;
+    int cluster = vol->next_free_hint;
+    int scanned = 0;
+    while (scanned < vol->CountofClusters && best_len < want)  {
+        if (cluster >= vol->CountofClusters + 2) {
+            cluster = 2;
+            len = 0;
         }
-    } else  {
-        if (strlen(source) < 11)    {
-            strncpy(dest, source, strlen(source));
-            int i;
-            for (i = strlen(source); i < 11; i ++)
-                dest[i] = 0x20;
+        int word = cluster / 32;
+        if (!vol->fat_sec_loaded[word * 32 / per_sec])
+            fat_sector(vol, word * 32 / per_sec);
+
+        //Step over the stretch of free or used clusters that starts at
+        //cluster, up to the end of its bitmap word
+        unsigned int bits = vol->free_bitmap[word] >> (cluster % 32);
+        int n;
+        if (bits & 1)   {
+            n = ~bits == 0 ? 32 : __builtin_ctz(~bits);
+            if (len == 0)
+                start = cluster;
+            len += n;
+            if (len > best_len) {
+                best = start;
+                best_len = len < want ? len : want;
+            }
         } else  {
-            strncpy(dest, source, 11);
+            n = bits == 0 ? 32 - cluster % 32 : __builtin_ctz(bits);
+            len = 0;
         }
+        cluster += n;
+        scanned += n;
     }
-}
 
-void wide_strcat(char * dest, const short int * source, int len) {
-    char buff[len + 1];
-    buff[len] = '\0';
-    int i;
-    for(i = 0; i < len; i ++)   {
-        if(source[i] == 0x0000 || source[i] == -1)  {   //Padded with -1 or null terminated
-            buff[i] = '\0';
-            break;
-        }
-        buff[i] = (char)(source[i]);
-    }
-    strcat(dest, buff);
+    if (best == -1)
+        return -1;
+    *length = best_len;
+    vol->next_free_hint = best + best_len;
+    if (vol->next_free_hint >= vol->CountofClusters + 2)
+        vol->next_free_hint = 2;
+    return best;
 }
 
 /**
-* Find a directory entry matching a desired name.
-* @param dest The destination for the matching directory entry
-* @param current The current set of directory entries
-* @param name The name to be matched
-* @param directory 1 if the entry searched for must be a directory
-* @return 1 if it is found, 0 otherwise 
+* Page in the whole FAT and count the available clusters from the free
+* cluster bitmap. Data clusters are numbered 2 through CountofClusters + 1.
+* @param vol The volume
+* @return The number of free clusters
 */
-int findDirEntry(dirEnt * dest, const dirEnt * current, char * name, int directory)    {
-    int i = 0;
-    char * lfilename = NULL;
-    while(1)    {
-        dirEnt de = current[i];
-        i ++;
-        if (de.dir_name[0] == 0)    //No more entries in directory
-            break;
-        if (de.dir_name[0] == 0xE5) //Unused entry
-            continue;
+int count_free_clusters(fat_volume * vol)   {
+    int sec;
+    for (sec = 0; sec < vol->fat_num_sec; sec ++)    {
+        if (!vol->fat_sec_loaded[sec])
+            fat_sector(vol, sec);
+    }
 
-        if (de.dir_attr == 0x0F)    {   //Long filename
-            //Read in long filename
-            if(lfilename == NULL)   {
-                lfilename = malloc(sizeof(char) * 255); //FAT spec says max length is 255
-                lfilename[0] = '\0';    //Null terminate for concatenations
-            }
+    int count = 0;
+    int i;
+    for (i = 0; i < vol->free_bitmap_words; i ++)
+        count += __builtin_popcount(vol->free_bitmap[i]);
+    return count;
+}
 
-            LDIR ldir = *(LDIR*)&de;
-            wide_strcat(lfilename, ldir.LDIR_Name1, 5);
-            wide_strcat(lfilename, ldir.LDIR_Name2, 6);
-            wide_strcat(lfilename, ldir.LDIR_Name3, 2);
+/**
+* Find the longest run of free clusters in the free cluster bitmap, a
+* word at a time. The whole FAT must have been paged in.
+* @param vol The volume
+* @return The number of clusters in the run
+*/
+int largest_free_run(fat_volume * vol)  {
+    int best = 0, run = 0;
+    int i;
+    for (i = 0; i < vol->free_bitmap_words; i ++)   {
+        unsigned int bits = vol->free_bitmap[i];
+        if (bits == ~0u)    {
+            run += 32;
             continue;
         }
 
-        if (lfilename == NULL)  {   //Parse the short filename
-            lfilename = malloc(sizeof(char) * 11);
-            lfilename[0] = '\0';    //Null terminate for concatenations
-            char * padding = strchr((char*)(de.dir_name), 0x20); //beginning of padding
-            if (padding == NULL || padding - (char*)(de.dir_name) > 8)
-                strncat(lfilename, (char*)(de.dir_name), 8);
-            else
-                strncat(lfilename, (char*)(de.dir_name), padding - (char*)(de.dir_name));
-            padding = strchr((char*)(de.dir_name) + 8, 0x20); //beginning of padding in extension
-            if (padding != (char*)(de.dir_name) + 8)
-                strcat(lfilename, ".");
-            if (padding == NULL)
-                strncat(lfilename, (char*)(de.dir_name) + 8, 3);
-            else
-                strncat(lfilename, (char*)(de.dir_name) + 8, padding - (char*)(de.dir_name) - 8);
-        }
-      
-        if(strcmp(lfilename, name) == 0)   {   //Filename match
-            if (!directory || (directory && de.dir_attr & 0x10))    {
-                free(lfilename);
-                *dest = de;
-                return 1;
-            }
+        run += __builtin_ctz(~bits);    //Free clusters continuing the previous run
+        if (run > best)
+            best = run;
+        if (best < 32)  {   //A longer run may lie inside the word
+            unsigned int x = bits;
+            int len = 0;
+            for (; x != 0; len ++)
+                x &= x >> 1;
+            if (len > best)
+                best = len;
         }
-
-        free(lfilename);
-        lfilename = NULL;
+        run = __builtin_clz(~bits);     //Free clusters starting the next run
     }
 
-    return 0;
+    return run > best ? run : best;
 }
 
 /**
-* Given a directory name and a current working directory, locate
-* a list of entries contained in the named directory.
-* @param path The path to the directory
-* @param current The current directory
-* @return A list of directory entries, or NULL if it doesn't exist
+* Gather the allocation statistics of a volume, paging in the whole FAT
+* @param vol The volume
+* @param stats Where the statistics are stored
+* @return 1 on success
 */
-dirEnt * findDir(const char * path, const dirEnt * current)   {
-    if (path == NULL || strlen(path) == 0)   //Base case
-        return NULL;
-
-    char *first, *remaining;
-    first = (char*) malloc(sizeof(char) * strlen(path));
-    remaining = (char*) malloc(sizeof(char) * strlen(path));
-    first = getFirstElement(first, path);
-    remaining = getRemaining(remaining, path);
-
-    //Locate first element in current directory
-    dirEnt dir_Ent;
-    if (!findDirEntry(&dir_Ent, current, first, 1)) {
-        return NULL;
-    }
-
-    //Load in next directory and recurse down
-    int cluster = (dir_Ent.dir_fstClusHI << 2) | dir_Ent.dir_fstClusLO;
-    dirEnt * next_dir = read_cluster_dirEnt(cluster);
-    dirEnt * ret = findDir(remaining, next_dir);
-    int no_more_path = (remaining == NULL || strlen(remaining) == 0);
-    free(first);
-    free(remaining);
-    if (ret == NULL && no_more_path)    {
-        return next_dir;
-    }
-    free(next_dir);
-    return ret;
+int stat_volume(fat_volume * vol, fat_stats * stats)    {
+    stats->cluster_bytes = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    stats->total_clusters = vol->CountofClusters;
+    stats->free_clusters = count_free_clusters(vol);
+    stats->largest_free_run = largest_free_run(vol);
+    scan_chains(vol, &stats->chains, &stats->contiguous_links);
+    return 1;
 }
 
 /**
-* Changes the current working directory to the specified path
-* @param path The absolute or relative path of the file
-* @return 1 on success, -1 on failure
+* Read the FAT32 FSInfo sector. If its signatures are valid and its free
+* count is in range, the free count and next free hint are trusted so that
+* the FAT does not have to be scanned at mount time.
+* @param vol The volume
+* @return 1 if the FSInfo free count can be trusted, 0 otherwise
 */
-int OS_cd(const char * path)    {
-    if(path == NULL || strlen(path) == 0)    {
-        return -1;
-    }
-
-    if (fat_fd == -1)    {   //If directory hasn't been loaded yet
-        int err = init_fat();   //Load the FAT volume
-        if (err == -1)  
-            return -1;
-    }
+int load_fsinfo(fat_volume * vol)   {
+    if (vol->fsys_type != 0x02 || vol->ebr_fat32.BPB_FSInfo <= 0)
+        return 0;
+
+    if (pread(vol->fat_fd, (char*)&vol->fsinfo, sizeof(FSInfo),
+        (off_t) vol->ebr_fat32.BPB_FSInfo * vol->bpb_struct.BPB_BytsPerSec) != sizeof(FSInfo))
+        return 0;
+    if (vol->fsinfo.FSI_LeadSig != 0x41615252 || vol->fsinfo.FSI_StrucSig != 0x61417272 ||
+        vol->fsinfo.FSI_TrailSig != (int) 0xAA550000)
+        return 0;
+    vol->fsinfo_valid = 1;
+
+    if (vol->fsinfo.FSI_Nxt_Free >= 2 && vol->fsinfo.FSI_Nxt_Free < vol->CountofClusters + 2)
+        vol->next_free_hint = vol->fsinfo.FSI_Nxt_Free;
+
+    //0xFFFFFFFF means the count is unknown
+    if (vol->fsinfo.FSI_Free_Count < 0 || vol->fsinfo.FSI_Free_Count > vol->CountofClusters)
+        return 0;
+    vol->available_clusters = vol->fsinfo.FSI_Free_Count;
+    return 1;
+}
 
-    dirEnt * current = OS_readDir(path);
-    if (current == NULL)
+/**
+* Write the free count and next free hint back to the FSInfo sector if
+* they have changed since it was last read or written.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int flush_fsinfo(fat_volume * vol)  {
+    if (!vol->fsinfo_valid)
+        return 1;
+    if (vol->fsinfo.FSI_Free_Count == vol->available_clusters &&
+        vol->fsinfo.FSI_Nxt_Free == vol->next_free_hint)
+        return 1;
+
+    vol->fsinfo.FSI_Free_Count = vol->available_clusters;
+    vol->fsinfo.FSI_Nxt_Free = vol->next_free_hint;
+    if (pwrite(vol->fat_fd, (char*)&vol->fsinfo + offsetof(FSInfo, FSI_Free_Count), 2 * sizeof(int),
+        (off_t) vol->ebr_fat32.BPB_FSInfo * vol->bpb_struct.BPB_BytsPerSec +
+        offsetof(FSInfo, FSI_Free_Count)) != 2 * sizeof(int))
         return -1;
-
-    if (cwd_entries != root_entries && cwd_entries != current)
-        free(cwd_entries);
-
-    if (path[0] == '/')
-        strcpy(cwd_path, path);
-    else
-        strcat(cwd_path, path);
-
-    cwd_entries = current;
-    cwd_cluster = readDir_cluster;
     return 1;
 }
 
 /**
-* Opens a file specified by path to be read/written to
-* @param path The absolute or relative path of the file
-* @return The file descriptor to be used, or -1 on failure
+* Body of the background thread that validates the free count taken from
+* FSInfo. It reads the on-disk FAT with pread into a private buffer, so it
+* never touches the shared FAT cache or the file offset of fat_fd.
+* @param arg The volume
+* @return NULL
 */
-int OS_open(const char * path)  {
-    if (fat_fd == -1)    {   //If directory hasn't been loaded yet
-        int err = init_fat();   //Load the FAT volume
-        if (err == -1)  
-            return -1;
+void * verify_free_count_thread(void * arg)  {
+    fat_volume * vol = (fat_volume *) arg;
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int per_sec = bps / vol->fat->entry_bytes;
+    char * buffer = (char *) malloc(FAT_READ_SECTORS * bps);
+    unsigned int * masks = (unsigned int *) malloc(FAT_READ_SECTORS * per_sec / 32 * sizeof(unsigned int));
+    int count = 0;
+    int sec;
+    for (sec = 0; sec < vol->fat_num_sec; sec += FAT_READ_SECTORS)   {
+        int nsec = vol->fat_num_sec - sec < FAT_READ_SECTORS ? vol->fat_num_sec - sec : FAT_READ_SECTORS;
+        pread(vol->fat_fd, buffer, nsec * bps, (off_t)(vol->fat_first_sec + sec) * bps);
+        int group = sec * per_sec / 32;
+        int ngroups = nsec * per_sec / 32;
+        if (group + ngroups > vol->free_bitmap_words)
+            ngroups = vol->free_bitmap_words - group;
+        if (ngroups <= 0)
+            break;
+        scan_free(vol, buffer, ngroups, masks);
+        clip_free_masks(vol, group, ngroups, masks);
+        int i;
+        for (i = 0; i < ngroups; i ++)
+            count += __builtin_popcount(masks[i]);
     }
+    free(buffer);
+    free(masks);
 
-    //Get the file name and the path name
-    char * filename = malloc(sizeof(char) * strlen(path));
-    char * pathname = malloc(sizeof(char) * strlen(path));
-    char * buff = malloc(sizeof(char) * strlen(path));
-    pathname = getRemaining(pathname, path);
-    filename = getFirstElement(filename, path);
-
-    while (pathname != NULL) {
-        buff = pathname;
-        filename = getFirstElement(filename, buff);
-        pathname = getRemaining(pathname, buff);
-    }
+    vol->verify_free_count = count;
+    vol->verify_flush_count = __atomic_load_n(&vol->fat_flush_count, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&vol->verify_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    free(buff);
+/**
+* Apply the result of the background free count validation, if it has
+* finished. The on-disk FAT only matches the state trusted at mount time
+* if nothing was flushed while it was being scanned, so the result is
+* discarded otherwise. Any drift is corrected in available_clusters and
+* reaches FSInfo on the next flush.
+* @param vol The volume
+*/
+void apply_verified_free_count(fat_volume * vol)    {
+    if (__atomic_load_n(&vol->verify_done, __ATOMIC_ACQUIRE) != 1)
+        return;
+    pthread_join(vol->verify_thread, NULL);
+    vol->verify_done = 2;
+    if (vol->verify_flush_count == 0)
+        vol->available_clusters += vol->verify_free_count - vol->mount_free_count;
+}
 
-    pathname = malloc(sizeof(char) * strlen(path));
-    int pathlen = strstr(path, filename) - path;
-    strncpy(pathname, path, pathlen);
-    pathname[pathlen] = '\0';
+/*
+* Set the FAT table entry for a given cluster to a specified value.
+* Only the in-memory FAT is updated; the sector is marked dirty and
+* reaches the volume on the next call to flush_fat.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int set_cluster_value(fat_volume * vol, int cluster, int value)   {
+    return vol->fat->set_entry(vol, cluster, value);
+}
 
-    dirEnt * current = OS_readDir(pathname);
+/**
+* Chain a run of free clusters together in the FAT, ending the chain at the
+* last one
+* @param vol The volume
+* @param start The first cluster of the run, as found by find_free_run
+* @param length The number of clusters in the run
+*/
+void set_cluster_run(fat_volume * vol, int start, int length) {
+    vol->fat->set_run(vol, start, length);
+}
 
-    if (current == NULL)
-        return -1;
+/**
+* Free a cluster chain, and the clusters it continues to, in one batched
+* update of the in-memory FAT
+* @param vol The volume
+* @param cluster The first cluster to free; 0 frees nothing
+* @return The number of clusters freed
+*/
+int free_cluster_chain(fat_volume * vol, int cluster) {
+    return vol->fat->free_chain(vol, cluster);
+}
 
-    dirEnt file;
-    if (!findDirEntry(&file, current, filename, 0)) {
-        return -1;
+/**
+* Write the dirty sectors of the in-memory FAT back to every copy of the
+* FAT on the volume. Runs of consecutive dirty sectors are written with a
+* single call per copy, and the FAT32 FSInfo sector is brought up to date.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int flush_fat(fat_volume * vol) {
+    apply_verified_free_count(vol);
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int sec = vol->fat_dirty_lo;
+    while (sec < vol->fat_dirty_hi)  {
+        if (!vol->fat_sec_dirty[sec])    {
+            sec ++;
+            continue;
+        }
+        int count = 0;
+        while (sec + count < vol->fat_dirty_hi && vol->fat_sec_dirty[sec + count])
+            count ++;
+        int copy;
+        for (copy = 0; copy < vol->fat_copies; copy ++)  {
+            off_t pos = (off_t)(vol->fat_first_sec + copy * vol->fat_num_sec + sec) * bps;
+            if (vol->volume_map != NULL)    {   //A mapped FAT is updated in place
+                if (copy > 0)
+                    memcpy(vol->volume_map + pos, vol->fat_table + sec * bps, count * bps);
+            } else if (pwrite(vol->fat_fd, vol->fat_table + sec * bps, count * bps, pos) != count * bps)   {
+                return -1;
+            }
+        }
+        memset(vol->fat_sec_dirty + sec, 0, count);
+        sec += count;
     }
 
-    free(current);  //Avoid memory leaks
-
-    //Find the first available file descriptor
-    int fd = 0;
-    while (fd < NUM_FD && fd_base[fd] != -1)
-        fd ++;
-
-    fd_base[fd] = (file.dir_fstClusHI << 2) | (file.dir_fstClusLO);
-    fd_dirEnt[fd] = file;
-    fd_parent_cluster[fd] = readDir_cluster;
+    if (vol->fat_dirty_lo < vol->fat_dirty_hi)
+        __atomic_add_fetch(&vol->fat_flush_count, 1, __ATOMIC_RELEASE);
+    vol->fat_dirty_lo = vol->fat_num_sec;
+    vol->fat_dirty_hi = 0;
+    return flush_fsinfo(vol);
+}
 
-    return fd;
+/**
+* Read from the volume at a byte offset, bypassing the block cache
+* @param vol The volume
+* @param buf The buffer to read into
+* @param nbytes The number of bytes to read
+* @param offset The byte offset on the volume
+* @return The number of bytes read, or -1 on failure
+*/
+int volume_read(fat_volume * vol, void * buf, int nbytes, off_t offset)  {
+    if (vol->volume_map != NULL) {
+        if (offset >= vol->volume_size)
+            return 0;
+        if (nbytes > vol->volume_size - offset)
+            nbytes = vol->volume_size - offset;
+        memcpy(buf, vol->volume_map + offset, nbytes);
+        return nbytes;
+    }
+    return pread(vol->fat_fd, buf, nbytes, offset);
 }
 
 /**
-* Close an opened file specified by fd
-* @param fd The file descriptor of the file to be closed
-* @preturn 1 on success, -1 on failure
+* Write to the volume at a byte offset, bypassing the block cache
+* @param vol The volume
+* @param buf The bytes to write
+* @param nbytes The number of bytes to write
+* @param offset The byte offset on the volume
+* @return The number of bytes written, or -1 on failure
 */
-int OS_close(int fd) {
-    if (fat_fd == -1)    {   //If directory hasn't been loaded yet
-        int err = init_fat();   //Load the FAT volume
-        if (err == -1)  
+int volume_write(fat_volume * vol, const void * buf, int nbytes, off_t offset)   {
+    if (vol->volume_map != NULL) {
+        if (offset >= vol->volume_size)
             return -1;
+        if (nbytes > vol->volume_size - offset)
+            nbytes = vol->volume_size - offset;
+        memcpy(vol->volume_map + offset, buf, nbytes);
+        return nbytes;
     }
+    return pwrite(vol->fat_fd, buf, nbytes, offset);
+}
 
-    if (fd < 0 || fd > NUM_FD || fd_base[fd] == -1)
-        return -1;
+/**
+* Read a contiguous part of the volume into several buffers with one call
+* @param vol The volume
+* @param iov The buffers, filled in order
+* @param iovcnt The number of buffers
+* @param offset The byte offset on the volume
+* @return The number of bytes read, or -1 on failure
+*/
+int volume_readv(fat_volume * vol, const struct iovec * iov, int iovcnt, off_t offset)  {
+    if (vol->volume_map != NULL) {
+        int done = 0;
+        int i;
+        for (i = 0; i < iovcnt; i ++)   {
+            int count = volume_read(vol, iov[i].iov_base, iov[i].iov_len, offset + done);
+            if (count <= 0)
+                break;
+            done += count;
+        }
+        return done;
+    }
+    return preadv(vol->fat_fd, iov, iovcnt, offset);
+}
 
-    
-    fd_base[fd] = -1;
-    free(fd_path[fd]);
+/**
+* Write several buffers to a contiguous part of the volume with one call
+* @param vol The volume
+* @param iov The buffers, written in order
+* @param iovcnt The number of buffers
+* @param offset The byte offset on the volume
+* @return The number of bytes written, or -1 on failure
+*/
+int volume_writev(fat_volume * vol, const struct iovec * iov, int iovcnt, off_t offset) {
+    if (vol->volume_map != NULL) {
+        int done = 0;
+        int i;
+        for (i = 0; i < iovcnt; i ++)   {
+            int count = volume_write(vol, iov[i].iov_base, iov[i].iov_len, offset + done);
+            if (count <= 0)
+                break;
+            done += count;
+        }
+        return done;
+    }
+    return pwritev(vol->fat_fd, iov, iovcnt, offset);
+}
+
+/**
+* Ask the kernel to start reading part of the volume in the background so a
+* later read of it does not wait on the disk
+* @param vol The volume
+* @param nbytes The number of bytes to prefetch
+* @param offset The byte offset on the volume
+*/
+void volume_prefetch(fat_volume * vol, int nbytes, off_t offset)    {
+    if (vol->volume_map != NULL) {
+        long page = sysconf(_SC_PAGESIZE);
+        off_t start = offset & ~(off_t)(page - 1);
+        if (start >= vol->volume_size)
+            return;
+        if (offset + nbytes > vol->volume_size)
+            nbytes = vol->volume_size - offset;
+        madvise(vol->volume_map + start, offset - start + nbytes, MADV_WILLNEED);
+        return;
+    }
+    posix_fadvise(vol->fat_fd, offset, nbytes, POSIX_FADV_WILLNEED);
+}
 
+/**
+* Map the whole volume into memory if the FAT_MMAP environment variable is
+* set. FAT_MMAP=sequential or FAT_MMAP=hugepage also pass the matching
+* madvise hint. If the image cannot be mapped, the library silently falls
+* back to reading and writing through fat_fd. A read-only volume is
+* mapped read-only, unless journal transactions not yet on the image are
+* pending: then it is always mapped, privately, so they can be applied to
+* the mapping without reaching the image.
+* @param vol The volume
+* @return 1 if the volume is mapped, 0 otherwise
+*/
+int map_volume(fat_volume * vol)    {
+    char * mode = getenv("FAT_MMAP");
+    int overlay = vol->journal_pending == 1;
+    if (!overlay && (mode == NULL || strcmp(mode, "0") == 0))
+        return 0;
+    if (vol->journal_fd != -1)  //Mapped pages reach the image in no set order
+        return 0;
+
+    struct stat st;
+    if (fstat(vol->fat_fd, &st) == -1)
+        return 0;
+    vol->volume_size = st.st_size;
+    if (vol->volume_size == 0)   //Block devices report their size through lseek
+        vol->volume_size = lseek(vol->fat_fd, 0, SEEK_END);
+    if (vol->volume_size <= 0)
+        return 0;
+
+    int prot = vol->read_only && !overlay ? PROT_READ : PROT_READ | PROT_WRITE;
+    char * map = mmap(NULL, vol->volume_size, prot, overlay ? MAP_PRIVATE : MAP_SHARED, vol->fat_fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    if (mode != NULL && strcmp(mode, "sequential") == 0)
+        madvise(map, vol->volume_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    else if (mode != NULL && strcmp(mode, "hugepage") == 0)
+        madvise(map, vol->volume_size, MADV_HUGEPAGE);
+#endif
+    vol->volume_map = map;
     return 1;
 }
 
 /**
-* Read nbytes of a file from offset into buf
-* @param fildes A previously opened file
-* @param buf A buffer of at least nbyte size
-* @param nbyte The number of bytes to read
-* @param offset The offset in the file to begin reading
-* @return The number of bytes read, or -1 otherwise
+* Size the block cache from the FAT_CACHE_KB environment variable and
+* allocate its hash table
+* @param vol The volume
 */
-int OS_read(int fildes, void * buf, int nbyte, int offset)  {
-    if (fat_fd == -1)    {   //If directory hasn't been loaded yet
-        int err = init_fat();   //Load the FAT volume
-        if (err == -1)  
-            return -1;
-    }
+void cache_init(fat_volume * vol)   {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    char * budget = getenv("FAT_CACHE_KB");
+    long kb = budget != NULL ? atol(budget) : CACHE_DEFAULT_KB;
+    vol->cache_max_blocks = kb * 1024 / bytesPerClus;
+    if (vol->cache_max_blocks < 16)
+        vol->cache_max_blocks = 16;
+
+    vol->cache_nbuckets = 1;
+    while (vol->cache_nbuckets < 2 * vol->cache_max_blocks)
+        vol->cache_nbuckets *= 2;
+    vol->cache_buckets = (cache_block **) calloc(vol->cache_nbuckets, sizeof(cache_block *));
+    vol->cache_mru = NULL;
+    vol->cache_lru = NULL;
+    vol->cache_count = 0;
+}
 
-    if (fildes < 0 || fildes > NUM_FD || fd_base[fildes] == -1)
-        return -1;
+/**
+* Find the first sector of the cache block that holds a given sector
+* @param vol The volume
+* @param sector The sector on the volume
+* @return The first sector of its block
+*/
+int block_start(fat_volume * vol, int sector) {
+    if (sector < vol->data_sec)
+        return sector;
+    return sector - (sector - vol->data_sec) % vol->bpb_struct.BPB_SecPerClus;
+}
 
-    int bytesPerClus = bpb_struct.BPB_SecPerClus * bpb_struct.BPB_BytsPerSec;
+/**
+* Look up a block in the cache without changing its position in the LRU list
+* @param vol The volume
+* @param sector The first sector of the block
+* @return The cached block, or NULL if it is not cached
+*/
+cache_block * cache_find(fat_volume * vol, int sector)    {
+    cache_block * b = vol->cache_buckets[sector & (vol->cache_nbuckets - 1)];
+    while (b != NULL && b->sector != sector)
+        b = b->hash_next;
+    return b;
+}
 
-    //Calculate offset in cluster and how many links on cluster chain to follow
-    int cluster_offset = offset % bytesPerClus;
-    int cluster_num = offset / bytesPerClus; 
-    int cluster = fd_base[fildes];
+/**
+* Unlink a block from the LRU list
+* @param vol The volume
+* @param b The block to unlink
+*/
+void lru_remove(fat_volume * vol, cache_block * b)    {
+    if (b->lru_prev != NULL)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        vol->cache_mru = b->lru_next;
+    if (b->lru_next != NULL)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        vol->cache_lru = b->lru_prev;
+}
 
-    int count = 0;  //Count tracks the number of cluster chains reached
-    while(count < cluster_num)  {
-        int next = value_in_FAT(cluster);
-        if (fsys_type == 0x01 && cluster >= 0xFFF8)
-            break;
-        if (fsys_type == 0x02 && cluster >= 0x0FFFFFF8)
-            break;
-        cluster = next;
-        count ++;
-    }
+/**
+* Put a block at the most recently used end of the LRU list
+* @param vol The volume
+* @param b The block that was just used
+*/
+void lru_push(fat_volume * vol, cache_block * b)  {
+    b->lru_prev = NULL;
+    b->lru_next = vol->cache_mru;
+    if (vol->cache_mru != NULL)
+        vol->cache_mru->lru_prev = b;
+    vol->cache_mru = b;
+    if (vol->cache_lru == NULL)
+        vol->cache_lru = b;
+}
 
-    if (count < cluster_num)    //Reached end of cluster chain before offset
+/**
+* Write a dirty block back to the volume
+* @param vol The volume
+* @param b The block to write back
+* @return 1 on success, -1 on failure
+*/
+int cache_writeback(fat_volume * vol, cache_block * b)    {
+    int nbytes = b->nsec * vol->bpb_struct.BPB_BytsPerSec;
+    if (volume_write(vol, b->data, nbytes, (off_t) b->sector * vol->bpb_struct.BPB_BytsPerSec) != nbytes)
         return -1;
+    b->dirty = 0;
+    return 1;
+}
 
-    int bytesRead = 0;   //Tracks the number of bytes read
-    count = -1;
-
-    //Seek to sector of cluster and cluster offset
-    int sector = (cluster - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-    lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec + cluster_offset, SEEK_SET);
-
-    int untilEOF = fd_dirEnt[fildes].dir_fileSize - bytesRead - offset;
-    int untilEOC = bytesPerClus - cluster_offset - bytesRead;
-
-    //Break if we've read the number of bytes or we count 0 bytes read -> end of file
-    while (bytesRead < nbyte && count != 0 && untilEOF > 0)  {
-        //Read either nbytes or until end of cluster or until end of file
-        if (untilEOF < untilEOC && untilEOF < (nbyte - bytesRead))  {
-            count = read(fat_fd, buf + bytesRead, untilEOF);
-        } else if (untilEOF > (nbyte - bytesRead) && (nbyte - bytesRead) < untilEOC)    {
-            count = read(fat_fd, buf + bytesRead, nbyte - bytesRead);
-        } else  {
-            count = read(fat_fd, buf + bytesRead, untilEOC);
-            //Go to next cluster
-            cluster = value_in_FAT(cluster);
-            if (fsys_type == 0x01 && cluster >= 0xFFF8)
-                break;
-            if (fsys_type == 0x02 && cluster >= 0x0FFFFFF8)
-                break;
-            sector = (cluster - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-            lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-            cluster_offset = 0;
-            untilEOC = bytesPerClus + count;
-        }
-        bytesRead += count;
-        untilEOF -= count;
-        untilEOC -= count;
+/**
+* Evict the least recently used block, writing it back first if dirty. With
+* a journal, the least recently used clean block is evicted instead.
+* @param vol The volume
+* @return The evicted block, which the caller may reuse, or NULL
+*/
+cache_block * cache_evict(fat_volume * vol) {
+    cache_block * b = vol->cache_lru;
+    if (vol->journal_fd != -1)  {
+        //Dirty blocks may not reach the volume before the journal holds
+        //them, so they stay cached until the next commit
+        while (b != NULL && b->dirty)
+            b = b->lru_prev;
     }
-
-    return bytesRead;
+    if (b == NULL)
+        return NULL;
+    if (b->dirty)
+        cache_writeback(vol, b);
+
+    lru_remove(vol, b);
+    cache_block ** link = &vol->cache_buckets[b->sector & (vol->cache_nbuckets - 1)];
+    while (*link != b)
+        link = &(*link)->hash_next;
+    *link = b->hash_next;
+    vol->cache_count --;
+    return b;
 }
 
 /**
-* Gives a list of directory entries contained in a directory
-* @param dirname The path to the directory
-* @return An array of dirEnts
+* Get a block from the cache, adding it if it is not cached yet. The block
+* becomes the most recently used one.
+* @param vol The volume
+* @param sector The first sector of the block
+* @param load 1 if a newly added block must be read from the volume, 0 if
+*   the caller is about to overwrite all of it
+* @return The cached block
 */
-dirEnt * OS_readDir(const char * dirname)  {
-    if (fat_fd == -1)    {   //If directory hasn't been loaded yet
-        int err = init_fat();   //Load the FAT volume
-        if (err == -1)  
-            return NULL;
+cache_block * cache_get(fat_volume * vol, int sector, int load)   {
+    cache_block * b = cache_find(vol, sector);
+    if (b != NULL)  {
+        lru_remove(vol, b);
+        lru_push(vol, b);
+        return b;
     }
 
-    dirEnt * current = cwd_entries;
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    if (vol->cache_count >= vol->cache_max_blocks)
+        b = cache_evict(vol);
+    if (b == NULL)  {
+        b = (cache_block *) malloc(sizeof(cache_block));
+        b->data = (char *) malloc(bytesPerClus);
+    }
 
-    const char * truncated_dirname;
-    int at_root = 0;
+    b->sector = sector;
+    b->nsec = sector < vol->data_sec ? 1 : vol->bpb_struct.BPB_SecPerClus;
+    b->dirty = 0;
+    if (load)
+        volume_read(vol, b->data, b->nsec * vol->bpb_struct.BPB_BytsPerSec,
+            (off_t) sector * vol->bpb_struct.BPB_BytsPerSec);
+
+    int bucket = sector & (vol->cache_nbuckets - 1);
+    b->hash_next = vol->cache_buckets[bucket];
+    vol->cache_buckets[bucket] = b;
+    lru_push(vol, b);
+    vol->cache_count ++;
+    return b;
+}
 
-    //If absolute path name start path at /
-    if (dirname[0] == '/') {
-        at_root = 1;
-        current = read_cluster_dirEnt(0);   //Read in cluster 0, which represents root
-        truncated_dirname = dirname + 1;
-    } else  {
-        truncated_dirname = dirname;
-    }
+/**
+* Read from the volume through the block cache. Blocks that are cached are
+* copied from memory. With bypass set, runs of whole data blocks that are
+* not cached are read straight into buf so that large reads do not flush
+* the cache; everything else is loaded into the cache first, with the
+* following uncached blocks of the range gathered into one call. A mapped
+* volume is read directly, and so is a read-only one, whose FAT and
+* directories are held in memory already and whose readers take no locks.
+* cache_lock is dropped around direct reads so concurrent readers only
+* serialize on cache hits and misses.
+* @param vol The volume
+* @param buf The buffer to read into
+* @param nbytes The number of bytes to read
+* @param offset The byte offset on the volume
+* @param bypass 1 to read uncached whole blocks directly
+* @return The number of bytes read, or -1 on failure
+*/
+int cache_read(fat_volume * vol, void * buf, int nbytes, off_t offset, int bypass)    {
+    if (vol->volume_map != NULL || vol->read_only) //The mapping already is a cache of the whole volume
+        return volume_read(vol, buf, nbytes, offset);
+
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int done = 0;
+    while (done < nbytes)   {
+        off_t pos = offset + done;
+        int start = block_start(vol, pos / bps);
+        int blockBytes = (start < vol->data_sec ? 1 : vol->bpb_struct.BPB_SecPerClus) * bps;
+        int in_block = pos - (off_t) start * bps;
+        int len = blockBytes - in_block;
+        if (len > nbytes - done)
+            len = nbytes - done;
+
+        pthread_mutex_lock(&vol->cache_lock);
+        cache_block * b = cache_find(vol, start);
+        if (b == NULL && bypass && start >= vol->data_sec && len == blockBytes)  {
+            //Extend the direct read over the following uncached whole blocks
+            while (len + blockBytes <= nbytes - done &&
+                cache_find(vol, start + len / bps) == NULL)
+                len += blockBytes;
+            pthread_mutex_unlock(&vol->cache_lock);
+            int count = volume_read(vol, (char*)buf + done, len, pos);
+            if (count <= 0)
+                return done > 0 ? done : -1;
+            done += count;
+            continue;
+        }
 
-    dirEnt * ret = findDir(truncated_dirname, current);
-    if (ret == NULL && strlen(truncated_dirname) == 0)  {
-        return current;
-    }
-    else if (ret == NULL)   {
-        if (at_root)
-            free(current);
-        return NULL;
+        if (b == NULL)  {
+            //Add the uncached blocks that the rest of the range covers and
+            //load them all with one vectored read
+            cache_block * blocks[CACHE_GATHER_MAX];
+            struct iovec iov[CACHE_GATHER_MAX];
+            int n = 0, sector = start, covered = -in_block;
+            do  {
+                blocks[n] = cache_get(vol, sector, 0);
+                iov[n].iov_base = blocks[n]->data;
+                iov[n].iov_len = blocks[n]->nsec * bps;
+                covered += iov[n].iov_len;
+                sector += blocks[n]->nsec;
+                n ++;
+            } while (n < CACHE_GATHER_MAX && n < vol->cache_max_blocks / 2 &&
+                covered < nbytes - done && cache_find(vol, sector) == NULL &&
+                (sector >= vol->data_sec) == (start >= vol->data_sec));
+            int count = volume_readv(vol, iov, n, (off_t) start * bps);
+            int i;
+            for (i = 0; i < n; i ++)    {   //Keep a short read from leaving garbage cached
+                if (count < (int) iov[i].iov_len)
+                    memset((char*)iov[i].iov_base + (count > 0 ? count : 0), 0,
+                        iov[i].iov_len - (count > 0 ? count : 0));
+                count -= iov[i].iov_len;
+            }
+            b = blocks[0];
+        }
+        else
+            b = cache_get(vol, start, 1);
+        memcpy((char*)buf + done, b->data + in_block, len);
+        pthread_mutex_unlock(&vol->cache_lock);
+        done += len;
     }
-    if (at_root)
-        free(current);
-    return ret;
+    return done;
 }
 
 /**
-* Write at a cluster number, updating the FAT and going to another cluster if
-* necessary.
-* @param cluster The cluster number to be written to
-* @param buf The buffer of bytes to be written
+* Write to the volume through the block cache. Written blocks are marked
+* dirty and reach the volume when they are evicted or on OS_sync. With
+* bypass set, runs of whole data blocks that are not cached are written
+* straight to the volume. A mapped volume is written directly. Only called
+* with the volume lock held exclusively, so cache_lock is not needed.
+* @param vol The volume
+* @param buf The bytes to write
 * @param nbytes The number of bytes to write
-* @param offset The offset at which to write
+* @param offset The byte offset on the volume
+* @param bypass 1 to write uncached whole blocks directly
 * @return The number of bytes written, or -1 on failure
 */
-int write_cluster(int cluster, const void * buf, int nbytes, int offset)  {
-    int bytesPerClus = bpb_struct.BPB_SecPerClus * bpb_struct.BPB_BytsPerSec;
-
-    int cluster_offset = offset % bytesPerClus;
-    int cluster_num = offset / bytesPerClus;
+int cache_write(fat_volume * vol, const void * buf, int nbytes, off_t offset, int bypass) {
+    if (vol->volume_map != NULL)
+        return volume_write(vol, buf, nbytes, offset);
+
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int done = 0;
+    while (done < nbytes)   {
+        off_t pos = offset + done;
+        int start = block_start(vol, pos / bps);
+        int blockBytes = (start < vol->data_sec ? 1 : vol->bpb_struct.BPB_SecPerClus) * bps;
+        int in_block = pos - (off_t) start * bps;
+        int len = blockBytes - in_block;
+        if (len > nbytes - done)
+            len = nbytes - done;
+
+        cache_block * b = cache_find(vol, start);
+        if (b == NULL && bypass && start >= vol->data_sec && len == blockBytes)  {
+            while (len + blockBytes <= nbytes - done &&
+                cache_find(vol, start + len / bps) == NULL)
+                len += blockBytes;
+            int count = volume_write(vol, (const char*)buf + done, len, pos);
+            if (count <= 0)
+                return done > 0 ? done : -1;
+            done += count;
+            continue;
+        }
 
-    int count = 0;
-    while(count < cluster_num)  {
-        int next = value_in_FAT(cluster);
-        if (fsys_type == 0x01 && cluster >= 0xFFF8)
-            break;
-        if (fsys_type == 0x02 && cluster >= 0x0FFFFFF8)
-            break;
-        cluster = next;
-            count ++;
+        //A block that is about to be overwritten whole need not be read first
+        b = cache_get(vol, start, len != blockBytes);
+        memcpy(b->data + in_block, (const char*)buf + done, len);
+        b->dirty = 1;
+        done += len;
     }
+    return done;
+}
 
-    if (count < cluster_num)
-        return -1;
-
-    int bytesWritten = 0; //Tracks the number of bytes written
-    count = -1;
+/**
+* Compare two cached blocks by their position on the volume
+*/
+int compare_blocks(const void * a, const void * b)  {
+    return (*(cache_block **) a)->sector - (*(cache_block **) b)->sector;
+}
 
-    //Seek to sector of cluster and cluster offset
-    int sector = (cluster - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-    if (cluster == 0)   {
-        if (fsys_type == 0x01)
-            sector = root_sec;
-        else if (fsys_type == 0x02)
-            sector = (ebr_fat32.BPB_RootClus - 2) * bpb_struct.BPB_SecPerClus + data_sec;
+/**
+* Write every dirty block in the cache back to the volume in on-disk order.
+* Dirty blocks that are adjacent on the volume are written with one call.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int cache_flush(fat_volume * vol)   {
+    if (vol->cache_count == 0)
+        return 1;
+    cache_block ** dirty = (cache_block **) malloc(sizeof(cache_block *) * vol->cache_count);
+    int count = 0;
+    cache_block * b;
+    for (b = vol->cache_mru; b != NULL; b = b->lru_next)  {
+        if (b->dirty)
+            dirty[count ++] = b;
     }
-    lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec + cluster_offset, SEEK_SET);
-
-    int untilEOC = bytesPerClus - cluster_offset - bytesWritten;
-    int required_clusters = (nbytes - untilEOC) / bytesPerClus;
-    if (available_clusters < required_clusters) //Break if we won't have enough space
-        return -1;
 
-    //Only break if we've written the number of bytes required
-    while (bytesWritten < nbytes)  {
-        if ((nbytes - bytesWritten) < untilEOC) {
-            count = write(fat_fd, buf + bytesWritten, nbytes - bytesWritten);
-        } else  {
-            count = write(fat_fd, buf + bytesWritten, untilEOC);
-            //Find next cluster
-            int next_cluster = find_free_cluster();
-            set_cluster_value(cluster, next_cluster);
-            set_cluster_value(next_cluster, -1);
-            cluster = next_cluster;
-            sector = (cluster - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-            lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-            cluster_offset = 0;
-            untilEOC = bytesPerClus + count;
-            available_clusters --;
+    qsort(dirty, count, sizeof(cache_block *), compare_blocks);
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int ret = 1;
+    int i = 0;
+    while (i < count)   {
+        struct iovec iov[CACHE_GATHER_MAX];
+        int n = 0, nbytes = 0;
+        do  {
+            iov[n].iov_base = dirty[i + n]->data;
+            iov[n].iov_len = dirty[i + n]->nsec * bps;
+            nbytes += iov[n].iov_len;
+            n ++;
+        } while (n < CACHE_GATHER_MAX && i + n < count &&
+            dirty[i + n]->sector == dirty[i + n - 1]->sector + dirty[i + n - 1]->nsec);
+
+        if (volume_writev(vol, iov, n, (off_t) dirty[i]->sector * bps) != nbytes)
+            ret = -1;
+        else    {
+            int j;
+            for (j = 0; j < n; j ++)
+                dirty[i + j]->dirty = 0;
         }
-        bytesWritten += count;
-        untilEOC -= count;
+        i += n;
     }
+    free(dirty);
+    return ret;
+}
 
-    return bytesWritten;
+/**
+* Continue an FNV-1a hash over a range of bytes
+* @param hash The hash so far
+* @param data The bytes
+* @param len The number of bytes
+* @return The new hash
+*/
+unsigned int journal_hash(unsigned int hash, const void * data, size_t len) {
+    const unsigned char * p = (const unsigned char *) data;
+    size_t i;
+    for (i = 0; i < len; i ++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
 }
 
 /**
-* Find the index at which entry is located in the cluster. This includes
-* entries of 0xE5.
-* @param cluster The cluster to be examined
-* @param entry The entry to be searched for
-* @return The index, or -1 * the number of entries looked at if it isn't found
+* Write the new contents of every changed metadata range to the journal as
+* one transaction, and wait until it is on stable storage. The ranges are
+* the dirty FAT sectors, the FSInfo counts and the dirty blocks of the
+* block cache. Once this returns, they may be written in place in any order.
+* The transaction goes after those of earlier commits, which must be kept
+* until a flush has put them on the image: a failed flush may already have
+* marked some of their ranges clean.
+* @param vol The volume
+* @return 1 on success or if there is no journal, -1 on failure
 */
-int find_dirEnt_match(int cluster, dirEnt entry)    {
-    int curr = cluster;
-    int sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
+int journal_commit(fat_volume * vol)    {
+    if (vol->journal_fd == -1)
+        return 1;
+
+    apply_verified_free_count(vol);
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int max = vol->cache_count + 1;
+    if (vol->fat_dirty_hi > vol->fat_dirty_lo)
+        max += (vol->fat_dirty_hi - vol->fat_dirty_lo) * vol->fat_copies;
+    journal_record * records = (journal_record *) calloc(max, sizeof(journal_record));
+    struct iovec * iov = (struct iovec *) malloc(sizeof(struct iovec) * (max + 2));
+    int n = 0;
+
+    //Runs of dirty FAT sectors, once for every copy of the FAT
+    int sec = vol->fat_dirty_lo;
+    while (sec < vol->fat_dirty_hi)  {
+        if (!vol->fat_sec_dirty[sec])    {
+            sec ++;
+            continue;
+        }
+        int count = 0;
+        while (sec + count < vol->fat_dirty_hi && vol->fat_sec_dirty[sec + count])
+            count ++;
+        int copy;
+        for (copy = 0; copy < vol->fat_copies; copy ++)  {
+            records[n].offset = (long long)(vol->fat_first_sec + copy * vol->fat_num_sec + sec) * bps;
+            records[n].length = count * bps;
+            iov[n + 2].iov_base = vol->fat_table + sec * bps;
+            n ++;
+        }
+        sec += count;
+    }
 
-    readDir_cluster = cluster;
+    //The FSInfo counts, as flush_fsinfo will write them
+    int fsinfo_counts[2] = { vol->available_clusters, vol->next_free_hint };
+    if (vol->fsinfo_valid && (vol->fsinfo.FSI_Free_Count != fsinfo_counts[0] ||
+        vol->fsinfo.FSI_Nxt_Free != fsinfo_counts[1]))  {
+        records[n].offset = (long long) vol->ebr_fat32.BPB_FSInfo * bps + offsetof(FSInfo, FSI_Free_Count);
+        records[n].length = sizeof(fsinfo_counts);
+        iov[n + 2].iov_base = fsinfo_counts;
+        n ++;
+    }
 
-    if (curr == 0)  {
-        if (fsys_type == 0x01)  {
-            sector = root_sec;
-        } else if (fsys_type == 0x02)   {
-            curr = ebr_fat32.BPB_RootClus;
-            readDir_cluster = curr;
-            sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-        }
+    //Dirty directory and data blocks
+    cache_block * b;
+    for (b = vol->cache_mru; b != NULL; b = b->lru_next)  {
+        if (!b->dirty)
+            continue;
+        records[n].offset = (long long) b->sector * bps;
+        records[n].length = b->nsec * bps;
+        iov[n + 2].iov_base = b->data;
+        n ++;
     }
 
-    lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-    int entry_count = 0;
-    int cluster_count = 0;
-
-    char name[12];
-    char currname[12];
-
-    strncpy(name, entry.dir_name, 11);
-    name[11] = '\0';
-    currname[11] = '\0';
-    dirEnt curr_entry;
-    while(1)    {
-        read(fat_fd, (char*)&curr_entry, sizeof(dirEnt));
-        if (curr_entry.dir_name[0] == 0) {
-            break;
+    int ret = 1;
+    if (n > 0)  {
+        journal_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = JOURNAL_MAGIC;
+        header.count = n;
+        header.checksum = journal_hash(2166136261u, records, n * sizeof(journal_record));
+        int i;
+        for (i = 0; i < n; i ++)    {
+            iov[i + 2].iov_len = records[i].length;
+            header.bytes += records[i].length;
+            header.checksum = journal_hash(header.checksum, iov[i + 2].iov_base, records[i].length);
         }
-
-        strncpy(currname, curr_entry.dir_name, 11);
-        if(strcmp(name, currname) == 0) {   //Match found
-            return entry_count;
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = records;
+        iov[1].iov_len = n * sizeof(journal_record);
+
+        off_t pos = vol->journal_end;
+        for (i = 0; i < n + 2 && ret == 1; i += JOURNAL_GATHER_MAX)  {
+            int pieces = n + 2 - i < JOURNAL_GATHER_MAX ? n + 2 - i : JOURNAL_GATHER_MAX;
+            ssize_t nbytes = 0;
+            int j;
+            for (j = 0; j < pieces; j ++)
+                nbytes += iov[i + j].iov_len;
+            if (pwritev(vol->journal_fd, iov + i, pieces, pos) != nbytes)
+                ret = -1;
+            pos += nbytes;
         }
+        if (ret == 1 && fdatasync(vol->journal_fd) == -1)
+            ret = -1;
+        if (ret == 1)
+            vol->journal_end = pos;
+        else    //Cut off what was written, so a later commit is not read as part of it
+            ftruncate(vol->journal_fd, vol->journal_end);
+    }
 
-        entry_count ++;
-        cluster_count ++;
-
-        if ((cluster_count * sizeof(dirEnt)) >= 
-            (bpb_struct.BPB_BytsPerSec * bpb_struct.BPB_SecPerClus))    {
-            curr = value_in_FAT(curr);
-            if (fsys_type == 0x01 && curr >= 0xFFF8)
-                break;
-            if (fsys_type == 0x02 && curr >= 0x0FFFFFF8)
-                break;
-            sector = (curr - 2) * bpb_struct.BPB_SecPerClus + data_sec;
-            lseek(fat_fd, sector * bpb_struct.BPB_BytsPerSec, SEEK_SET);
-            cluster_count = 0;
-        }
+    free(records);
+    free(iov);
+    return ret;
+}
 
+/**
+* Read the committed transactions at the front of a journal. Reading stops
+* at the first one that is torn or has a bad checksum: it never committed,
+* so nothing of it or of anything after it reached the image.
+* @param fd The journal
+* @param size Set to the number of bytes of committed transactions
+* @return The transactions, or NULL if there are none
+*/
+char * journal_load(int fd, size_t * size)  {
+    struct stat st;
+    *size = 0;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(journal_header))
+        return NULL;
+    char * log = (char *) malloc(st.st_size);
+    if (pread(fd, log, st.st_size, 0) != st.st_size)    {
+        free(log);
+        return NULL;
     }
 
-    return -1 * entry_count;
+    size_t pos = 0;
+    while (st.st_size - pos >= sizeof(journal_header))  {
+        journal_header header;
+        memcpy(&header, log + pos, sizeof(header));
+        size_t left = st.st_size - pos - sizeof(header);
+        if (header.magic != JOURNAL_MAGIC || header.count > left / sizeof(journal_record) ||
+            header.bytes > left - header.count * sizeof(journal_record))
+            break;
+        size_t body = header.count * sizeof(journal_record) + header.bytes;
+        if (journal_hash(2166136261u, log + pos + sizeof(header), body) != header.checksum)
+            break;
+        pos += sizeof(header) + body;
+    }
+    if (pos == 0)   {
+        free(log);
+        return NULL;
+    }
+    *size = pos;
+    return log;
 }
 
 /**
-* Overwrite a directory entry contained in a given cluster. If a
-* directory entry at path does not exist with the same name as entry, 
-* then a new one will be created.
-* @param cluster The cluster 
-* @param entry The entry to be written in the directory
-* @return 1 on success
+* Write committed journal transactions to the volume, oldest first
+* @param vol The volume
+* @param log The transactions, as read by journal_load
+* @param size The number of bytes of transactions
+* @return 1 on success, -1 on failure
 */
-int write_dirEnt(int cluster, dirEnt entry)   {
-    int i = find_dirEnt_match(cluster, entry);
-    if (i < 0)  {
-        i = -1 * i;
-        write_cluster(cluster, (void*)&entry, sizeof(dirEnt), i * sizeof(dirEnt));
-        char toWrite = '\0';
-        write_cluster(cluster, (void*)&toWrite, sizeof(char), (i+1) * sizeof(dirEnt));
-    } else  {
-        write_cluster(cluster, (void*)&entry, sizeof(dirEnt), i * sizeof(dirEnt));
+int journal_apply(fat_volume * vol, const char * log, size_t size)   {
+    size_t pos = 0;
+    while (pos < size)  {
+        journal_header header;
+        memcpy(&header, log + pos, sizeof(header));
+        const journal_record * records = (const journal_record *)(log + pos + sizeof(header));
+        const char * data = (const char *)(records + header.count);
+        unsigned int i;
+        for (i = 0; i < header.count; i ++) {
+            if (volume_write(vol, data, records[i].length, records[i].offset) != records[i].length)
+                return -1;
+            data += records[i].length;
+        }
+        pos = data - log;
     }
-
     return 1;
 }
 
 /**
-* Create a new directory entry at the specified path with 
-* the desired attribute
-* @param path The path to the entry
-* @param attr The desired dirEnt attribute
-* @return 1 if created, -1 if path is invalid, -2 if final
-*   path element already exists
+* Write the committed journal transactions left by a volume that was not
+* synced to the image, then empty the journal. Replay happens whether or
+* not FAT_JOURNAL is set now. A read-only mount uses journal_read instead.
+* @param vol The volume, whose image is open for writing
+* @param path The path of the image
+* @return 1 on success or if there was nothing to replay, -1 on failure
 */
-int create_new_dirEnt(const char * path, char attr) {
-    if (fat_fd == -1)   {
-        int err = init_fat();
-        if (err == -1)
-            return -1;
+int journal_replay(fat_volume * vol, const char * path)    {
+    char jpath[PATH_MAX];
+    snprintf(jpath, sizeof(jpath), "%s.journal", path);
+    int fd = open(jpath, O_RDWR);
+    if (fd == -1)
+        return errno == ENOENT ? 1 : -1;   //A journal that cannot be emptied would be replayed again
+
+    size_t size;
+    char * log = journal_load(fd, &size);
+    if (log == NULL)    {
+        close(fd);
+        return 1;
     }
 
-    char *filename, *pathname;
-    pathname = malloc(sizeof(char) * strlen(path));
-    filename = malloc(sizeof(char) * strlen(path));
-    separate_path(filename, pathname, path); 
+    int ret = journal_apply(vol, log, size);
+    if (ret == 1 && (fdatasync(vol->fat_fd) == -1 || ftruncate(fd, 0) == -1))
+        ret = -1;   //Replaying again later would undo newer changes
 
-    dirEnt * current = OS_readDir(pathname);
+    free(log);
+    close(fd);
+    return ret;
+}
 
+/**
+* Read the committed journal transactions left on an image for a read-only
+* mount, which changes neither the journal nor the image. If the journal
+* exists but cannot be read, journal_pending is set to 2.
+* @param vol The volume
+* @param path The path of the image
+* @param size Set to the number of bytes of committed transactions
+* @return The transactions, or NULL if there are none to apply
+*/
+char * journal_read(fat_volume * vol, const char * path, size_t * size)  {
+    char jpath[PATH_MAX];
+    snprintf(jpath, sizeof(jpath), "%s.journal", path);
+    *size = 0;
+    int fd = open(jpath, O_RDONLY);
+    if (fd == -1)   {
+        if (errno != ENOENT)
+            vol->journal_pending = 2;
+        return NULL;
+    }
+    char * log = journal_load(fd, size);
+    close(fd);
+    return log;
+}
 
-    if(current == NULL)
-        return -1;  //Invalid path
+/**
+* Given a cluster number, how many clusters does it chain to?
+* @param vol The volume
+* @param cluster The cluster number to be checked
+* @return The number of clusters in the chain
+*/
+int cluster_chain_length(fat_volume * vol, int cluster)   {
+    return vol->fat->chain_length(vol, cluster);
+}
+
+/**
+* Start an extent map for the cluster chain beginning at a given cluster
+* @param map The map to initialize
+* @param cluster The first cluster of the chain
+*/
+void extent_map_init(extent_map * map, int cluster)   {
+    map->capacity = 4;
+    map->extents = (extent *) malloc(sizeof(extent) * map->capacity);
+    map->extents[0].file_index = 0;
+    map->extents[0].cluster = cluster;
+    map->extents[0].length = 1;
+    map->count = 1;
+    map->last = 0;
+}
+
+/**
+* Release the memory held by an extent map
+* @param map The map to free
+*/
+void extent_map_free(extent_map * map)  {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+}
+
+/**
+* Add a run of clusters to the end of the mapped part of a chain, merging
+* it into the last run if it directly follows it on the volume
+* @param map The map to extend
+* @param cluster The cluster that follows the last mapped cluster
+* @param length The number of contiguous clusters starting at cluster
+*/
+void extent_map_append(extent_map * map, int cluster, int length)   {
+    extent * tail = &map->extents[map->count - 1];
+    if (tail->cluster + tail->length == cluster)    {
+        tail->length += length;
+        return;
+    }
+
+    if (map->count == map->capacity)    {
+        map->capacity *= 2;
+        map->extents = (extent *) realloc(map->extents, sizeof(extent) * map->capacity);
+        tail = &map->extents[map->count - 1];
+    }
+    extent * next = &map->extents[map->count];
+    next->file_index = tail->file_index + tail->length;
+    next->cluster = cluster;
+    next->length = length;
+    map->count ++;
+}
+
+/**
+* Drop the clusters past the first few of a chain from its extent map,
+* after the chain has been cut short
+* @param map The extent map
+* @param clusters The number of clusters left in the chain, at least 1
+*/
+void extent_map_cut(extent_map * map, int clusters)    {
+    while (map->count > 1 && map->extents[map->count - 1].file_index >= clusters)
+        map->count --;
+    extent * tail = &map->extents[map->count - 1];
+    if (tail->file_index + tail->length > clusters)
+        tail->length = clusters - tail->file_index;
+    if (map->last >= map->count)
+        map->last = 0;
+}
+
+/**
+* Find the cluster holding a given cluster index of a file. The run used by
+* the previous lookup and the one after it are tried first so sequential
+* access does not search; otherwise the runs are binary searched. If the
+* index lies past the mapped part of the chain, the chain is followed
+* through the FAT and the new clusters are added to the map.
+* @param vol The volume
+* @param map The extent map of the file
+* @param index The cluster index within the file
+* @param run If not NULL, set to the number of contiguous clusters
+*   starting at the returned cluster that are known to belong to the file
+* @return The cluster number, or -1 if the chain is shorter than index
+*/
+int extent_lookup(fat_volume * vol, extent_map * map, int index, int * run)   {
+    extent * tail = &map->extents[map->count - 1];
+    while (index >= tail->file_index + tail->length)    {
+        int next = value_in_FAT(vol, tail->cluster + tail->length - 1);
+        if (end_of_chain(vol, next))
+            return -1;
+        int wanted = index - (tail->file_index + tail->length) + 1;
+        extent_map_append(map, next, vol->fat->chain_run(vol, next, wanted, NULL));
+        tail = &map->extents[map->count - 1];
+    }
+
+    int i = __atomic_load_n(&map->last, __ATOMIC_RELAXED);  //Shared by readers of a read-only volume
+    extent * e = &map->extents[i];
+    if (index < e->file_index || index >= e->file_index + e->length)    {
+        i ++;
+        e = &map->extents[i];
+        if (i >= map->count || index < e->file_index ||
+            index >= e->file_index + e->length) {
+            int lo = 0, hi = map->count - 1;
+            while (lo < hi) {
+                int mid = (lo + hi + 1) / 2;
+                if (map->extents[mid].file_index <= index)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            i = lo;
+            e = &map->extents[i];
+        }
+    }
+
+    __atomic_store_n(&map->last, i, __ATOMIC_RELAXED);
+    if (run != NULL)
+        *run = e->length - (index - e->file_index);
+    return e->cluster + (index - e->file_index);
+}
+
+/**
+* Read the next run of contiguous clusters of a directory with one call
+* @param vol The volume
+* @param cluster The cluster the run starts at. Set to the cluster that
+*   follows the run, or -1 at the end of the chain
+* @param buf Where to store the entries
+* @param max_clusters The most clusters to read
+* @return The number of entries read, or -1 on failure
+*/
+int read_dir_run(fat_volume * vol, int * cluster, dirEnt * buf, int max_clusters)  {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    int curr = *cluster;
+    int run = vol->fat->chain_run(vol, curr, max_clusters, cluster);
+
+    int sector = (curr - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+    if (cache_read(vol, (char*)buf, run * bytesPerClus,
+        (off_t) sector * vol->bpb_struct.BPB_BytsPerSec, 0) < run * bytesPerClus)
+        return -1;
+    return run * bytesPerClus / sizeof(dirEnt);
+}
+
+/**
+* Read in directory entries from a cluster and follow the cluster chain.
+* Each run of contiguous clusters, or the whole FAT16 root region, is read
+* with one call, and free entries are then squeezed out in place.
+* @param vol The volume
+* @param cluster The cluster number to be read
+* @return The list of directory entries in a cluster
+*/
+dirEnt * read_cluster_dirEnt(fat_volume * vol, int cluster)    {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    int perClus = bytesPerClus / sizeof(dirEnt);
+    int curr = cluster;
+
+    //cluster number of 0 is the root directory
+    if (curr == 0 && vol->fsys_type == 0x02)
+        curr = vol->ebr_fat32.BPB_RootClus;
+
+    int num_entries;
+    if (curr == 0)  //FAT16 root is a fixed region
+        num_entries = vol->bpb_struct.BPB_RootEntCnt;
+    else
+        num_entries = cluster_chain_length(vol, curr) * perClus;
+
+    dirEnt * entries = (dirEnt *) malloc(sizeof(dirEnt) * num_entries);
+    int raw = 0;    //Tracks the number of entries read in, free ones included
+    if (curr == 0)  {
+        if (cache_read(vol, (char*)entries, num_entries * sizeof(dirEnt),
+            (off_t) vol->root_sec * vol->bpb_struct.BPB_BytsPerSec, 0) == num_entries * (int)sizeof(dirEnt))
+            raw = num_entries;
+    } else  {
+        while (curr != -1 && raw < num_entries) {
+            int start = raw;
+            int count = read_dir_run(vol, &curr, entries + raw, (num_entries - raw) / perClus);
+            if (count <= 0)
+                break;
+            raw += count;
+
+            //Stop once the end of the directory has been read
+            int i;
+            for (i = start; i < raw && entries[i].dir_name[0] != 0; i ++)
+                ;
+            if (i < raw)
+                break;
+        }
+    }
+
+    int entry_count = 0;
+    int i;
+    for (i = 0; i < raw; i ++)  {
+        if (entries[i].dir_name[0] == 0xE5) //Skip free entries
+            continue;
+        if (entry_count != i)
+            entries[entry_count] = entries[i];
+        if (entries[i].dir_name[0] == 0)    //First byte 0 means no more
+            break;
+        entry_count ++;
+    }
+    if (i == raw && entry_count < num_entries)
+        memset(&entries[entry_count], 0, sizeof(dirEnt));
+    return entries;
+}
+
+/**
+* Initialize the FAT volume and load all relevant data
+* @param vol The volume, zeroed apart from its locks
+* @param path The path to the volume image
+* @return 1 on success, -1 on failure
+*/
+int init_fat(fat_volume * vol, const char * path)   {
+    vol->fat_fd = open(path, vol->read_only ? O_RDONLY : O_RDWR, 0);    //Store the file descriptor
     
-    dirEnt file;
-    if(findDirEntry(&file, current, filename, 0))   {
-        //File with desired name already exists
-        return -2;
+    if (vol->fat_fd == -1)   {
+        return -1;
+    }
+
+    //Finish the committed journal transactions before reading anything,
+    //then keep a journal of our own changes if asked to
+    if (!vol->read_only && journal_replay(vol, path) == -1)
+        return -1;
+    char * journal = getenv("FAT_JOURNAL");
+    if (journal != NULL && strcmp(journal, "0") != 0 && !vol->read_only)  {
+        char jpath[PATH_MAX];
+        snprintf(jpath, sizeof(jpath), "%s.journal", path);
+        vol->journal_fd = open(jpath, O_RDWR | O_CREAT | O_TRUNC, 0644);    //Drops a torn transaction
+        if (vol->journal_fd == -1)
+            return -1;
+    }
+
+    //Read in the BPB_Structure
+    pread(vol->fat_fd, (char*)&vol->bpb_struct, sizeof(BPB_Structure), 0);
+    pread(vol->fat_fd, (char*)&vol->ebr_fat16, sizeof(EBR_FAT16), sizeof(BPB_Structure)); //Load EBR for FAT16
+    pread(vol->fat_fd, (char*)&vol->ebr_fat32, sizeof(EBR_FAT32), sizeof(BPB_Structure)); //Load EBR for FAT32
+
+    //Determine FAT16 or FAT32
+    //Number of sectors occupied by root directory
+    int RootDirSectors = ((vol->bpb_struct.BPB_RootEntCnt * 32) + 
+        (vol->bpb_struct.BPB_BytsPerSec -1)) / vol->bpb_struct.BPB_BytsPerSec;
+    
+
+    int FATSz, TotSec;
+    if (vol->bpb_struct.BPB_FATSz16 != 0)
+        FATSz = vol->bpb_struct.BPB_FATSz16;
+    else
+        FATSz = vol->ebr_fat32.BPB_FATSz32;
+
+    if (vol->bpb_struct.BPB_TotSec16 != 0)
+        TotSec = vol->bpb_struct.BPB_TotSec16;
+    else
+        TotSec = vol->bpb_struct.BPB_TotSec32;
+
+    int DataSec = TotSec - (vol->bpb_struct.BPB_RsvdSecCnt + 
+        (vol->bpb_struct.BPB_NumFATs * FATSz) + RootDirSectors);
+    vol->CountofClusters = DataSec / vol->bpb_struct.BPB_SecPerClus;
+
+    if (vol->CountofClusters < 4085) {   //Volume is FAT12 - exit
+        return -1;
+    } else if (vol->CountofClusters < 65525) {   //Volume is FAT16
+        vol->fsys_type = 0x01;
+        vol->fat = &fat_ops16;
+    } else  {   //Volume is FAT32
+        vol->fsys_type = 0x02;
+        vol->fat = &fat_ops32;
+    }
+
+    //Initialize more global variables
+    vol->root_sec = vol->bpb_struct.BPB_RsvdSecCnt +
+        (vol->bpb_struct.BPB_NumFATs * FATSz);
+    vol->data_sec = vol->root_sec + RootDirSectors;
+
+    //Set up the in-memory FAT. Sectors are paged in on first use. Changes
+    //go to every copy of the FAT unless FAT32 mirroring is turned off, in
+    //which case only the active FAT named by the low bits is used
+    vol->fat_num_sec = FATSz;
+    vol->fat_copies = (unsigned char) vol->bpb_struct.BPB_NumFATs;
+    vol->fat_first_sec = vol->bpb_struct.BPB_RsvdSecCnt;
+    if (vol->fsys_type == 0x02 && (vol->ebr_fat32.BPB_ExtFlags & 0x80))  {
+        int active = vol->ebr_fat32.BPB_ExtFlags & 0x0F;
+        if (active >= vol->fat_copies)
+            return -1;  //The active FAT is not on the volume
+        vol->fat_first_sec += active * FATSz;
+        vol->fat_copies = 1;
+    }
+    if (vol->fat_copies < 1)
+        vol->fat_copies = 1;
+
+    //A read-only mount leaves the journal for a writable one to replay, and
+    //sees the volume as that will leave it through a private mapping
+    size_t log_size = 0;
+    char * log = vol->read_only ? journal_read(vol, path, &log_size) : NULL;
+    if (log != NULL)
+        vol->journal_pending = 1;
+    if (map_volume(vol))
+        vol->fat_table = vol->volume_map + (size_t) vol->fat_first_sec * vol->bpb_struct.BPB_BytsPerSec;
+    else
+        vol->fat_table = (char *) malloc(FATSz * vol->bpb_struct.BPB_BytsPerSec);
+    if (log != NULL)    {
+        if (vol->volume_map == NULL || journal_apply(vol, log, log_size) == -1)
+            vol->journal_pending = 2;
+        free(log);
+    }
+    vol->fat_sec_loaded = (char *) calloc(FATSz, sizeof(char));
+    vol->fat_sec_dirty = (char *) calloc(FATSz, sizeof(char));
+    vol->fat_dirty_lo = vol->fat_num_sec;
+    vol->fat_dirty_hi = 0;
+
+    //Set up the free cluster bitmap. Bits are filled in as the FAT is paged in
+    vol->free_bitmap_words = (vol->CountofClusters + 2 + 31) / 32;
+    vol->free_bitmap = (unsigned int *) calloc(vol->free_bitmap_words, sizeof(unsigned int));
+    vol->next_free_hint = 2;
+    vol->simd_level = detect_simd_level();
+
+    cache_init(vol);
+
+    char * delay = getenv("FAT_DIRENT_DELAY_MS");
+    vol->dirEnt_delay_ms = delay != NULL ? atol(delay) : DIRENT_DEFAULT_DELAY_MS;
+    char * readahead = getenv("FAT_READAHEAD_KB");
+    long readahead_kb = readahead != NULL ? atol(readahead) : READAHEAD_DEFAULT_KB;
+    vol->readahead_clusters = readahead_kb * 1024 /
+        (vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec);
+  
+    //Initialize cwd to root. Directories are read on first use
+    if (vol->fsys_type == 0x01)
+        vol->cwd_cluster = 0;
+    else
+        vol->cwd_cluster = vol->ebr_fat32.BPB_RootClus;
+    strcpy(vol->cwd_path, "/");
+
+    //Free all file descriptors except for 0, 1 (Those are stdin, stdout by convention)
+    int i;
+    for (i = 0; i < NUM_FD; i ++)    {
+        vol->fd_base[i] = -1;
+    }
+
+    vol->fd_base[0] = 0;
+    vol->fd_base[1] = 0;
+
+    //Initialize the number of empty clusters. FAT32 volumes with a valid
+    //FSInfo sector are trusted, and optionally checked in the background.
+    //A read-only volume never changes, so its whole FAT is paged in now by
+    //counting and readers never have to take fat_lock
+    if (vol->read_only) {
+        vol->available_clusters = count_free_clusters(vol);
+    } else if (load_fsinfo(vol))  {
+        vol->mount_free_count = vol->available_clusters;
+        if (getenv("FAT_VERIFY_FREE_COUNT") != NULL)    {
+            vol->verify_done = 0;
+            if (pthread_create(&vol->verify_thread, NULL, verify_free_count_thread, vol) != 0)
+                vol->verify_done = 2;
+        }
+    } else  {
+        vol->available_clusters = count_free_clusters(vol);
+    }
+
+    return 1;
+}
+
+/**
+* Separate a path to a file into the filename and the pathname. Trailing
+* slashes are ignored, so /Media/ names the entry Media in /.
+* @param filename Where the filename will be stored
+* @param pathname Where the pathname will be stored, including its
+*   trailing slash
+* @param path The path to be split up
+*/
+void separate_path(char * filename, char * pathname, const char * path) {
+    int len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len --;
+
+    int slash = len - 1;
+    while (slash >= 0 && path[slash] != '/')
+        slash --;
+
+    strncpy(pathname, path, slash + 1);
+    pathname[slash + 1] = '\0';
+    strncpy(filename, path + slash + 1, len - slash - 1);
+    filename[len - slash - 1] = '\0';
+}
+
+/**
+* Translate an 8.3 formatted filename into an 11 character string
+* @param dest The place for the translated name to be stored
+* @param source The 8.3 formatted filename
+*/
+void fill_dir_name(char * dest, const char * source)    {
+    char * period = strchr(source, '.');
+    if (period != NULL) {
+        if (period - source < 8)    {
+            strncpy(dest, source, period-source);
+            int i;
+            for (i = period - source; i < 8; i ++)
+                dest[i] = 0x20;  //Pad end of string
+        } else  {
+            strncpy(dest, source, 8);
+        }
+        if (strlen(period + 1) < 3) {
+            strncpy(dest+8, period + 1, strlen(period + 1));
+            int i;
+            for (i = 8 + strlen(period+1); i < 11; i ++)
+                dest[i] = 0x20;
+        } else  {
+            strncpy(dest + 8, period + 1, 3);
+        }
+    } else  {
+        if (strlen(source) < 11)    {
+            strncpy(dest, source, strlen(source));
+            int i;
+            for (i = strlen(source); i < 11; i ++)
+                dest[i] = 0x20;
+        } else  {
+            strncpy(dest, source, 11);
+        }
+    }
+}
+
+/**
+* Hash a decoded file name for the directory name index
+* @param name The name to hash
+* @return The FNV-1a hash of the name
+*/
+unsigned int name_hash(const char * name)   {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0')  {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+* Turn the 11 character short name of an entry into NAME.EXT form
+* @param dest Where the name is stored, at least 13 bytes
+* @param de The directory entry
+*/
+void decode_short_name(char * dest, const dirEnt * de)  {
+    dest[0] = '\0';
+    char * padding = memchr((char*)(de->dir_name), 0x20, 8); //beginning of padding
+    if (padding == NULL)
+        strncat(dest, (char*)(de->dir_name), 8);
+    else
+        strncat(dest, (char*)(de->dir_name), padding - (char*)(de->dir_name));
+    padding = memchr((char*)(de->dir_name) + 8, 0x20, 3); //beginning of padding in extension
+    if (padding != (char*)(de->dir_name) + 8)
+        strcat(dest, ".");
+    if (padding == NULL)
+        strncat(dest, (char*)(de->dir_name) + 8, 3);
+    else
+        strncat(dest, (char*)(de->dir_name) + 8, padding - (char*)(de->dir_name) - 8);
+}
+
+/**
+* Copy the characters held by one long name entry into their place in the
+* long name. Entries are stored last part first, so each part is placed by
+* its ordinal rather than appended.
+* @param dest The long name being built, at least 256 bytes
+* @param ldir The long name entry
+* @param len Updated to the length of the name if this part ends it
+*/
+void decode_long_part(char * dest, const LDIR * ldir, int * len)  {
+    short int chars[13];
+    memcpy(chars, ldir->LDIR_Name1, sizeof(ldir->LDIR_Name1));
+    memcpy(chars + 5, ldir->LDIR_Name2, sizeof(ldir->LDIR_Name2));
+    memcpy(chars + 11, ldir->LDIR_Name3, sizeof(ldir->LDIR_Name3));
+
+    int pos = ((ldir->LDIR_Ord & 0x3F) - 1) * 13;
+    int i;
+    for (i = 0; i < 13 && pos + i < 255; i ++)  {
+        if (chars[i] == 0x0000 || chars[i] == -1)   {  //Padded with -1 or null terminated
+            *len = pos + i;
+            return;
+        }
+        dest[pos + i] = (char)(chars[i]);
+    }
+    if (ldir->LDIR_Ord & 0x40)  //Last part of the name without a terminator
+        *len = pos + i;
+}
+
+/**
+* Compute the checksum of a short name that its long name entries carry
+* @param de The short directory entry
+* @return The checksum
+*/
+unsigned char short_name_checksum(const dirEnt * de)    {
+    unsigned char sum = 0;
+    int i;
+    for (i = 0; i < 11; i ++)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + de->dir_name[i];
+    return sum;
+}
+
+/**
+* Forget any long name being assembled
+* @param lfn The long name state
+*/
+void lfn_reset(lfn_state * lfn) {
+    lfn->next_ord = -1;
+}
+
+/**
+* Add a long name entry to the name being assembled. The entries of a name
+* must run from the one flagged last down to ordinal 1 with one checksum;
+* anything else drops the name.
+* @param lfn The long name state
+* @param ldir The long name entry
+*/
+void lfn_add(lfn_state * lfn, const LDIR * ldir)  {
+    int ord = ldir->LDIR_Ord & 0x3F;
+    if (ldir->LDIR_Ord & 0x40)  {   //First entry stored, holding the end of the name
+        if (ord < 1 || ord > 20)    {
+            lfn->next_ord = -1;
+            return;
+        }
+        lfn->checksum = ldir->LDIR_Chksum;
+        lfn->len = 0;
+    } else if (lfn->next_ord < 1 || ord != lfn->next_ord ||
+        (unsigned char) ldir->LDIR_Chksum != lfn->checksum)   {
+        lfn->next_ord = -1;
+        return;
+    }
+    lfn->next_ord = ord - 1;
+    decode_long_part(lfn->name, ldir, &lfn->len);
+}
+
+/**
+* Decode the name of a short entry: the long name assembled before it if
+* that is complete and its checksum matches, otherwise the 8.3 name. The
+* long name state is reset for the next entry.
+* @param lfn The long name state
+* @param de The short directory entry
+* @param dest Where the name is stored, at least 256 bytes
+* @return The length of the name
+*/
+int lfn_take(lfn_state * lfn, const dirEnt * de, char * dest)    {
+    int len;
+    if (lfn->next_ord == 0 && lfn->checksum == short_name_checksum(de))    {
+        len = lfn->len;
+        memcpy(dest, lfn->name, len);
+        dest[len] = '\0';
+    } else  {
+        decode_short_name(dest, de);
+        len = strlen(dest);
+    }
+    lfn->next_ord = -1;
+    return len;
+}
+
+/**
+* Empty the path cache
+* @param vol The volume
+*/
+void dentry_flush(fat_volume * vol) {
+    int i;
+    for (i = 0; i < DENTRY_BUCKETS; i ++)  {
+        while (vol->dentry_buckets[i] != NULL)   {
+            dentry * d = vol->dentry_buckets[i];
+            vol->dentry_buckets[i] = d->next;
+            free(d->key);
+            free(d);
+        }
+    }
+    vol->dentry_count = 0;
+}
+
+/**
+* Drop every cached path whose entry lives in a directory
+* @param vol The volume
+* @param cluster The first cluster of the directory
+*/
+void dentry_invalidate(fat_volume * vol, int cluster) {
+    if (vol->dentry_count == 0)
+        return;
+    int i;
+    for (i = 0; i < DENTRY_BUCKETS; i ++)  {
+        dentry ** link = &vol->dentry_buckets[i];
+        while (*link != NULL)   {
+            dentry * d = *link;
+            if (d->parent_cluster == cluster)   {
+                *link = d->next;
+                free(d->key);
+                free(d);
+                vol->dentry_count --;
+            } else  {
+                link = &d->next;
+            }
+        }
+    }
+}
+
+/**
+* Refresh the cached copies of a directory entry that was rewritten in place
+* @param vol The volume
+* @param cluster The first cluster of the directory holding the entry
+* @param entry The new contents of the entry
+*/
+void dentry_update(fat_volume * vol, int cluster, const dirEnt * entry)   {
+    if (vol->dentry_count == 0)
+        return;
+    int i;
+    dentry * d;
+    for (i = 0; i < DENTRY_BUCKETS; i ++)
+        for (d = vol->dentry_buckets[i]; d != NULL; d = d->next)
+            if (d->parent_cluster == cluster &&
+                memcmp(d->entry.dir_name, entry->dir_name, 11) == 0)
+                d->entry = *entry;
+}
+
+/**
+* Map cluster 0 to the FAT32 root cluster so each directory has one key
+* @param vol The volume
+* @param cluster The first cluster of a directory
+* @return The cluster the directory is cached under
+*/
+int dir_key(fat_volume * vol, int cluster)    {
+    if (cluster == 0 && vol->fsys_type == 0x02)
+        return vol->ebr_fat32.BPB_RootClus;
+    return cluster;
+}
+
+/**
+* Release the memory held by a directory built by dir_build
+* @param dir The directory
+*/
+void dir_free(dir_cache * dir)  {
+    free(dir->arena);
+    free(dir->names);
+    free(dir->buckets);
+    free(dir->entries);
+    free(dir);
+}
+
+/**
+* Remove a directory from the directory cache and free it
+* @param vol The volume
+* @param dir The cached directory
+*/
+void dir_cache_remove(fat_volume * vol, dir_cache * dir)  {
+    dir_cache ** link = &vol->dcache_buckets[dir->cluster % DIR_CACHE_BUCKETS];
+    while (*link != dir)
+        link = &(*link)->hash_next;
+    *link = dir->hash_next;
+
+    if (dir->lru_prev != NULL)
+        dir->lru_prev->lru_next = dir->lru_next;
+    else
+        vol->dcache_mru = dir->lru_next;
+    if (dir->lru_next != NULL)
+        dir->lru_next->lru_prev = dir->lru_prev;
+    else
+        vol->dcache_lru = dir->lru_prev;
+
+    vol->dcache_entries -= dir->num_entries;
+    dir_free(dir);
+}
+
+/**
+* Drop a directory from the directory cache after its entries have changed
+* @param vol The volume
+* @param cluster The first cluster of the directory
+*/
+void dir_invalidate(fat_volume * vol, int cluster)    {
+    cluster = dir_key(vol, cluster);
+    dir_cache * dir = vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS];
+    while (dir != NULL && dir->cluster != cluster)
+        dir = dir->hash_next;
+    if (dir != NULL)
+        dir_cache_remove(vol, dir);
+    dentry_invalidate(vol, cluster);
+}
+
+/**
+* Refresh a cached directory after one of its entries was rewritten in place.
+* The name is unchanged, so the name index stays valid.
+* @param vol The volume
+* @param cluster The first cluster of the directory
+* @param entry The new contents of the entry
+*/
+void dir_update(fat_volume * vol, int cluster, const dirEnt * entry)  {
+    cluster = dir_key(vol, cluster);
+    dir_cache * dir = vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS];
+    while (dir != NULL && dir->cluster != cluster)
+        dir = dir->hash_next;
+    if (dir != NULL)    {
+        int i;
+        for (i = 0; i < dir->num_entries; i ++)
+            if (memcmp(dir->entries[i].dir_name, entry->dir_name, 11) == 0)
+                dir->entries[i] = *entry;
+    }
+    dentry_update(vol, cluster, entry);
+}
+
+/**
+* Read a directory and build its name index. Each short entry is indexed
+* under the name findDirEntry matches against: its long name if one
+* precedes it, otherwise its 8.3 name.
+* @param vol The volume
+* @param cluster The first cluster of the directory, as given by dir_key
+* @return The directory, not yet in the directory cache
+*/
+dir_cache * dir_build(fat_volume * vol, int cluster)   {
+    dir_cache * dir = (dir_cache *) malloc(sizeof(dir_cache));
+    dir->cluster = cluster;
+    dir->entries = read_cluster_dirEnt(vol, cluster);
+    int max_entries = (cluster == 0) ? vol->bpb_struct.BPB_RootEntCnt :
+        cluster_chain_length(vol, cluster) * vol->bpb_struct.BPB_SecPerClus *
+        vol->bpb_struct.BPB_BytsPerSec / sizeof(dirEnt);
+    dir->hash_next = NULL;
+    dir->lru_prev = NULL;
+    dir->lru_next = NULL;
+    dir->num_entries = 0;
+    while (dir->num_entries < max_entries && dir->entries[dir->num_entries].dir_name[0] != 0)
+        dir->num_entries ++;
+
+    dir->nbuckets = 16;
+    while (dir->nbuckets < dir->num_entries)
+        dir->nbuckets *= 2;
+    dir->buckets = (int *) malloc(sizeof(int) * dir->nbuckets);
+    memset(dir->buckets, -1, sizeof(int) * dir->nbuckets);
+    dir->names = (dir_name *) malloc(sizeof(dir_name) * (dir->num_entries + 1));
+    dir->num_names = 0;
+
+    //Decode the names in order into the arena, then chain them from the
+    //back so that the earliest entry with a given name is found first
+    int arena_size = 0, arena_cap = 16 * (dir->num_entries + 1);
+    dir->arena = (char *) malloc(arena_cap);
+    lfn_state lfn;
+    lfn_reset(&lfn);
+    int i;
+    for (i = 0; i < dir->num_entries; i ++) {
+        dirEnt * de = &dir->entries[i];
+        if (de->dir_attr == 0x0F)   {   //Long filename
+            lfn_add(&lfn, (LDIR*)de);
+            continue;
+        }
+
+        if (arena_size + 256 > arena_cap)   {
+            arena_cap = 2 * arena_cap + 256;
+            dir->arena = (char *) realloc(dir->arena, arena_cap);
+        }
+        dir_name * dn = &dir->names[dir->num_names ++];
+        dn->name = arena_size;
+        arena_size += lfn_take(&lfn, de, dir->arena + arena_size) + 1;
+        dn->index = i;
     }
+    dir->arena = (char *) realloc(dir->arena, arena_size > 0 ? arena_size : 1);
+    for (i = dir->num_names - 1; i >= 0; i --)  {
+        int bucket = name_hash(dir->arena + dir->names[i].name) & (dir->nbuckets - 1);
+        dir->names[i].next = dir->buckets[bucket];
+        dir->buckets[bucket] = i;
+    }
+
+    return dir;
+}
+
+/**
+* Get a directory from the directory cache, building it with dir_build if
+* it is not cached yet. Directories of a read-only volume never change, so
+* they are never evicted and are looked up and inserted without locks:
+* readers that build the same directory at once race to push it onto its
+* bucket, and the losers free their copy.
+* @param vol The volume
+* @param cluster The first cluster of the directory, 0 for the root
+* @return The cached directory
+*/
+dir_cache * dir_load(fat_volume * vol, int cluster)   {
+    cluster = dir_key(vol, cluster);
+    if (vol->read_only) {
+        dir_cache ** head = &vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS];
+        dir_cache * dir = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+        while (dir != NULL && dir->cluster != cluster)
+            dir = dir->hash_next;
+        if (dir != NULL)
+            return dir;
+
+        dir_cache * built = dir_build(vol, cluster);
+        built->hash_next = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(head, &built->hash_next, built, 0,
+            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))    {
+            //Another reader pushed first; it may have built the same directory
+            dir = built->hash_next;
+            while (dir != NULL && dir->cluster != cluster)
+                dir = dir->hash_next;
+            if (dir != NULL)    {
+                dir_free(built);
+                return dir;
+            }
+        }
+        return built;
+    }
+
+    dir_cache * dir = vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS];
+    while (dir != NULL && dir->cluster != cluster)
+        dir = dir->hash_next;
+
+    if (dir != NULL)    {   //Move to the front of the LRU list
+        if (dir != vol->dcache_mru)  {
+            dir->lru_prev->lru_next = dir->lru_next;
+            if (dir->lru_next != NULL)
+                dir->lru_next->lru_prev = dir->lru_prev;
+            else
+                vol->dcache_lru = dir->lru_prev;
+            dir->lru_prev = NULL;
+            dir->lru_next = vol->dcache_mru;
+            vol->dcache_mru->lru_prev = dir;
+            vol->dcache_mru = dir;
+        }
+        return dir;
+    }
+
+    dir = dir_build(vol, cluster);
+
+    //Make room within the budget, then insert at the front of the LRU list
+    while (vol->dcache_lru != NULL && vol->dcache_entries + dir->num_entries > DIR_CACHE_MAX_ENTRIES)
+        dir_cache_remove(vol, vol->dcache_lru);
+    dir->hash_next = vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS];
+    vol->dcache_buckets[cluster % DIR_CACHE_BUCKETS] = dir;
+    dir->lru_prev = NULL;
+    dir->lru_next = vol->dcache_mru;
+    if (vol->dcache_mru != NULL)
+        vol->dcache_mru->lru_prev = dir;
+    vol->dcache_mru = dir;
+    if (vol->dcache_lru == NULL)
+        vol->dcache_lru = dir;
+    vol->dcache_entries += dir->num_entries;
+
+    return dir;
+}
+
+/**
+* Find a directory entry matching a desired name using the name index of
+* a cached directory.
+* @param dest The destination for the matching directory entry
+* @param dir The directory to search
+* @param name The name to be matched
+* @param directory 1 if the entry searched for must be a directory
+* @return 1 if it is found, 0 otherwise 
+*/
+int findDirEntry(dirEnt * dest, const dir_cache * dir, const char * name, int directory)    {
+    int i = dir->buckets[name_hash(name) & (dir->nbuckets - 1)];
+    while (i != -1) {
+        const dir_name * dn = &dir->names[i];
+        const dirEnt * de = &dir->entries[dn->index];
+        if (strcmp(dir->arena + dn->name, name) == 0 && (!directory || (de->dir_attr & 0x10)))   {
+            *dest = *de;
+            return 1;
+        }
+        i = dn->next;
+    }
+
+    return 0;
+}
+
+/**
+* Given a path and the directory it is relative to, locate the cluster of
+* the named directory, one component at a time.
+* @param vol The volume
+* @param path The path to the directory
+* @param cluster The first cluster of the directory the path starts in
+* @return The first cluster of the directory, or -1 if it doesn't exist
+*/
+int findDir(fat_volume * vol, const char * path, int cluster)   {
+    char * copy = strdup(path);
+    char * save;
+    char * element = strtok_r(copy, "/", &save);
+    while (element != NULL) {
+        dirEnt dir_Ent;
+        if (!findDirEntry(&dir_Ent, dir_load(vol, cluster), element, 1))  {
+            free(copy);
+            return -1;
+        }
+        cluster = (dir_Ent.dir_fstClusHI << 16) | dir_Ent.dir_fstClusLO;
+        element = strtok_r(NULL, "/", &save);
+    }
+
+    free(copy);
+    return dir_key(vol, cluster);
+}
+
+/**
+* Locate the cluster of a directory named by an absolute path or by a path
+* relative to the current working directory
+* @param vol The volume
+* @param dirname The path to the directory
+* @return The first cluster of the directory, or -1 if it doesn't exist
+*/
+int resolve_dir(fat_volume * vol, const char * dirname)   {
+    if (dirname[0] == '/')  //If absolute path name start path at /
+        return findDir(vol, dirname + 1, 0);
+    return findDir(vol, dirname, __atomic_load_n(&vol->cwd_cluster, __ATOMIC_RELAXED));
+}
+
+/**
+* Build the path cache key for a path: the cluster the path starts in
+* followed by the path itself, so relative paths from different working
+* directories never collide
+* @param vol The volume
+* @param path The absolute or relative path
+* @return The key, to be freed by the caller
+*/
+char * dentry_key(fat_volume * vol, const char * path)    {
+    int base = __atomic_load_n(&vol->cwd_cluster, __ATOMIC_RELAXED);
+    if (path[0] == '/') {
+        base = dir_key(vol, 0);
+        path ++;
+    }
+    char * key = malloc(sizeof(char) * (strlen(path) + 12));
+    sprintf(key, "%d:%s", base, path);
+    return key;
+}
+
+/**
+* Find the directory entry named by a path by walking the directories
+* @param vol The volume
+* @param dest The destination for the directory entry
+* @param parent_cluster Set to the first cluster of the directory that
+*   holds or would hold the entry
+* @param path The absolute or relative path
+* @return 1 if found, 0 if the directory exists but not the entry,
+*   -1 if the directory doesn't exist
+*/
+int walk_path(fat_volume * vol, dirEnt * dest, int * parent_cluster, const char * path)  {
+    char * filename = malloc(sizeof(char) * (strlen(path) + 1));
+    char * pathname = malloc(sizeof(char) * (strlen(path) + 1));
+    separate_path(filename, pathname, path);
+    *parent_cluster = resolve_dir(vol, pathname);
+    int found = *parent_cluster != -1 &&
+        findDirEntry(dest, dir_load(vol, *parent_cluster), filename, 0);
+    free(filename);
+    free(pathname);
+    if (!found)
+        return (*parent_cluster == -1) ? -1 : 0;
+    return 1;
+}
+
+/**
+* Find the directory entry named by a path, using the path cache before
+* walking the directories. Only paths that exist are cached. A read-only
+* volume skips the path cache, which would need a lock to flush.
+* @param vol The volume
+* @param dest The destination for the directory entry
+* @param parent_cluster Set to the first cluster of the directory that
+*   holds or would hold the entry
+* @param path The absolute or relative path
+* @return 1 if found, 0 if the directory exists but not the entry,
+*   -1 if the directory doesn't exist
+*/
+int lookup_path(fat_volume * vol, dirEnt * dest, int * parent_cluster, const char * path)  {
+    if (vol->read_only)
+        return walk_path(vol, dest, parent_cluster, path);
+
+    char * key = dentry_key(vol, path);
+    unsigned int bucket = name_hash(key) % DENTRY_BUCKETS;
+    dentry * d;
+    for (d = vol->dentry_buckets[bucket]; d != NULL; d = d->next)    {
+        if (strcmp(d->key, key) == 0)   {
+            free(key);
+            *dest = d->entry;
+            *parent_cluster = d->parent_cluster;
+            return 1;
+        }
+    }
+
+    int found = walk_path(vol, dest, parent_cluster, path);
+    if (found != 1) {
+        free(key);
+        return found;
+    }
+
+    if (vol->dentry_count >= DENTRY_MAX)
+        dentry_flush(vol);
+    d = (dentry *) malloc(sizeof(dentry));
+    d->key = key;
+    d->entry = *dest;
+    d->parent_cluster = *parent_cluster;
+    d->next = vol->dentry_buckets[bucket];
+    vol->dentry_buckets[bucket] = d;
+    vol->dentry_count ++;
+    return 1;
+}
+
+/**
+* Changes the current working directory to the specified path
+* @param vol The volume
+* @param path The absolute or relative path of the file
+* @return 1 on success, -1 on failure
+*/
+int change_dir(fat_volume * vol, const char * path)    {
+    if(path == NULL || strlen(path) == 0)    {
+        return -1;
+    }
+
+    int cluster = resolve_dir(vol, path);
+    if (cluster == -1)
+        return -1;
+
+    if (path[0] == '/')
+        strcpy(vol->cwd_path, path);
+    else
+        strcat(vol->cwd_path, path);
+
+    __atomic_store_n(&vol->cwd_cluster, cluster, __ATOMIC_RELAXED);  //Read-only readers take no lock
+    return 1;
+}
+
+/**
+* Take a reference on an opened file, so that closing it waits until the
+* reference is dropped. The count is raised before fd_base is checked, and
+* close_file changes fd_base before it looks at the count, so either the
+* close sees the reference or the reference sees the close.
+* @param vol The volume
+* @param fd The file descriptor
+* @return 1 if the descriptor is open and now held, -1 otherwise
+*/
+int fd_hold(fat_volume * vol, int fd)  {
+    if (fd < 0 || fd >= NUM_FD)
+        return -1;
+    __atomic_add_fetch(&vol->fd_users[fd], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&vol->fd_base[fd], __ATOMIC_SEQ_CST) < 0)  {
+        __atomic_sub_fetch(&vol->fd_users[fd], 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+* Drop a reference taken by fd_hold, waking a close waiting for it
+* @param vol The volume
+* @param fd The file descriptor
+*/
+void fd_drop(fat_volume * vol, int fd)  {
+    if (__atomic_sub_fetch(&vol->fd_users[fd], 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&vol->fd_closing[fd], __ATOMIC_SEQ_CST))   {
+        pthread_mutex_lock(&vol->fd_lock);
+        pthread_cond_broadcast(&vol->fd_idle);
+        pthread_mutex_unlock(&vol->fd_lock);
+    }
+}
+
+/**
+* Wait until no reference is held on a descriptor. Called without the
+* volume lock, which queued asynchronous requests need to finish.
+* @param vol The volume
+* @param fd The file descriptor
+*/
+void fd_wait_idle(fat_volume * vol, int fd) {
+    if (fd < 0 || fd >= NUM_FD)
+        return;
+    __atomic_store_n(&vol->fd_closing[fd], 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&vol->fd_lock);
+    while (__atomic_load_n(&vol->fd_users[fd], __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&vol->fd_idle, &vol->fd_lock);
+    pthread_mutex_unlock(&vol->fd_lock);
+    __atomic_store_n(&vol->fd_closing[fd], 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+* Open a file on a read-only volume without taking any lock. A free
+* descriptor is claimed by swapping its fd_base from -1 to -2, the whole
+* cluster chain is mapped so later reads never change the extent map, and
+* the descriptor is published by storing the first cluster.
+* @param vol The volume
+* @param path The absolute or relative path of the file
+* @return The file descriptor to be used, or -1 on failure
+*/
+int open_file_readonly(fat_volume * vol, const char * path)  {
+    dirEnt file;
+    int parent_cluster;
+    if (lookup_path(vol, &file, &parent_cluster, path) != 1)
+        return -1;
+
+    int fd;
+    for (fd = 0; fd < NUM_FD; fd ++)    {
+        int expected = -1;
+        if (__atomic_compare_exchange_n(&vol->fd_base[fd], &expected, -2, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (fd == NUM_FD)
+        return -1;
+
+    int base = (file.dir_fstClusHI << 16) | (file.dir_fstClusLO);
+    vol->fd_dirEnt[fd] = file;
+    extent_map_init(&vol->fd_extents[fd], base);
+    extent_lookup(vol, &vol->fd_extents[fd], INT_MAX, NULL);
+    vol->fd_parent_cluster[fd] = parent_cluster;
+    vol->fd_dirEnt_pos[fd] = -1;
+    vol->fd_dirEnt_dirty[fd] = 0;
+    vol->fd_next_offset[fd] = -1;
+    vol->fd_seq_reads[fd] = 0;
+    vol->fd_ra_end[fd] = 0;
+    __atomic_store_n(&vol->fd_base[fd], base, __ATOMIC_RELEASE);
+    return fd;
+}
+
+/**
+* Opens a file specified by path to be read/written to
+* @param vol The volume
+* @param path The absolute or relative path of the file
+* @return The file descriptor to be used, or -1 on failure
+*/
+int open_file(fat_volume * vol, const char * path)  {
+    dirEnt file;
+    int parent_cluster;
+    if (vol->read_only)
+        return open_file_readonly(vol, path);
+
+    pthread_mutex_lock(&vol->dir_lock);
+    int found = lookup_path(vol, &file, &parent_cluster, path);
+    pthread_mutex_unlock(&vol->dir_lock);
+    if (found != 1)
+        return -1;
+
+    //Find the first available file descriptor
+    pthread_mutex_lock(&vol->fd_lock);
+    int fd = 0;
+    while (fd < NUM_FD && vol->fd_base[fd] != -1)
+        fd ++;
+
+    if (fd == NUM_FD)   {
+        pthread_mutex_unlock(&vol->fd_lock);
+        return -1;
+    }
+
+    vol->fd_base[fd] = (file.dir_fstClusHI << 16) | (file.dir_fstClusLO);
+    vol->fd_dirEnt[fd] = file;
+    extent_map_init(&vol->fd_extents[fd], vol->fd_base[fd]);
+    vol->fd_parent_cluster[fd] = parent_cluster;
+    vol->fd_dirEnt_pos[fd] = -1;
+    vol->fd_dirEnt_dirty[fd] = 0;
+    vol->fd_next_offset[fd] = -1;
+    vol->fd_seq_reads[fd] = 0;
+    vol->fd_ra_end[fd] = 0;
+
+    //Pick up size changes another descriptor has not written yet
+    int i;
+    for (i = 0; i < NUM_FD; i ++)   {
+        if (i != fd && vol->fd_base[i] != -1 && vol->fd_dirEnt_dirty[i] &&
+            vol->fd_parent_cluster[i] == parent_cluster &&
+            memcmp(vol->fd_dirEnt[i].dir_name, file.dir_name, 11) == 0)
+            vol->fd_dirEnt[fd] = vol->fd_dirEnt[i];
+    }
+    pthread_mutex_unlock(&vol->fd_lock);
+
+    return fd;
+}
+
+/**
+* Track the reads of a descriptor and, once they have continued each other,
+* prefetch the next readahead_clusters clusters of the file. The next window
+* is only issued when the reader has consumed half of the previous one.
+* Readers of the same descriptor may race here; the state is only a hint.
+* @param vol The volume
+* @param fd The file descriptor
+* @param map_lock The lock guarding the extent map, or NULL if it needs none
+* @param offset The offset the read started at
+* @param nbytes The number of bytes that were read
+*/
+void read_ahead(fat_volume * vol, int fd, pthread_mutex_t * map_lock, int offset, int nbytes)    {
+    int seq = 0;
+    if (offset == __atomic_load_n(&vol->fd_next_offset[fd], __ATOMIC_RELAXED))
+        seq = __atomic_load_n(&vol->fd_seq_reads[fd], __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&vol->fd_seq_reads[fd], seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&vol->fd_next_offset[fd], offset + nbytes, __ATOMIC_RELAXED);
+    if (seq == 0 || vol->readahead_clusters == 0)
+        return;
+
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    int next = (offset + nbytes + bytesPerClus - 1) / bytesPerClus;
+    int end = __atomic_load_n(&vol->fd_ra_end[fd], __ATOMIC_RELAXED);
+    if (end > next + vol->readahead_clusters / 2)   //Enough is already in flight
+        return;
+    if (end < next)
+        end = next;
+    int stop = next + vol->readahead_clusters;
+    int last = (vol->fd_dirEnt[fd].dir_fileSize + bytesPerClus - 1) / bytesPerClus;
+    if (stop > last)
+        stop = last;
+
+    //Map the whole window first so each lookup returns a full run, then
+    //prefetch one run of contiguous clusters at a time
+    if (map_lock != NULL)
+        pthread_mutex_lock(map_lock);
+    extent_lookup(vol, &vol->fd_extents[fd], stop - 1, NULL);
+    if (map_lock != NULL)
+        pthread_mutex_unlock(map_lock);
+    while (end < stop)  {
+        int run;
+        if (map_lock != NULL)
+            pthread_mutex_lock(map_lock);
+        int cluster = extent_lookup(vol, &vol->fd_extents[fd], end, &run);
+        if (map_lock != NULL)
+            pthread_mutex_unlock(map_lock);
+        if (cluster == -1)
+            break;
+        if (run > stop - end)
+            run = stop - end;
+        int sector = (cluster - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+        volume_prefetch(vol, run * bytesPerClus, (off_t) sector * vol->bpb_struct.BPB_BytsPerSec);
+        end += run;
+    }
+    __atomic_store_n(&vol->fd_ra_end[fd], end, __ATOMIC_RELAXED);
+}
+
+/**
+* Read nbytes of a file from offset into buf. On a read-only volume the
+* caller holds a reference on the descriptor, taken with fd_hold.
+* @param vol The volume
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @return The number of bytes read, or -1 otherwise
+*/
+int read_file(fat_volume * vol, int fildes, void * buf, int nbyte, int offset)  {
+    if (fildes < 0 || fildes >= NUM_FD || (!vol->read_only && vol->fd_base[fildes] < 0))
+        return -1;
+    //A read-only volume maps the whole chain on open, so its map never changes
+    pthread_mutex_t * map_lock = vol->read_only ? NULL : &vol->fd_mutex[fildes];
+
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+
+    //Calculate offset in cluster and which cluster of the file to start in
+    int cluster_offset = offset % bytesPerClus;
+    int cluster_num = offset / bytesPerClus; 
+    int untilEOF = vol->fd_dirEnt[fildes].dir_fileSize - offset;
+    if (untilEOF <= 0)  //Nothing to read at or past the end of the file
+        return 0;
+    if (nbyte > untilEOF)
+        nbyte = untilEOF;
+
+    int run;
+    if (map_lock != NULL)
+        pthread_mutex_lock(map_lock);
+    int cluster = extent_lookup(vol, &vol->fd_extents[fildes], cluster_num, &run);
+    if (map_lock != NULL)
+        pthread_mutex_unlock(map_lock);
+    if (cluster == -1)    //Reached end of cluster chain before offset
+        return -1;
+
+    int bytesRead = 0;   //Tracks the number of bytes read
+
+    //Read up to the end of each run of contiguous clusters at once
+    while (bytesRead < nbyte)  {
+        int toRead = run * bytesPerClus - cluster_offset;
+        if (toRead > nbyte - bytesRead)
+            toRead = nbyte - bytesRead;
+
+        int sector = (cluster - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+        int count = cache_read(vol, buf + bytesRead, toRead,
+            (off_t) sector * vol->bpb_struct.BPB_BytsPerSec + cluster_offset, 1);
+        if (count <= 0)
+            break;
+        bytesRead += count;
+
+        //Go to the cluster after the run
+        cluster_num += (cluster_offset + count) / bytesPerClus;
+        cluster_offset = (cluster_offset + count) % bytesPerClus;
+        if (bytesRead < nbyte)  {
+            if (map_lock != NULL)
+                pthread_mutex_lock(map_lock);
+            cluster = extent_lookup(vol, &vol->fd_extents[fildes], cluster_num, &run);
+            if (map_lock != NULL)
+                pthread_mutex_unlock(map_lock);
+            if (cluster == -1)
+                break;
+        }
+    }
+
+    read_ahead(vol, fildes, map_lock, offset, bytesRead);
+    return bytesRead;
+}
+
+/**
+* Gives a list of directory entries contained in a directory
+* @param vol The volume
+* @param dirname The path to the directory
+* @return An array of dirEnts
+*/
+dirEnt * read_dir(fat_volume * vol, const char * dirname)  {
+    if (!vol->read_only)
+        pthread_mutex_lock(&vol->dir_lock);
+    int cluster = resolve_dir(vol, dirname);
+    if (cluster == -1)  {
+        if (!vol->read_only)
+            pthread_mutex_unlock(&vol->dir_lock);
+        return NULL;
+    }
+
+    //Hand back a copy so the caller can free it, ending in an empty entry
+    dir_cache * dir = dir_load(vol, cluster);
+    dirEnt * ret = (dirEnt *) malloc(sizeof(dirEnt) * (dir->num_entries + 1));
+    memcpy(ret, dir->entries, sizeof(dirEnt) * dir->num_entries);
+    memset(&ret[dir->num_entries], 0, sizeof(dirEnt));
+    int dir_cluster = dir->cluster, num_entries = dir->num_entries;
+    if (vol->read_only) //Nothing is written, so there are no deferred dirENTs
+        return ret;
+    pthread_mutex_unlock(&vol->dir_lock);
+
+    //Show the size and time of opened files whose dirENT writes are deferred
+    int fd, i;
+    pthread_mutex_lock(&vol->fd_lock);
+    for (fd = 0; fd < NUM_FD; fd ++)    {
+        if (vol->fd_base[fd] == -1 || !vol->fd_dirEnt_dirty[fd] ||
+            dir_key(vol, vol->fd_parent_cluster[fd]) != dir_cluster)
+            continue;
+        for (i = 0; i < num_entries; i ++)
+            if (memcmp(ret[i].dir_name, vol->fd_dirEnt[fd].dir_name, 11) == 0)
+                ret[i] = vol->fd_dirEnt[fd];
+    }
+    pthread_mutex_unlock(&vol->fd_lock);
+    return ret;
+}
+
+/**
+* Fill a run of clusters with zeros through the block cache. Freed clusters
+* keep their old bytes, which a directory would take for entries.
+* @param vol The volume
+* @param cluster The first cluster of the run
+* @param length The number of clusters
+* @return 1 on success, -1 on failure
+*/
+int zero_clusters(fat_volume * vol, int cluster, int length)  {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    char * zeros = (char *) calloc(bytesPerClus, 1);
+    int ret = 1;
+    int i;
+    for (i = 0; i < length && ret == 1; i ++)   {
+        int sector = (cluster + i - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+        if (cache_write(vol, zeros, bytesPerClus, (off_t) sector * vol->bpb_struct.BPB_BytsPerSec, 0) != bytesPerClus)
+            ret = -1;
+    }
+    free(zeros);
+    return ret;
+}
+
+/**
+* Make a cluster chain at least a given number of clusters long. Missing
+* clusters are allocated as contiguous runs, each linked onto the end of
+* the chain with one batched FAT update.
+* @param vol The volume
+* @param map The extent map of the chain
+* @param clusters The number of clusters the chain should have
+* @param zero 1 to fill the new clusters with zeros, as a directory needs
+* @return 1 on success, -1 if there is not enough free space
+*/
+int grow_chain(fat_volume * vol, extent_map * map, int clusters, int zero)  {
+    if (clusters <= 0 || extent_lookup(vol, map, clusters - 1, NULL) != -1)
+        return 1;
+
+    //The lookup mapped the whole chain, so the last run ends the chain
+    extent * tail = &map->extents[map->count - 1];
+    int last = tail->cluster + tail->length - 1;
+    int missing = clusters - (tail->file_index + tail->length);
+    apply_verified_free_count(vol);
+    if (vol->available_clusters < missing)   //Break if we won't have enough space
+        return -1;
+
+    while (missing > 0) {
+        int length;
+        int start = find_free_run(vol, missing, &length);
+        if (start == -1)
+            return -1;
+        set_cluster_run(vol, start, length);
+        set_cluster_value(vol, last, start);
+        extent_map_append(map, start, length);
+        if (zero && zero_clusters(vol, start, length) == -1)
+            return -1;
+        last = start + length - 1;
+        missing -= length;
+    }
+
+    return 1;
+}
+
+/**
+* Write to the cluster chain described by an extent map, growing the chain
+* if the write runs past its end. The write may start at most at the end
+* of the chain.
+* @param vol The volume
+* @param map The extent map of the chain
+* @param buf The buffer of bytes to be written
+* @param nbytes The number of bytes to write
+* @param offset The offset in the chain at which to write
+* @return The number of bytes written, or -1 on failure
+*/
+int write_chain(fat_volume * vol, extent_map * map, const void * buf, int nbytes, int offset)  {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+
+    int cluster_offset = offset % bytesPerClus;
+    int cluster_num = offset / bytesPerClus;
+
+    if (cluster_num > 0 && extent_lookup(vol, map, cluster_num - 1, NULL) == -1)
+        return -1;
+    if (grow_chain(vol, map, (offset + nbytes + bytesPerClus - 1) / bytesPerClus, 0) == -1)
+        return -1;
+
+    int bytesWritten = 0; //Tracks the number of bytes written
+
+    //Write up to the end of each run of contiguous clusters at once
+    while (bytesWritten < nbytes)  {
+        int run;
+        int cluster = extent_lookup(vol, map, cluster_num, &run);
+        if (cluster == -1)
+            break;
+
+        int toWrite = run * bytesPerClus - cluster_offset;
+        if (toWrite > nbytes - bytesWritten)
+            toWrite = nbytes - bytesWritten;
+
+        int sector = (cluster - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+        int count = cache_write(vol, buf + bytesWritten, toWrite,
+            (off_t) sector * vol->bpb_struct.BPB_BytsPerSec + cluster_offset, 1);
+        if (count <= 0)
+            break;
+        bytesWritten += count;
+
+        //Go to the cluster after the run
+        cluster_num += (cluster_offset + count) / bytesPerClus;
+        cluster_offset = (cluster_offset + count) % bytesPerClus;
+    }
+
+    return bytesWritten;
+}
+
+/**
+* Write at a cluster number, updating the FAT and going to another cluster if
+* necessary. Cluster 0 refers to the root directory.
+* @param vol The volume
+* @param cluster The cluster number to be written to
+* @param buf The buffer of bytes to be written
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @return The number of bytes written, or -1 on failure
+*/
+int write_cluster(fat_volume * vol, int cluster, const void * buf, int nbytes, int offset)  {
+    if (cluster == 0 && vol->fsys_type == 0x01)  {
+        //The FAT16 root directory is a fixed region that cannot grow
+        if (offset + nbytes > vol->bpb_struct.BPB_RootEntCnt * (int) sizeof(dirEnt))
+            return -1;
+        return cache_write(vol, buf, nbytes, (off_t) vol->root_sec * vol->bpb_struct.BPB_BytsPerSec + offset, 0);
+    }
+    if (cluster == 0)
+        cluster = vol->ebr_fat32.BPB_RootClus;
+
+    //Only directories are written here, so clusters they gain start empty
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    extent_map map;
+    extent_map_init(&map, cluster);
+    int bytesWritten = -1;
+    if (grow_chain(vol, &map, (offset + nbytes + bytesPerClus - 1) / bytesPerClus, 1) == 1)
+        bytesWritten = write_chain(vol, &map, buf, nbytes, offset);
+    extent_map_free(&map);
+    return bytesWritten;
+}
+
+/**
+* Find the index at which entry is located in the cluster. This includes
+* entries of 0xE5.
+* @param vol The volume
+* @param cluster The cluster to be examined
+* @param entry The entry to be searched for
+* @return The index, or -1 - the number of entries looked at if it isn't
+*   found, so that an empty directory is not taken for a match at index 0
+*/
+int find_dirEnt_match(fat_volume * vol, int cluster, dirEnt entry)    {
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    int curr = cluster;
+    if (curr == 0 && vol->fsys_type == 0x02)
+        curr = vol->ebr_fat32.BPB_RootClus;
+
+    //The FAT16 root is read whole, directories a run of clusters at a time
+    int max_entries = (curr == 0) ? vol->bpb_struct.BPB_RootEntCnt :
+        DIR_READ_CLUSTERS * bytesPerClus / sizeof(dirEnt);
+    dirEnt * block = (dirEnt *) malloc(sizeof(dirEnt) * max_entries);
+    int entry_count = 0;
+    while (1)   {
+        int count;
+        if (curr == 0)  {
+            count = cache_read(vol, (char*)block, max_entries * sizeof(dirEnt),
+                (off_t) vol->root_sec * vol->bpb_struct.BPB_BytsPerSec, 0) / (int)sizeof(dirEnt);
+            curr = -1;
+        } else  {
+            count = read_dir_run(vol, &curr, block, DIR_READ_CLUSTERS);
+        }
+
+        int i;
+        for (i = 0; i < count; i ++)    {
+            if (block[i].dir_name[0] == 0)  {
+                free(block);
+                return -1 - entry_count;
+            }
+            if (memcmp(block[i].dir_name, entry.dir_name, 11) == 0)    {   //Match found
+                free(block);
+                return entry_count;
+            }
+            entry_count ++;
+        }
+        if (count <= 0 || curr == -1)
+            break;
+    }
+
+    free(block);
+    return -1 - entry_count;
+}
+
+/**
+* Overwrite a directory entry contained in a given cluster. If a
+* directory entry at path does not exist with the same name as entry, 
+* then a new one will be created.
+* @param vol The volume
+* @param cluster The cluster 
+* @param entry The entry to be written in the directory
+* @return 1 on success
+*/
+int write_dirEnt(fat_volume * vol, int cluster, dirEnt entry)   {
+    int i = find_dirEnt_match(vol, cluster, entry);
+    if (i < 0)  {
+        i = -1 - i;
+        write_cluster(vol, cluster, (void*)&entry, sizeof(dirEnt), i * sizeof(dirEnt));
+        char toWrite = '\0';
+        write_cluster(vol, cluster, (void*)&toWrite, sizeof(char), (i+1) * sizeof(dirEnt));
+        dir_invalidate(vol, cluster);
+    } else  {
+        write_cluster(vol, cluster, (void*)&entry, sizeof(dirEnt), i * sizeof(dirEnt));
+        dir_update(vol, cluster, &entry);
+    }
+
+    return 1;
+}
+
+/**
+* Get the volume offset of a directory entry
+* @param vol The volume
+* @param cluster The first cluster of the directory
+* @param index The index of the entry, counting free entries, as returned
+*   by find_dirEnt_match
+* @return The byte offset of the entry on the volume
+*/
+off_t dirEnt_offset(fat_volume * vol, int cluster, int index) {
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    cluster = dir_key(vol, cluster);
+    if (cluster == 0)   //FAT16 root is a fixed region
+        return (off_t) vol->root_sec * bps + index * sizeof(dirEnt);
+
+    int per_clus = vol->bpb_struct.BPB_SecPerClus * bps / sizeof(dirEnt);
+    int i;
+    for (i = 0; i < index / per_clus; i ++)
+        cluster = value_in_FAT(vol, cluster);
+    int sector = (cluster - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+    return (off_t) sector * bps + (index % per_clus) * sizeof(dirEnt);
+}
+
+/**
+* Get a millisecond clock for aging deferred dirEnt updates
+* @return Milliseconds since an arbitrary point
+*/
+long now_ms()   {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+* Write the deferred size and time changes of an opened file to its dirENT.
+* The slot holding the entry is found on the first flush and reused; it is
+* checked against the name before each write in case the file was removed.
+* @param vol The volume
+* @param fd The file descriptor
+* @return 1 on success or if nothing was deferred, -1 on failure
+*/
+int flush_fd_dirEnt(fat_volume * vol, int fd) {
+    if (!vol->fd_dirEnt_dirty[fd])
+        return 1;
+    vol->fd_dirEnt_dirty[fd] = 0;
+
+    int parent = vol->fd_parent_cluster[fd];
+    if (vol->fd_dirEnt_pos[fd] != -1)    {
+        dirEnt current;
+        cache_read(vol, (char*)&current, sizeof(dirEnt), vol->fd_dirEnt_pos[fd], 0);
+        if (memcmp(current.dir_name, vol->fd_dirEnt[fd].dir_name, 11) != 0)
+            vol->fd_dirEnt_pos[fd] = -1;
+    }
+    if (vol->fd_dirEnt_pos[fd] == -1)    {
+        int i = find_dirEnt_match(vol, parent, vol->fd_dirEnt[fd]);
+        if (i < 0)  //The file has been removed, so there is nothing to update
+            return 1;
+        vol->fd_dirEnt_pos[fd] = dirEnt_offset(vol, parent, i);
+    }
+
+    if (cache_write(vol, (char*)&vol->fd_dirEnt[fd], sizeof(dirEnt), vol->fd_dirEnt_pos[fd], 0) != sizeof(dirEnt))
+        return -1;
+    dir_update(vol, parent, &vol->fd_dirEnt[fd]);
+    return 1;
+}
+
+/**
+* Write the deferred dirENT changes of every opened file
+* @param vol The volume
+* @param max_age Only write changes at least this many ms old
+* @return 1 on success, -1 if any write failed
+*/
+int flush_dirEnts(fat_volume * vol, long max_age) {
+    int ret = 1;
+    long now = now_ms();
+    int fd;
+    for (fd = 0; fd < NUM_FD; fd ++)    {
+        if (vol->fd_base[fd] != -1 && vol->fd_dirEnt_dirty[fd] &&
+            now - vol->fd_dirty_since[fd] >= max_age && flush_fd_dirEnt(vol, fd) == -1)
+            ret = -1;
+    }
+    return ret;
+}
+
+/**
+* Mark the dirENT of an opened file as changed, deferring its update until
+* it has aged, is closed, or is synced. The flusher thread is told when the
+* oldest deferred update is due.
+* @param vol The volume
+* @param fildes The file descriptor
+*/
+void defer_dirEnt(fat_volume * vol, int fildes) {
+    if (vol->fd_dirEnt_dirty[fildes])
+        return;
+    vol->fd_dirEnt_dirty[fildes] = 1;
+    vol->fd_dirty_since[fildes] = now_ms();
+    if (!vol->flush_running)
+        return;
+
+    pthread_mutex_lock(&vol->flush_lock);
+    if (vol->flush_due == 0)    {   //Otherwise an older update is due first
+        vol->flush_due = vol->fd_dirty_since[fildes] + vol->dirEnt_delay_ms;
+        pthread_cond_signal(&vol->flush_cond);
+    }
+    pthread_mutex_unlock(&vol->flush_lock);
+}
+
+/**
+* Close an opened file specified by fd
+* @param vol The volume
+* @param fd The file descriptor of the file to be closed
+* @preturn 1 on success, -1 on failure
+*/
+int close_file(fat_volume * vol, int fd) {
+    if (fd < 0 || fd >= NUM_FD)
+        return -1;
+    if (vol->read_only) {   //Take the descriptor back the way open_file_readonly claimed it
+        int base = __atomic_load_n(&vol->fd_base[fd], __ATOMIC_ACQUIRE);
+        if (base < 0 || !__atomic_compare_exchange_n(&vol->fd_base[fd], &base, -2, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return -1;
+        fd_wait_idle(vol, fd);  //Reads already running still use the extent map
+        extent_map_free(&vol->fd_extents[fd]);
+        __atomic_store_n(&vol->fd_base[fd], -1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    if (vol->fd_base[fd] == -1)
+        return -1;
+
+    
+    int ret = flush_fd_dirEnt(vol, fd);
+    vol->fd_base[fd] = -1;
+    extent_map_free(&vol->fd_extents[fd]);
+
+    return ret;
+}
+
+/**
+* Open a stream over the entries of a directory. Pending size and time
+* changes of its opened files are written first so the stream sees them.
+* @param vol The volume
+* @param dirname The path to the directory
+* @return The stream, or NULL if the directory doesn't exist
+*/
+fat_dir * open_dir(fat_volume * vol, const char * dirname)  {
+    int cluster = resolve_dir(vol, dirname);
+    if (cluster == -1)
+        return NULL;
+    cluster = dir_key(vol, cluster);
+
+    int fd;
+    if (!vol->read_only)    {
+        for (fd = 0; fd < NUM_FD; fd ++)
+            if (vol->fd_base[fd] != -1 && vol->fd_dirEnt_dirty[fd] &&
+                dir_key(vol, vol->fd_parent_cluster[fd]) == cluster)
+                flush_fd_dirEnt(vol, fd);
+    }
+
+    fat_dir * dir = (fat_dir *) malloc(sizeof(fat_dir));
+    dir->vol = vol;
+    dir->cluster = cluster;
+    dir->root_read = 0;
+    dir->buf = (dirEnt *) malloc(vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec);
+    dir->count = 0;
+    dir->index = 0;
+    dir->done = 0;
+    lfn_reset(&dir->lfn);
+    return dir;
+}
+
+/**
+* Read the next cluster of a directory stream into its buffer. The FAT16
+* root is read a cluster's worth of entries at a time.
+* @param dir The stream
+* @return 1 if entries were read, 0 at the end of the chain, -1 on failure
+*/
+int load_dir_cluster(fat_dir * dir)  {
+    fat_volume * vol = dir->vol;
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int perClus = vol->bpb_struct.BPB_SecPerClus * bps / sizeof(dirEnt);
+    if (dir->cluster == -1)
+        return 0;
+
+    off_t pos;
+    int count = perClus;
+    if (dir->cluster == 0)  {
+        count = vol->bpb_struct.BPB_RootEntCnt - dir->root_read;
+        if (count <= 0)
+            return 0;
+        if (count > perClus)
+            count = perClus;
+        pos = (off_t) vol->root_sec * bps + dir->root_read * sizeof(dirEnt);
+        dir->root_read += count;
+    } else  {
+        pos = (off_t)((dir->cluster - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec) * bps;
+        int next = value_in_FAT(vol, dir->cluster);
+        dir->cluster = end_of_chain(vol, next) ? -1 : next;
+    }
+
+    if (cache_read(vol, (char*)dir->buf, count * sizeof(dirEnt), pos, 0) != count * (int)sizeof(dirEnt))
+        return -1;
+    dir->count = count;
+    dir->index = 0;
+    return 1;
+}
+
+/**
+* Get the next entry of a directory stream. Free entries are skipped and
+* long name entries are folded into the name of the short entry they
+* precede.
+* @param dir The stream
+* @param dest Where the entry and its decoded name are stored
+* @return 1 if an entry was stored, 0 at the end of the directory,
+*   -1 on failure
+*/
+int next_dir_entry(fat_dir * dir, fat_dirent * dest)   {
+    while (!dir->done)  {
+        if (dir->index == dir->count)   {
+            int loaded = load_dir_cluster(dir);
+            if (loaded <= 0)    {
+                dir->done = 1;
+                return loaded;
+            }
+        }
+
+        dirEnt * de = &dir->buf[dir->index ++];
+        if (de->dir_name[0] == 0)   {   //First byte 0 means no more
+            dir->done = 1;
+            break;
+        }
+        if (de->dir_name[0] == 0xE5)    {
+            lfn_reset(&dir->lfn);
+            continue;
+        }
+        if (de->dir_attr == 0x0F)   {   //Long filename
+            lfn_add(&dir->lfn, (LDIR*)de);
+            continue;
+        }
+
+        lfn_take(&dir->lfn, de, dest->name);
+        dest->entry = *de;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* Close a directory stream
+* @param dir The stream
+*/
+void close_dir(fat_dir * dir)   {
+    free(dir->buf);
+    free(dir);
+}
+
+/**
+* Create a new directory entry at the specified path with 
+* the desired attribute
+* @param vol The volume
+* @param path The path to the entry
+* @param attr The desired dirEnt attribute
+* @return 1 if created, -1 if path is invalid, -2 if final
+*   path element already exists
+*/
+int create_new_dirEnt(fat_volume * vol, const char * path, char attr) {
+    dirEnt file;
+    int parent_cluster;
+    int found = lookup_path(vol, &file, &parent_cluster, path);
+    if (found == -1)
+        return -1;  //Invalid path
+    if (found == 1)
+        return -2;  //File with desired name already exists
+
+    char *filename, *pathname;
+    pathname = malloc(sizeof(char) * (strlen(path) + 1));
+    filename = malloc(sizeof(char) * (strlen(path) + 1));
+    separate_path(filename, pathname, path); 
+    free(pathname);
+
+    dirEnt toWrite;
+    toWrite.dir_attr = attr;
+    fill_dir_name(toWrite.dir_name, filename);
+    free(filename);
+    toWrite.dir_fileSize = 0;
+
+    //Find next available cluster to allocate
+    int next_cluster = find_free_cluster(vol);
+    set_cluster_value(vol, next_cluster, -1); 
+    if ((attr & 0x10) && next_cluster != -1)
+        zero_clusters(vol, next_cluster, 1);   //Its old bytes would read as entries
+
+    toWrite.dir_fstClusHI = (unsigned short int)(next_cluster >> 16);   //Will be 0 for FAT16
+    toWrite.dir_fstClusLO = (unsigned short int)(next_cluster & 0xFFFF);
+
+    short int date, tim;  //The packed fields can't be written through a pointer
+    get_date_time(&date, &tim);
+    toWrite.dir_wrtDate = date;
+    toWrite.dir_wrtTime = tim;
+    toWrite.dir_crtDate = toWrite.dir_wrtDate;
+    toWrite.dir_crtTime = toWrite.dir_wrtTime;
+
+    write_dirEnt(vol, parent_cluster, toWrite);
+
+    //If a directory, need to make . and .. entries
+    if (attr & 0x10)    {
+        toWrite.dir_name[0] = '.';
+        int i;
+        for (i = 1; i < 10; i ++)
+            toWrite.dir_name[i] = 0x20;
+        write_dirEnt(vol, next_cluster, toWrite);
+
+        toWrite.dir_name[1] = '.';
+        toWrite.dir_fstClusHI = (unsigned short int)(parent_cluster >> 16);
+        toWrite.dir_fstClusLO = (unsigned short int)(parent_cluster & 0xFFFF);
+
+        write_dirEnt(vol, next_cluster, toWrite);
+    }
+
+    return 1;
+}
+
+/**
+* Remove a directory entry and clear the required information from the FAT
+* @param vol The volume
+* @param path The path to the directory entry to be removed
+* @param attr The attribute of the entry to be removed 
+*   (0x10 for directory, 0x20 for file)
+* @return 1 if removed, -1 if path is invalid
+    If attr = 0x10
+        -2 if path does not refer to a file
+        -3 if directory is not empty
+    If attr = 0x20
+        -2 if file is a directory
+*/
+int remove_dirEnt(fat_volume * vol, const char * path, char attr) {
+    dirEnt file;
+    int parent_cluster;
+    if (lookup_path(vol, &file, &parent_cluster, path) != 1)
+        return -1;  //Invalid path or file does not exist
+
+    //If it's a file, attr & 0x20 will be true
+    //If it's a directory, attr & 0x10 will be true
+    //rmdir returns -2 if the path doesn't refer to a file
+    //rm returns -2 if the path refers to a directory
+    if (!(file.dir_attr & attr))    {
+        return -2;
+    }
+   
+    int cluster = (file.dir_fstClusHI << 16) | (file.dir_fstClusLO);
+
+    if (attr & 0x10)    {
+        //check if empty
+        //Make sure that only . and .. are contained in the directory
+        dir_cache * dir = dir_load(vol, cluster);
+        int i;
+        for (i = 0; i < dir->num_entries; i ++) {
+            if (strncmp(dir->entries[i].dir_name, ".          ", 11) != 0 &&
+                strncmp(dir->entries[i].dir_name, "..         ", 11) != 0)
+                return -3;
+        }
+        dir_invalidate(vol, cluster);
+        dentry_flush(vol);     //Cached paths may lead through the directory
+    }
+
+    //Delete directory entry and empty FAT entry
+    //Can delete directory entry by changing Name[0] to 0xE5 and overwriting
+    //Find index of file in current
+    int i = find_dirEnt_match(vol, parent_cluster, file);
+    if (i < 0)
+        return -1;  //The entry went away under a stale lookup
+    file.dir_name[0] = 0xE5;
+    write_cluster(vol, parent_cluster, (void*)&file, sizeof(dirEnt), i * sizeof(dirEnt));
+    dir_invalidate(vol, parent_cluster);
+    free_cluster_chain(vol, cluster);
+
+    return 1;
+}
+
+/**
+* Creates a new directory at the specified path
+* @param vol The volume
+* @param path The path to the directory
+* @return 1 if created, -1 if the path is invalid, -2 if final 
+*   path element already exists
+*/
+int make_dir(fat_volume * vol, const char * path) {
+    return create_new_dirEnt(vol, path, 0x10);
+}
+
+/**
+* Remove an empty directory at the specified path
+* @param vol The volume
+* @param path The path to the directory
+* @return 1 if removed, -1 if path is invalid,
+*   -2 if path does not refer to a file, 
+*   -3 if directory is not empty
+*/
+int remove_dir(fat_volume * vol, const char * path) {
+    return remove_dirEnt(vol, path, 0x10);
+}
+
+/**
+* Remove a file at the specified path
+* @param vol The volume
+* @param path The path to the file
+* @return 1 if removed, -1 if path is invalid,
+*   -2 if file is a directory
+*/
+int remove_file(fat_volume * vol, const char * path)    {
+    return remove_dirEnt(vol, path, 0x20);
+}
+
+/**
+* Create a file at a desired path name
+* @param vol The volume
+* @param path The path to the file
+* @return 1 if file is created, -1 if path is invalid,
+*   -2 if final path element already exists
+*/
+int create_file(fat_volume * vol, const char * path) {
+    return create_new_dirEnt(vol, path, 0x20);
+}
+
+/**
+* Write to an opened file
+* @param vol The volume
+* @param fildes The file descriptor
+* @param buf The buffer of bytes to be written
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @return The number of bytes written, or -1 on failure
+*/
+int write_file(fat_volume * vol, int fildes, const void * buf, int nbytes, int offset)  {
+    if (fildes < 0 || fildes >= NUM_FD || vol->fd_base[fildes] == -1)
+        return -1;
+
+    int bytesWritten = write_chain(vol, &vol->fd_extents[fildes], buf, nbytes, offset);
+
+    if (bytesWritten <= 0)
+        return bytesWritten;
+
+    //Need to now update the file size in its dirEnt
+    if (offset + bytesWritten > vol->fd_dirEnt[fildes].dir_fileSize)
+        vol->fd_dirEnt[fildes].dir_fileSize = offset + bytesWritten;
+    short int date, tim;
+    get_date_time(&date, &tim);
+    vol->fd_dirEnt[fildes].dir_wrtDate = date;
+    vol->fd_dirEnt[fildes].dir_wrtTime = tim;
+
+    //Defer writing the dirENT until it has aged, is closed, or is synced
+    defer_dirEnt(vol, fildes);
+    flush_dirEnts(vol, vol->dirEnt_delay_ms);
+
+    return bytesWritten;
+}
+
+/**
+* Reserve clusters for an opened file so that later writes up to length
+* bytes do not allocate. The clusters are taken as contiguous runs where
+* free space allows. The file size is left unchanged.
+* @param vol The volume
+* @param fildes The file descriptor
+* @param length The number of bytes to reserve space for
+* @return 1 on success, -1 on failure
+*/
+int allocate_file(fat_volume * vol, int fildes, int length)    {
+    if (fildes < 0 || fildes >= NUM_FD || vol->fd_base[fildes] == -1 || length < 0)
+        return -1;
+
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    return grow_chain(vol, &vol->fd_extents[fildes], (length + bytesPerClus - 1) / bytesPerClus, 0);
+}
+
+/**
+* Change the size of an opened file. Shrinking it frees the clusters past
+* the new end with one batched FAT update; a file keeps at least its first
+* cluster. Growing it fills the new part of the file with zeros.
+* @param vol The volume
+* @param fildes The file descriptor
+* @param length The new size in bytes
+* @return 1 on success, -1 on failure
+*/
+int truncate_file(fat_volume * vol, int fildes, int length)    {
+    if (fildes < 0 || fildes >= NUM_FD || vol->fd_base[fildes] == -1 || length < 0)
+        return -1;
+
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    extent_map * map = &vol->fd_extents[fildes];
+    int size = vol->fd_dirEnt[fildes].dir_fileSize;
+    if (length > size)  {
+        char * zeros = (char *) calloc(bytesPerClus, 1);
+        int offset = size;
+        while (offset < length) {
+            int count = bytesPerClus - offset % bytesPerClus;
+            if (count > length - offset)
+                count = length - offset;
+            if (write_chain(vol, map, zeros, count, offset) != count)   {
+                free(zeros);
+                return -1;
+            }
+            offset += count;
+        }
+        free(zeros);
+    } else if (length < size)   {
+        int keep = length == 0 ? 1 : (length + bytesPerClus - 1) / bytesPerClus;
+        int last = extent_lookup(vol, map, keep - 1, NULL);
+        if (last != -1) {
+            int next = value_in_FAT(vol, last);
+            if (!end_of_chain(vol, next))   {
+                set_cluster_value(vol, last, -1);
+                free_cluster_chain(vol, next);
+            }
+            extent_map_cut(map, keep);
+        }
+
+        //Other descriptors of the file must not reach the freed clusters
+        int fd;
+        for (fd = 2; fd < NUM_FD; fd ++)    {
+            if (fd != fildes && vol->fd_base[fd] == vol->fd_base[fildes])
+                extent_map_cut(&vol->fd_extents[fd], keep);
+        }
+        vol->fd_ra_end[fildes] = 0;
+    }
+
+    //Every descriptor of the file sees the new size, so none of them writes
+    //an older one back to the directory entry
+    int fd;
+    for (fd = 2; fd < NUM_FD; fd ++)    {
+        if (fd == fildes || vol->fd_base[fd] != vol->fd_base[fildes])
+            continue;
+        vol->fd_dirEnt[fd].dir_fileSize = length;
+        vol->fd_ra_end[fd] = 0;
+    }
+    vol->fd_dirEnt[fildes].dir_fileSize = length;
+    short int date, tim;
+    get_date_time(&date, &tim);
+    vol->fd_dirEnt[fildes].dir_wrtDate = date;
+    vol->fd_dirEnt[fildes].dir_wrtTime = tim;
+    defer_dirEnt(vol, fildes);
+    flush_dirEnts(vol, vol->dirEnt_delay_ms);
+    return 1;
+}
+
+/**
+* Follow a cluster chain for fat_check, claiming each of its clusters. The
+* walk stops at a cluster that was claimed before, so a chain that loops or
+* joins another one counts as a cross link and is never walked twice.
+* @param st The check
+* @param cluster The first cluster of the chain
+* @param runs If not NULL and any cluster was claimed, initialized with
+*   the runs of the claimed clusters
+* @return The number of clusters claimed
+*/
+int check_chain(check_state * st, int cluster, extent_map * runs)   {
+    fat_volume * vol = st->vol;
+    int length = 0;
+    while (1)   {
+        if (cluster < 2 || cluster >= vol->CountofClusters + 2) {
+            __atomic_add_fetch(&st->report->bad_chains, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        unsigned int bit = 1u << (cluster % 32);
+        if (__atomic_fetch_or(&st->claimed[cluster / 32], bit, __ATOMIC_RELAXED) & bit)  {
+            __atomic_add_fetch(&st->report->cross_links, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (runs != NULL)   {
+            if (length == 0)
+                extent_map_init(runs, cluster);
+            else
+                extent_map_append(runs, cluster, 1);
+        }
+        length ++;
+        int next = vol->fat->next(vol, cluster);
+        if (next >= vol->fat->eoc_min)
+            break;
+        cluster = next;
+    }
+    return length;
+}
+
+/**
+* Push a directory for a thread of fat_check to read
+* @param st The check
+* @param cluster The first cluster of the directory
+*/
+void check_push(check_state * st, int cluster)  {
+    pthread_mutex_lock(&st->lock);
+    if (st->stack_count == st->stack_capacity)  {
+        st->stack_capacity *= 2;
+        st->stack = (int *) realloc(st->stack, sizeof(int) * st->stack_capacity);
+    }
+    st->stack[st->stack_count ++] = cluster;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+* Check a block of directory entries for fat_check. The chain of each file
+* is claimed and measured against its size; each subdirectory is pushed.
+* @param st The check
+* @param entries The entries
+* @param count The number of entries
+* @return 0 once the end of the directory has been seen, 1 otherwise
+*/
+int check_entries(check_state * st, const dirEnt * entries, int count)  {
+    fat_volume * vol = st->vol;
+    fat_check_report * report = st->report;
+    long long bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    int i;
+    for (i = 0; i < count; i ++)    {
+        const dirEnt * de = &entries[i];
+        if (de->dir_name[0] == 0)   //First byte 0 means no more
+            return 0;
+        //Skip free entries, long name parts, the volume label, . and ..
+        if (de->dir_name[0] == 0xE5 || (de->dir_attr & 0x08) || de->dir_name[0] == '.')
+            continue;
+
+        int first = de->dir_fstClusLO;
+        if (vol->fsys_type == 0x02)
+            first |= de->dir_fstClusHI << 16;
+        if (de->dir_attr & 0x10)    {
+            __atomic_add_fetch(&report->directories, 1, __ATOMIC_RELAXED);
+            if (first == 0) //Cluster 0 would be read as the root
+                __atomic_add_fetch(&report->bad_chains, 1, __ATOMIC_RELAXED);
+            else
+                check_push(st, first);
+            continue;
+        }
+
+        __atomic_add_fetch(&report->files, 1, __ATOMIC_RELAXED);
+        int length = first == 0 ? 0 : check_chain(st, first, NULL);
+        long long need = (de->dir_fileSize + bytesPerClus - 1) / bytesPerClus;
+        if (length < need || length > (need > 0 ? need : 1))    //Empty files may hold one cluster
+            __atomic_add_fetch(&report->size_mismatches, 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/**
+* Claim the chain of a directory for fat_check and check its entries. Each
+* run of contiguous clusters is read with one call per DIR_READ_CLUSTERS.
+* @param st The check
+* @param cluster The first cluster of the directory, 0 for the root
+*/
+void check_dir(check_state * st, int cluster)   {
+    fat_volume * vol = st->vol;
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * bps;
+    if (cluster == 0 && vol->fsys_type == 0x01) {   //FAT16 root is a fixed region
+        int count = vol->bpb_struct.BPB_RootEntCnt;
+        dirEnt * entries = (dirEnt *) malloc(sizeof(dirEnt) * count);
+        if (cache_read(vol, (char*)entries, count * sizeof(dirEnt),
+            (off_t) vol->root_sec * bps, 0) == count * (int)sizeof(dirEnt))
+            check_entries(st, entries, count);
+        free(entries);
+        return;
+    }
+    if (cluster == 0)
+        cluster = vol->ebr_fat32.BPB_RootClus;
+
+    extent_map runs;
+    if (check_chain(st, cluster, &runs) == 0)
+        return;
+    dirEnt * buf = (dirEnt *) malloc(DIR_READ_CLUSTERS * bytesPerClus);
+    int more = 1;
+    int i;
+    for (i = 0; i < runs.count && more; i ++)   {
+        extent * e = &runs.extents[i];
+        int done;
+        for (done = 0; done < e->length && more; done += DIR_READ_CLUSTERS)    {
+            int n = e->length - done < DIR_READ_CLUSTERS ? e->length - done : DIR_READ_CLUSTERS;
+            int sector = (e->cluster + done - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+            if (cache_read(vol, (char*)buf, n * bytesPerClus, (off_t) sector * bps, 0) < n * bytesPerClus)
+                break;
+            more = check_entries(st, buf, n * bytesPerClus / sizeof(dirEnt));
+        }
+    }
+    free(buf);
+    extent_map_free(&runs);
+}
+
+/**
+* Scan runs of FAT sectors for fat_check until none is left. Allocated
+* clusters that no chain claimed are lost, unless they are marked bad, and
+* each sector is compared with the other copies of the FAT.
+* @param st The check, with every chain claimed
+*/
+void check_segments(check_state * st)   {
+    fat_volume * vol = st->vol;
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int per_sec = bps / vol->fat->entry_bytes;
+    char * copy_buf = (char *) malloc(CHECK_SEGMENT_SECTORS * bps);
+    int used = 0, lost = 0, mismatches = 0;
+    while (1)   {
+        int first = __atomic_fetch_add(&st->next_segment, CHECK_SEGMENT_SECTORS, __ATOMIC_RELAXED);
+        if (first >= vol->fat_num_sec)
+            break;
+        int nsec = vol->fat_num_sec - first < CHECK_SEGMENT_SECTORS ?
+            vol->fat_num_sec - first : CHECK_SEGMENT_SECTORS;
+
+        //A group of 32 entries never spans two FAT sectors
+        int group = first * per_sec / 32;
+        int end = (first + nsec) * per_sec / 32;
+        if (end > vol->free_bitmap_words)
+            end = vol->free_bitmap_words;
+        for (; group < end; group ++)   {
+            unsigned int claimed = st->claimed[group];
+            unsigned int unreached = ~vol->free_bitmap[group] & ~claimed;
+            clip_free_masks(vol, group, 1, &unreached);
+            used += __builtin_popcount(claimed);
+            while (unreached != 0)  {
+                int cluster = group * 32 + __builtin_ctz(unreached);
+                if (vol->fat->next(vol, cluster) != vol->fat->eoc_min - 1)
+                    lost ++;
+                unreached &= unreached - 1;
+            }
+        }
+
+        int copy;
+        for (copy = 1; copy < vol->fat_copies; copy ++)  {
+            off_t pos = (off_t)(vol->fat_first_sec + copy * vol->fat_num_sec + first) * bps;
+            if (volume_read(vol, copy_buf, nsec * bps, pos) != nsec * bps)  {
+                mismatches += nsec;
+                continue;
+            }
+            int sec;
+            for (sec = 0; sec < nsec; sec ++)
+                if (memcmp(copy_buf + sec * bps, vol->fat_table + (first + sec) * bps, bps) != 0)
+                    mismatches ++;
+        }
+    }
+    free(copy_buf);
+
+    __atomic_add_fetch(&st->report->used_clusters, used, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->report->lost_clusters, lost, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->report->fat_mismatches, mismatches, __ATOMIC_RELAXED);
+}
+
+/**
+* Run one thread of fat_check. Directories are read off the stack until it
+* is empty with no thread left to push more; every chain has then been
+* claimed, so the thread moves on to scanning the FAT.
+* @param arg The check
+* @return NULL
+*/
+void * check_worker(void * arg) {
+    check_state * st = (check_state *) arg;
+    pthread_mutex_lock(&st->lock);
+    while (1)   {
+        while (st->stack_count == 0 && st->busy > 0)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->stack_count == 0)   //The walk is over
+            break;
+        int cluster = st->stack[-- st->stack_count];
+        st->busy ++;
+        pthread_mutex_unlock(&st->lock);
+        check_dir(st, cluster);
+        pthread_mutex_lock(&st->lock);
+        st->busy --;
+    }
+    pthread_cond_broadcast(&st->cond);  //Let the waiting threads see the end too
+    pthread_mutex_unlock(&st->lock);
+
+    check_segments(st);
+    return NULL;
+}
+
+/**
+* Read the free count of the FAT32 FSInfo sector from the volume
+* @param vol The volume
+* @return The free count, or -1 if there is no valid FSInfo sector or the
+*   count is unknown
+*/
+int recorded_free_count(fat_volume * vol)   {
+    FSInfo fsinfo;
+    if (vol->fsys_type != 0x02 || vol->ebr_fat32.BPB_FSInfo <= 0 ||
+        volume_read(vol, &fsinfo, sizeof(FSInfo),
+        (off_t) vol->ebr_fat32.BPB_FSInfo * vol->bpb_struct.BPB_BytsPerSec) != sizeof(FSInfo))
+        return -1;
+    if (fsinfo.FSI_LeadSig != 0x41615252 || fsinfo.FSI_StrucSig != 0x61417272 ||
+        fsinfo.FSI_TrailSig != (int) 0xAA550000)
+        return -1;
+    if (fsinfo.FSI_Free_Count < 0 || fsinfo.FSI_Free_Count > vol->CountofClusters)
+        return -1;
+    return fsinfo.FSI_Free_Count;
+}
+
+/**
+* Check the consistency of a volume: walk the directory tree from the root
+* following every chain, then scan the FAT for lost clusters and compare its
+* copies. Subtrees and FAT segments are spread over a pool of threads that
+* read the in-memory FAT without locks, so it must not change meanwhile.
+* @param vol The volume
+* @param nthreads The number of threads, or 0 for one per processor
+* @param report Where the results are stored
+* @return 1 on success
+*/
+int check_volume(fat_volume * vol, int nthreads, fat_check_report * report)    {
+    if (nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > CHECK_MAX_THREADS)
+        nthreads = CHECK_MAX_THREADS;
+
+    memset(report, 0, sizeof(fat_check_report));
+    report->free_clusters = count_free_clusters(vol);   //Pages in the whole FAT
+    report->recorded_free = recorded_free_count(vol);
+    report->journal_pending = vol->journal_pending;
+    report->directories = 1;    //The root
+
+    check_state st;
+    memset(&st, 0, sizeof(check_state));
+    st.vol = vol;
+    st.report = report;
+    st.claimed = (unsigned int *) calloc(vol->free_bitmap_words, sizeof(unsigned int));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    st.stack_capacity = 64;
+    st.stack = (int *) malloc(sizeof(int) * st.stack_capacity);
+    st.stack[st.stack_count ++] = 0;
+
+    //The calling thread is one of the workers
+    pthread_t threads[CHECK_MAX_THREADS];
+    int started = 0;
+    while (started < nthreads - 1 &&
+        pthread_create(&threads[started], NULL, check_worker, &st) == 0)
+        started ++;
+    check_worker(&st);
+    int i;
+    for (i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+
+    free(st.stack);
+    free(st.claimed);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    return 1;
+}
+
+/**
+* Write dirty FAT sectors, the FSInfo sector and dirty blocks in the block
+* cache to the volume. With a journal they are committed to it first, with
+* one fdatasync for all of them, and the journal is emptied once they are
+* on the image.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int flush_volume(fat_volume * vol)  {
+    if (journal_commit(vol) == -1)
+        return -1;  //Nothing may be written in place
+
+    int ret = 1;
+    if (flush_fat(vol) == -1)
+        ret = -1;
+    if (cache_flush(vol) == -1)
+        ret = -1;
+    if (vol->volume_map != NULL && msync(vol->volume_map, vol->volume_size, MS_SYNC) == -1)
+        ret = -1;
+    if (fsync(vol->fat_fd) == -1)
+        ret = -1;
+    if (ret == 1 && vol->journal_fd != -1)  {
+        if (ftruncate(vol->journal_fd, 0) == -1)
+            ret = -1;
+        else
+            vol->journal_end = 0;
+    }
+    return ret;
+}
+
+/**
+* Group commit for a journaled volume. Dirty blocks are held in the block
+* cache until the journal has them, so once they outgrow its budget they
+* are committed and written in place.
+* @param vol The volume
+*/
+void journal_trim(fat_volume * vol) {
+    if (vol->journal_fd != -1 && vol->cache_count > vol->cache_max_blocks)
+        flush_volume(vol);
+}
+
+/**
+* Flush all cached changes to the volume: pending dirENT updates, dirty FAT
+* sectors, the FSInfo sector and dirty blocks in the block cache. A
+* read-only volume has nothing to flush.
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int sync_volume(fat_volume * vol)   {
+    if (vol->read_only)
+        return 1;
+
+    int ret = 1;
+    if (flush_dirEnts(vol, 0) == -1)
+        ret = -1;
+    if (flush_volume(vol) == -1)
+        ret = -1;
+    return ret;
+}
+
+/**
+* Write the deferred dirENT changes of an opened file, then flush all
+* cached changes to the volume as OS_sync does
+* @param vol The volume
+* @param fildes The file descriptor
+* @return 1 on success, -1 on failure
+*/
+int sync_file(fat_volume * vol, int fildes)    {
+    if (fildes < 0 || fildes >= NUM_FD || vol->fd_base[fildes] == -1)
+        return -1;
+
+    int ret = flush_fd_dirEnt(vol, fildes);
+    if (sync_volume(vol) == -1)
+        ret = -1;
+    return ret;
+}
+
+/**
+* Count the runs of contiguous clusters in a chain
+* @param vol The volume
+* @param cluster The first cluster of the chain
+* @param clusters Set to the number of clusters in the chain
+* @return The number of runs, or -1 if the chain loops
+*/
+int chain_extents(fat_volume * vol, int cluster, int * clusters)   {
+    int runs = 0, total = 0;
+    while (cluster != -1)   {
+        if (runs == vol->CountofClusters)
+            return -1;
+        total += vol->fat->chain_run(vol, cluster, INT_MAX, &cluster);
+        runs ++;
+    }
+    *clusters = total;
+    return runs;
+}
+
+/**
+* Add a file to the plan of fat_defrag if it is fragmented and not open;
+* an open file's descriptors map its clusters, so it is left where it is
+* @param vol The volume
+* @param plan The plan
+* @param de The short directory entry of the file
+* @param parent_cluster The first cluster of the directory holding it
+* @param pos The volume offset of the entry
+*/
+void defrag_add(fat_volume * vol, defrag_plan * plan, const dirEnt * de, int parent_cluster, off_t pos)    {
+    int first = de->dir_fstClusLO;
+    if (vol->fsys_type == 0x02)
+        first |= de->dir_fstClusHI << 16;
+    if (first < 2)  //Empty files have no chain
+        return;
+
+    int clusters;
+    int extents = chain_extents(vol, first, &clusters);
+    if (extents == -1)
+        return;
+    plan->report->files ++;
+    plan->report->extents_before += extents;
+
+    int open = 0;
+    int fd;
+    for (fd = 2; fd < NUM_FD; fd ++)
+        if (vol->fd_base[fd] == first)
+            open = 1;
+    if (extents == 1 || open)   {
+        plan->report->extents_after += extents;
+        return;
+    }
+
+    if (plan->count == plan->capacity)  {
+        plan->capacity = plan->capacity == 0 ? 64 : plan->capacity * 2;
+        plan->files = (defrag_file *) realloc(plan->files, sizeof(defrag_file) * plan->capacity);
+    }
+    defrag_file * f = &plan->files[plan->count ++];
+    f->entry_pos = pos;
+    f->parent_cluster = parent_cluster;
+    f->cluster = first;
+    f->clusters = clusters;
+    f->extents = extents;
+    f->target = 0;
+}
+
+/**
+* Add the files of a directory and its subdirectories to the plan of
+* fat_defrag
+* @param vol The volume
+* @param plan The plan
+* @param cluster The first cluster of the directory, 0 for the root
+* @param depth The number of directories above it
+*/
+void defrag_collect(fat_volume * vol, defrag_plan * plan, int cluster, int depth)   {
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * bps;
+    int curr = dir_key(vol, cluster);
+    int max_entries = (curr == 0) ? vol->bpb_struct.BPB_RootEntCnt :
+        DIR_READ_CLUSTERS * bytesPerClus / sizeof(dirEnt);
+    dirEnt * block = (dirEnt *) malloc(sizeof(dirEnt) * max_entries);
+    while (curr != -1)  {
+        off_t pos;
+        int count;
+        if (curr == 0)  {   //FAT16 root is a fixed region
+            pos = (off_t) vol->root_sec * bps;
+            count = cache_read(vol, (char*)block, max_entries * sizeof(dirEnt), pos, 0) / (int)sizeof(dirEnt);
+            curr = -1;
+        } else  {
+            pos = (off_t)((curr - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec) * bps;
+            count = read_dir_run(vol, &curr, block, DIR_READ_CLUSTERS);
+        }
+        if (count <= 0)
+            break;
+
+        int i;
+        for (i = 0; i < count; i ++)    {
+            const dirEnt * de = &block[i];
+            if (de->dir_name[0] == 0)   {   //First byte 0 means no more
+                free(block);
+                return;
+            }
+            //Skip free entries, long name parts, the volume label, . and ..
+            if (de->dir_name[0] == 0xE5 || (de->dir_attr & 0x08) || de->dir_name[0] == '.')
+                continue;
+
+            if (!(de->dir_attr & 0x10))
+                defrag_add(vol, plan, de, cluster, pos + i * sizeof(dirEnt));
+            else if (depth < DEFRAG_MAX_DEPTH && (de->dir_fstClusLO != 0 || de->dir_fstClusHI != 0))
+                defrag_collect(vol, plan, (de->dir_fstClusHI << 16) | de->dir_fstClusLO, depth + 1);
+        }
+    }
+    free(block);
+}
+
+/**
+* Order the files of a fat_defrag plan largest first, so the longest free
+* runs go to the files that need them
+*/
+int compare_defrag_files(const void * a, const void * b)    {
+    return ((const defrag_file *) b)->clusters - ((const defrag_file *) a)->clusters;
+}
+
+/**
+* Copy a fragmented file into a run of free clusters, which is chained in
+* the FAT. The pieces of the old chain are gathered into buf with one read
+* each and written to the run DEFRAG_COPY_CLUSTERS at a time. Nothing
+* points at the run until defrag_relink.
+* @param vol The volume
+* @param f The file; its target is set if it was copied
+* @param buf A buffer of DEFRAG_COPY_CLUSTERS clusters
+* @return 1 if the file was copied, 0 if no free run is long enough,
+*   -1 on failure
+*/
+int defrag_copy(fat_volume * vol, defrag_file * f, char * buf)    {
+    int length;
+    int target = find_free_run(vol, f->clusters, &length);
+    if (target == -1 || length < f->clusters)
+        return 0;
+    set_cluster_run(vol, target, f->clusters);
+
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * bps;
+    int src = f->cluster;
+    int done = 0;
+    while (done < f->clusters)  {
+        int filled = 0;
+        while (src != -1 && filled < DEFRAG_COPY_CLUSTERS) {
+            int next;
+            int run = vol->fat->chain_run(vol, src, DEFRAG_COPY_CLUSTERS - filled, &next);
+            int sector = (src - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+            if (cache_read(vol, buf + filled * bytesPerClus, run * bytesPerClus,
+                (off_t) sector * bps, 1) != run * bytesPerClus)  {
+                free_cluster_chain(vol, target);
+                return -1;
+            }
+            filled += run;
+            src = next;
+        }
+
+        int sector = (target + done - 2) * vol->bpb_struct.BPB_SecPerClus + vol->data_sec;
+        if (filled == 0 || cache_write(vol, buf, filled * bytesPerClus,
+            (off_t) sector * bps, 1) != filled * bytesPerClus)   {
+            free_cluster_chain(vol, target);
+            return -1;
+        }
+        done += filled;
+    }
+
+    f->target = target;
+    return 1;
+}
+
+/**
+* Point the directory entry of a copied file at its new chain
+* @param vol The volume
+* @param f The file
+* @return 1 on success, -1 on failure
+*/
+int defrag_relink(fat_volume * vol, defrag_file * f)    {
+    dirEnt entry;
+    if (cache_read(vol, (char*)&entry, sizeof(dirEnt), f->entry_pos, 0) != sizeof(dirEnt))
+        return -1;
+    entry.dir_fstClusLO = f->target & 0xFFFF;
+    entry.dir_fstClusHI = vol->fsys_type == 0x02 ? f->target >> 16 : 0;
+    if (cache_write(vol, (char*)&entry, sizeof(dirEnt), f->entry_pos, 0) != sizeof(dirEnt))
+        return -1;
+    dir_update(vol, f->parent_cluster, &entry);
+    return 1;
+}
+
+/**
+* Defragment the files below a directory, or a single file. Each fragmented
+* file that is not open is copied into a free run long enough to hold its
+* whole chain, largest files first; a file for which there is no such run
+* stays as it is. Files are moved in batches of DEFRAG_BATCH_CLUSTERS.
+* With a journal each batch commits atomically. Without one, the copies
+* reach the volume before any directory entry points at them, and the
+* entries before the old chains are freed, so a crash can at worst leave
+* lost clusters.
+* @param vol The volume
+* @param path A file or directory, or NULL for the whole volume
+* @param report Where the counts are stored
+* @return 1 on success, -1 on failure
+*/
+int defrag_volume(fat_volume * vol, const char * path, fat_defrag_report * report)    {
+    memset(report, 0, sizeof(fat_defrag_report));
+    defrag_plan plan;
+    memset(&plan, 0, sizeof(defrag_plan));
+    plan.report = report;
+
+    int cluster = resolve_dir(vol, path == NULL ? "/" : path);
+    if (cluster != -1)  {
+        defrag_collect(vol, &plan, cluster, 0);
+    } else  {
+        dirEnt file;
+        int parent_cluster;
+        if (lookup_path(vol, &file, &parent_cluster, path) != 1)
+            return -1;
+        int i = find_dirEnt_match(vol, parent_cluster, file);
+        if (i < 0)
+            return -1;
+        defrag_add(vol, &plan, &file, parent_cluster, dirEnt_offset(vol, parent_cluster, i));
+    }
+    qsort(plan.files, plan.count, sizeof(defrag_file), compare_defrag_files);
+
+    int bytesPerClus = vol->bpb_struct.BPB_SecPerClus * vol->bpb_struct.BPB_BytsPerSec;
+    char * buf = (char *) malloc(DEFRAG_COPY_CLUSTERS * bytesPerClus);
+    int staged = vol->journal_fd == -1;    //Without a journal, each step is flushed before the next
+    int ret = 1;
+    int first = 0;
+    while (first < plan.count && ret == 1)  {
+        int last = first, batch = 0;
+        while (last < plan.count && batch < DEFRAG_BATCH_CLUSTERS)  {
+            int copied = defrag_copy(vol, &plan.files[last], buf);
+            if (copied == -1)   {
+                ret = -1;
+                break;
+            }
+            if (copied)
+                batch += plan.files[last].clusters;
+            last ++;
+        }
+        if (staged && ret == 1 && flush_volume(vol) == -1)
+            ret = -1;
+
+        int i;
+        for (i = first; i < last && ret == 1; i ++)
+            if (plan.files[i].target != 0 && defrag_relink(vol, &plan.files[i]) == -1)
+                ret = -1;
+        if (staged && ret == 1 && flush_volume(vol) == -1)
+            ret = -1;
+        if (ret == -1)  //The old chains stay in use; the copies are at worst lost clusters
+            break;
+
+        for (i = first; i < last; i ++) {
+            defrag_file * f = &plan.files[i];
+            if (f->target == 0) {
+                report->extents_after += f->extents;
+                continue;
+            }
+            free_cluster_chain(vol, f->cluster);
+            report->moved_files ++;
+            report->moved_clusters += f->clusters;
+            report->extents_after ++;
+        }
+        if (flush_volume(vol) == -1)
+            ret = -1;
+        first = last;
+    }
+
+    free(buf);
+    free(plan.files);
+    return ret;
+}
+
+fat_volume * mounted_volumes = NULL;    //Every mounted volume, flushed at exit
+pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER; //Guards mounted_volumes
+fat_volume * default_vol = NULL;        //Volume used by the OS_* functions
+int exit_hook_set = 0;                  //1 once sync_at_exit is registered
+pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;   //Guards mounting default_vol
+
+/**
+* Stop the asynchronous workers of a volume once they have run every queued
+* request
+* @param vol The volume
+*/
+void async_shutdown(fat_volume * vol)   {
+    pthread_mutex_lock(&vol->async_lock);
+    vol->async_stop = 1;
+    pthread_cond_broadcast(&vol->async_cond);
+    pthread_mutex_unlock(&vol->async_lock);
+
+    int i;
+    for (i = 0; i < vol->async_nthreads; i ++)
+        pthread_join(vol->async_threads[i], NULL);
+    vol->async_nthreads = 0;
+}
+
+/**
+* Write the deferred dirENT updates of a volume once they are
+* dirEnt_delay_ms old, so the size and time of a file that is no longer
+* written reach its entry without waiting for a close or sync. Runs from
+* mount until flusher_shutdown.
+* @param arg The volume
+* @return NULL
+*/
+void * dirEnt_flusher(void * arg)  {
+    fat_volume * vol = (fat_volume *) arg;
+    pthread_mutex_lock(&vol->flush_lock);
+    while (!vol->flush_stop)    {
+        if (vol->flush_due == 0)    {
+            pthread_cond_wait(&vol->flush_cond, &vol->flush_lock);
+            continue;
+        }
+        long wait = vol->flush_due - now_ms();
+        if (wait > 0)   {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait / 1000;
+            deadline.tv_nsec += (wait % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&vol->flush_cond, &vol->flush_lock, &deadline);
+            continue;
+        }
+        vol->flush_due = 0;
+        pthread_mutex_unlock(&vol->flush_lock);
+
+        //Updates deferred since the wait began are left for a later round
+        pthread_rwlock_wrlock(&vol->lock);
+        flush_dirEnts(vol, vol->dirEnt_delay_ms);
+        long oldest = 0;
+        int fd;
+        for (fd = 0; fd < NUM_FD; fd ++)    {
+            if (vol->fd_base[fd] != -1 && vol->fd_dirEnt_dirty[fd] &&
+                (oldest == 0 || vol->fd_dirty_since[fd] < oldest))
+                oldest = vol->fd_dirty_since[fd];
+        }
+        journal_trim(vol);
+        pthread_rwlock_unlock(&vol->lock);
+
+        pthread_mutex_lock(&vol->flush_lock);
+        if (oldest != 0 && (vol->flush_due == 0 || oldest + vol->dirEnt_delay_ms < vol->flush_due))
+            vol->flush_due = oldest + vol->dirEnt_delay_ms;
+    }
+    pthread_mutex_unlock(&vol->flush_lock);
+    return NULL;
+}
+
+/**
+* Stop the dirENT flusher of a volume, if it runs. Updates it has not
+* written yet are left for the final sync.
+* @param vol The volume
+*/
+void flusher_shutdown(fat_volume * vol) {
+    if (!vol->flush_running)
+        return;
+    pthread_mutex_lock(&vol->flush_lock);
+    vol->flush_stop = 1;
+    pthread_cond_signal(&vol->flush_cond);
+    pthread_mutex_unlock(&vol->flush_lock);
+    pthread_join(vol->flush_thread, NULL);
+    vol->flush_running = 0;
+}
+
+/**
+* Flush cached changes of every mounted volume when the process exits
+* normally. The volume lock keeps out a dirENT flusher that is running.
+*/
+void sync_at_exit() {
+    fat_volume * vol;
+    for (vol = mounted_volumes; vol != NULL; vol = vol->next)   {
+        pthread_rwlock_wrlock(&vol->lock);
+        sync_volume(vol);
+        pthread_rwlock_unlock(&vol->lock);
+    }
+}
+
+/**
+* Format an image as an empty FAT16 or FAT32 volume, sized by the rules of
+* the FAT specification with 512 byte sectors and two FATs. The image is
+* truncated first, so it is sparse apart from the sectors written here. A
+* journal left beside it by the old volume is removed.
+* @param path The path to the image, created if it does not exist
+* @param size The size of the volume in bytes
+* @param cluster_bytes The cluster size, a power of two from 512 to 32768
+* @param fat_type 16 or 32, or 0 to use FAT16 if the volume is small enough
+* @return 1 on success, -1 if the volume cannot be formatted as asked
+*/
+int fat_mkfs(const char * path, long long size, int cluster_bytes, int fat_type)  {
+    int bps = 512;
+    long long total = size / bps;
+    if (cluster_bytes < bps || cluster_bytes > 32768 || (cluster_bytes & (cluster_bytes - 1)) != 0 ||
+        total > INT_MAX)    //BPB_TotSec32 is read as a signed int
+        return -1;
+    int spc = cluster_bytes / bps;
+
+    //Size the FAT for each allowed type until the cluster count fits it
+    int fat32, rsvd = 0, root_secs = 0, fat_size = 0;
+    long long clusters = 0;
+    for (fat32 = 0; fat32 <= 1; fat32 ++)   {
+        if ((fat_type == 16 && fat32) || (fat_type == 32 && !fat32))
+            continue;
+        rsvd = fat32 ? 32 : 1;
+        root_secs = fat32 ? 0 : FORMAT_ROOT_ENTRIES * sizeof(dirEnt) / bps;
+        long long per_sec = 256LL * spc + 2;
+        if (fat32)
+            per_sec /= 2;
+        fat_size = (total - (rsvd + root_secs) + per_sec - 1) / per_sec;
+        clusters = (total - rsvd - 2LL * fat_size - root_secs) / spc;
+        if (fat32 ? (clusters >= 65525 && clusters <= 0x0FFFFFF5) : (clusters >= 4085 && clusters < 65525))
+            break;
+    }
+    if (fat32 > 1)
+        return -1;
+
+    //Replaying the old volume's journal would write its metadata over the new one
+    char jpath[PATH_MAX];
+    snprintf(jpath, sizeof(jpath), "%s.journal", path);
+    if (unlink(jpath) == -1 && errno != ENOENT)
+        return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    int ret = ftruncate(fd, (off_t) total * bps) == 0 ? 1 : -1;
+
+    char sector[512];
+    memset(sector, 0, sizeof(sector));
+    BPB_Structure * bpb = (BPB_Structure *) sector;
+    memcpy(bpb->BS_jmpBoot, fat32 ? "\xEB\x58\x90" : "\xEB\x3C\x90", 3);
+    memcpy(bpb->BS_OEMName, "MSWIN4.1", 8);
+    bpb->BPB_BytsPerSec = bps;
+    bpb->BPB_SecPerClus = spc;
+    bpb->BPB_RsvdSecCnt = rsvd;
+    bpb->BPB_NumFATs = 2;
+    bpb->BPB_RootEntCnt = fat32 ? 0 : FORMAT_ROOT_ENTRIES;
+    bpb->BPB_TotSec16 = (!fat32 && total < 32768) ? total : 0;   //Read as a signed short
+    bpb->BPB_Media = (char) 0xF8;
+    bpb->BPB_FATSz16 = fat32 ? 0 : fat_size;
+    bpb->BPB_SecPerTrk = 63;
+    bpb->BPB_NumHeads = 255;
+    bpb->BPB_TotSec32 = bpb->BPB_TotSec16 != 0 ? 0 : total;
+    if (fat32)  {
+        EBR_FAT32 * ebr = (EBR_FAT32 *) (sector + sizeof(BPB_Structure));
+        ebr->BPB_FATSz32 = fat_size;
+        ebr->BPB_RootClus = 2;
+        ebr->BPB_FSInfo = 1;
+        ebr->BPB_BkBootSec = 6;
+        ebr->BS_DrvNum = (char) 0x80;
+        ebr->BS_BootSig = 0x29;
+        ebr->BS_VolID = (int) time(NULL);
+        memcpy(ebr->BS_VolLab, "NO NAME    ", 11);
+        memcpy(ebr->BS_FilSysType, "FAT32   ", 8);
+    } else  {
+        EBR_FAT16 * ebr = (EBR_FAT16 *) (sector + sizeof(BPB_Structure));
+        ebr->BS_DrvNum = (char) 0x80;
+        ebr->BS_BootSig = 0x29;
+        ebr->BS_VolID = (int) time(NULL);
+        memcpy(ebr->BS_VolLab, "NO NAME    ", 11);
+        memcpy(ebr->BS_FilSysType, "FAT16   ", 8);
+    }
+    sector[510] = 0x55;
+    sector[511] = (char) 0xAA;
+    if (pwrite(fd, sector, bps, 0) != bps || (fat32 && pwrite(fd, sector, bps, 6 * bps) != bps))
+        ret = -1;
+
+    if (fat32)  {   //The root directory takes cluster 2
+        FSInfo fsinfo;
+        memset(&fsinfo, 0, sizeof(FSInfo));
+        fsinfo.FSI_LeadSig = 0x41615252;
+        fsinfo.FSI_StrucSig = 0x61417272;
+        fsinfo.FSI_Free_Count = clusters - 1;
+        fsinfo.FSI_Nxt_Free = 3;
+        fsinfo.FSI_TrailSig = (int) 0xAA550000;
+        if (pwrite(fd, &fsinfo, sizeof(FSInfo), bps) != sizeof(FSInfo) ||
+            pwrite(fd, &fsinfo, sizeof(FSInfo), 7 * bps) != sizeof(FSInfo))
+            ret = -1;
+    }
+
+    //Entries 0 and 1 of each FAT are reserved; the rest is free. The root
+    //directory is already zeroed
+    memset(sector, 0, sizeof(sector));
+    if (fat32)  {
+        unsigned int * entries = (unsigned int *) sector;
+        entries[0] = 0x0FFFFFF8;
+        entries[1] = 0x0FFFFFFF;
+        entries[2] = 0x0FFFFFFF;
+    } else  {
+        unsigned short int * entries = (unsigned short int *) sector;
+        entries[0] = 0xFFF8;
+        entries[1] = 0xFFFF;
+    }
+    int copy;
+    for (copy = 0; copy < 2; copy ++)
+        if (pwrite(fd, sector, bps, (off_t)(rsvd + copy * fat_size) * bps) != bps)
+            ret = -1;
+
+    if (fsync(fd) == -1)
+        ret = -1;
+    close(fd);
+    return ret;
+}
+
+/**
+* Mount a FAT16 or FAT32 volume
+* @param path The path to the volume image
+* @param read_only 1 to open the image read-only and serve reads without locks
+* @return The volume, or NULL on failure
+*/
+fat_volume * mount_volume(const char * path, int read_only)   {
+    if (path == NULL)
+        return NULL;
+
+    fat_volume * vol = (fat_volume *) calloc(1, sizeof(fat_volume));
+    vol->read_only = read_only;
+    pthread_rwlock_init(&vol->lock, NULL);
+    pthread_mutex_init(&vol->fat_lock, NULL);
+    pthread_mutex_init(&vol->cache_lock, NULL);
+    pthread_mutex_init(&vol->dir_lock, NULL);
+    pthread_mutex_init(&vol->fd_lock, NULL);
+    pthread_cond_init(&vol->fd_idle, NULL);
+    pthread_mutex_init(&vol->async_lock, NULL);
+    pthread_cond_init(&vol->async_cond, NULL);
+    pthread_mutex_init(&vol->flush_lock, NULL);
+    pthread_cond_init(&vol->flush_cond, NULL);
+    int i;
+    for (i = 0; i < NUM_FD; i ++)
+        pthread_mutex_init(&vol->fd_mutex[i], NULL);
+    vol->verify_done = 2;
+    vol->journal_fd = -1;
+
+    if (init_fat(vol, path) == -1)  {
+        if (vol->fat_fd != -1)
+            close(vol->fat_fd);
+        if (vol->journal_fd != -1)
+            close(vol->journal_fd);
+        free(vol);
+        return NULL;
+    }
+
+    //dirENT updates deferred by writes are written once they have aged
+    if (!vol->read_only && vol->dirEnt_delay_ms > 0 &&
+        pthread_create(&vol->flush_thread, NULL, dirEnt_flusher, vol) == 0)
+        vol->flush_running = 1;
+
+    pthread_mutex_lock(&mount_lock);
+    if (!exit_hook_set) {
+        atexit(sync_at_exit);
+        exit_hook_set = 1;
+    }
+    vol->next = mounted_volumes;
+    mounted_volumes = vol;
+    pthread_mutex_unlock(&mount_lock);
+    return vol;
+}
+
+/**
+* Mount a FAT16 or FAT32 volume
+* @param path The path to the volume image
+* @return The volume, or NULL on failure
+*/
+fat_volume * fat_mount(const char * path)   {
+    return mount_volume(path, 0);
+}
+
+/**
+* Mount a FAT16 or FAT32 volume read-only
+* @param path The path to the volume image
+* @return The volume, or NULL on failure
+*/
+fat_volume * fat_mount_readonly(const char * path)  {
+    return mount_volume(path, 1);
+}
+
+/**
+* Flush and release a mounted volume once its queued asynchronous requests
+* have completed. Its file descriptors are closed.
+* @param vol The volume
+* @return 1 on success, -1 if the flush failed
+*/
+int fat_unmount(fat_volume * vol)   {
+    pthread_mutex_lock(&mount_lock);
+    fat_volume ** link = &mounted_volumes;
+    while (*link != NULL && *link != vol)
+        link = &(*link)->next;
+    if (*link != NULL)
+        *link = vol->next;
+    pthread_mutex_unlock(&mount_lock);
+
+    async_shutdown(vol);
+    flusher_shutdown(vol);
+    int ret = sync_volume(vol);
+    if (vol->verify_done != 2)
+        pthread_join(vol->verify_thread, NULL);
+
+    int i;
+    for (i = 2; i < NUM_FD; i ++)
+        if (vol->fd_base[i] != -1)
+            extent_map_free(&vol->fd_extents[i]);
+    for (i = 0; i < DIR_CACHE_BUCKETS; i ++)  { //Read-only volumes keep no LRU list
+        while (vol->dcache_buckets[i] != NULL)  {
+            dir_cache * dir = vol->dcache_buckets[i];
+            vol->dcache_buckets[i] = dir->hash_next;
+            dir_free(dir);
+        }
+    }
+    dentry_flush(vol);
+    while (vol->cache_lru != NULL)  {
+        cache_block * b = vol->cache_lru;
+        vol->cache_lru = b->lru_prev;
+        free(b->data);
+        free(b);
+    }
+    free(vol->cache_buckets);
+    free(vol->free_bitmap);
+    free(vol->fat_sec_loaded);
+    free(vol->fat_sec_dirty);
+    if (vol->volume_map != NULL)
+        munmap(vol->volume_map, vol->volume_size);
+    else
+        free(vol->fat_table);
+    close(vol->fat_fd);
+    if (vol->journal_fd != -1)
+        close(vol->journal_fd);
+
+    pthread_rwlock_destroy(&vol->lock);
+    pthread_mutex_destroy(&vol->fat_lock);
+    pthread_mutex_destroy(&vol->cache_lock);
+    pthread_mutex_destroy(&vol->dir_lock);
+    pthread_mutex_destroy(&vol->fd_lock);
+    pthread_cond_destroy(&vol->fd_idle);
+    pthread_mutex_destroy(&vol->async_lock);
+    pthread_cond_destroy(&vol->async_cond);
+    pthread_mutex_destroy(&vol->flush_lock);
+    pthread_cond_destroy(&vol->flush_cond);
+    for (i = 0; i < NUM_FD; i ++)
+        pthread_mutex_destroy(&vol->fd_mutex[i]);
+    free(vol);
+    return ret;
+}
+
+/**
+* Changes the current working directory of a volume
+* @param vol The volume
+* @param path The absolute or relative path of the directory
+* @return 1 on success, -1 on failure
+*/
+int fat_cd(fat_volume * vol, const char * path) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = change_dir(vol, path);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Opens a file of a volume. Runs alongside other lookups and reads, and
+* takes no lock on a read-only volume.
+* @param vol The volume
+* @param path The absolute or relative path of the file
+* @return The file descriptor to be used, or -1 on failure
+*/
+int fat_open(fat_volume * vol, const char * path)   {
+    if (vol->read_only)
+        return open_file(vol, path);
+
+    pthread_rwlock_rdlock(&vol->lock);
+    int ret = open_file(vol, path);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Close an opened file of a volume
+* @param vol The volume
+* @param fd The file descriptor of the file to be closed
+* @return 1 on success, -1 on failure
+*/
+int fat_close(fat_volume * vol, int fd) {
+    if (vol->read_only)
+        return close_file(vol, fd);
+
+    fd_wait_idle(vol, fd);  //Let queued asynchronous requests finish first
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = close_file(vol, fd);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Read from an opened file of a volume. Runs alongside other lookups and
+* reads, and takes no lock on a read-only volume.
+* @param vol The volume
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @return The number of bytes read, or -1 otherwise
+*/
+int fat_read(fat_volume * vol, int fildes, void * buf, int nbyte, int offset)   {
+    if (vol->read_only) {
+        if (fd_hold(vol, fildes) == -1)
+            return -1;
+        int ret = read_file(vol, fildes, buf, nbyte, offset);
+        fd_drop(vol, fildes);
+        return ret;
+    }
+
+    pthread_rwlock_rdlock(&vol->lock);
+    int ret = read_file(vol, fildes, buf, nbyte, offset);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* List a directory of a volume. Runs alongside other lookups and reads,
+* and takes no lock on a read-only volume.
+* @param vol The volume
+* @param dirname The path to the directory
+* @return An array of dirEnts to be freed by the caller, or NULL
+*/
+dirEnt * fat_readDir(fat_volume * vol, const char * dirname)    {
+    if (vol->read_only)
+        return read_dir(vol, dirname);
+
+    pthread_rwlock_rdlock(&vol->lock);
+    dirEnt * ret = read_dir(vol, dirname);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Open a stream over the entries of a directory of a volume
+* @param vol The volume
+* @param dirname The path to the directory
+* @return The stream, or NULL if the directory doesn't exist
+*/
+fat_dir * fat_opendir(fat_volume * vol, const char * dirname)   {
+    if (vol->read_only)
+        return open_dir(vol, dirname);
+
+    pthread_rwlock_wrlock(&vol->lock);
+    fat_dir * ret = open_dir(vol, dirname);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Get the next entry of a directory stream. Runs alongside other lookups
+* and reads, and takes no lock on a read-only volume.
+* @param dir The stream
+* @param dest Where the entry and its decoded name are stored
+* @return 1 if an entry was stored, 0 at the end, -1 on failure
+*/
+int fat_readdir_next(fat_dir * dir, fat_dirent * dest)  {
+    if (dir == NULL || dest == NULL)
+        return -1;
+    if (dir->vol->read_only)
+        return next_dir_entry(dir, dest);
+
+    pthread_rwlock_rdlock(&dir->vol->lock);
+    int ret = next_dir_entry(dir, dest);
+    pthread_rwlock_unlock(&dir->vol->lock);
+    return ret;
+}
+
+/**
+* Close a directory stream
+* @param dir The stream
+* @return 1 on success, -1 if dir is NULL
+*/
+int fat_closedir(fat_dir * dir) {
+    if (dir == NULL)
+        return -1;
+    close_dir(dir);
+    return 1;
+}
+
+/**
+* Create a directory on a volume
+* @param vol The volume
+* @param path The path to the directory
+* @return As for OS_mkdir
+*/
+int fat_mkdir(fat_volume * vol, const char * path)  {
+    if (vol->read_only)
+        return -1;
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = make_dir(vol, path);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Remove an empty directory from a volume
+* @param vol The volume
+* @param path The path to the directory
+* @return As for OS_rmdir
+*/
+int fat_rmdir(fat_volume * vol, const char * path)  {
+    if (vol->read_only)
+        return -1;
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = remove_dir(vol, path);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Remove a file from a volume
+* @param vol The volume
+* @param path The path to the file
+* @return As for OS_rm
+*/
+int fat_rm(fat_volume * vol, const char * path) {
+    if (vol->read_only)
+        return -1;
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = remove_file(vol, path);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Create a file on a volume
+* @param vol The volume
+* @param path The path to the file
+* @return As for OS_creat
+*/
+int fat_creat(fat_volume * vol, const char * path)  {
+    if (vol->read_only)
+        return -1;
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = create_file(vol, path);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
+
+/**
+* Write to an opened file of a volume
+* @param vol The volume
+* @param fildes The file descriptor
+* @param buf The buffer of bytes to be written
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @return The number of bytes written, or -1 on failure
+*/
+int fat_write(fat_volume * vol, int fildes, const void * buf, int nbytes, int offset)   {
+    if (vol->read_only)
+        return -1;
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = write_file(vol, fildes, buf, nbytes, offset);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    dirEnt toWrite;
-    toWrite.dir_attr = attr;
-    fill_dir_name(toWrite.dir_name, filename);
-    toWrite.dir_fileSize = 0;
+/**
+* Reserve clusters for an opened file of a volume
+* @param vol The volume
+* @param fildes The file descriptor
+* @param length The number of bytes to reserve space for
+* @return 1 on success, -1 on failure
+*/
+int fat_fallocate(fat_volume * vol, int fildes, int length) {
+    if (vol->read_only)
+        return -1;
 
-    //Find next available cluster to allocate
-    int next_cluster = find_free_cluster();
-    set_cluster_value(next_cluster, -1); 
-    available_clusters --;
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = allocate_file(vol, fildes, length);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    toWrite.dir_fstClusHI = (unsigned short int)(next_cluster >> 16);   //Will be 0 for FAT16
-    toWrite.dir_fstClusLO = (unsigned short int)(next_cluster & 0xFFFF);
+/**
+* Change the size of an opened file of a volume
+* @param vol The volume
+* @param fildes The file descriptor
+* @param length The new size in bytes
+* @return 1 on success, -1 on failure
+*/
+int fat_truncate(fat_volume * vol, int fildes, int length)  {
+    if (vol->read_only)
+        return -1;
 
-    get_date_time(&(toWrite.dir_wrtDate), &(toWrite.dir_wrtTime));
-    toWrite.dir_crtDate = toWrite.dir_wrtDate;
-    toWrite.dir_crtTime = toWrite.dir_wrtTime;
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = truncate_file(vol, fildes, length);
+    journal_trim(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    int parent_cluster = readDir_cluster;
-    write_dirEnt(parent_cluster, toWrite);
+/**
+* Flush all cached changes of a volume
+* @param vol The volume
+* @return 1 on success, -1 on failure
+*/
+int fat_sync(fat_volume * vol)  {
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = sync_volume(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    //If a directory, need to make . and .. entries
-    if (attr & 0x10)    {
-        toWrite.dir_name[0] = '.';
-        int i;
-        for (i = 1; i < 10; i ++)
-            toWrite.dir_name[i] = 0x20;
-        write_dirEnt(next_cluster, toWrite);
+/**
+* Flush the pending dirENT changes of an opened file of a volume, then all
+* cached changes of the volume
+* @param vol The volume
+* @param fildes The file descriptor
+* @return 1 on success, -1 on failure
+*/
+int fat_fsync(fat_volume * vol, int fildes) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = sync_file(vol, fildes);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-        toWrite.dir_name[1] = '.';
-        toWrite.dir_fstClusHI = (unsigned short int)(parent_cluster >> 16);
-        toWrite.dir_fstClusLO = (unsigned short int)(parent_cluster & 0xFFFF);
+/**
+* Get the allocation statistics of a volume. Runs alongside other lookups
+* and reads, and takes no lock on a read-only volume.
+* @param vol The volume
+* @param stats Where the statistics are stored
+* @return 1 on success, -1 on failure
+*/
+int fat_statfs(fat_volume * vol, fat_stats * stats) {
+    if (vol->read_only)
+        return stat_volume(vol, stats);
 
-        write_dirEnt(next_cluster, toWrite);
-    }
+    pthread_rwlock_rdlock(&vol->lock);
+    int ret = stat_volume(vol, stats);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    return 1;
+/**
+* Check the consistency of a volume. Pending changes are flushed first and
+* nothing else runs on the volume until the check is done; a read-only
+* volume is checked without locks.
+* @param vol The volume
+* @param nthreads The number of threads, or 0 for one per processor
+* @param report Where the results are stored
+* @return 1 on success, -1 if the pending changes could not be flushed
+*/
+int fat_check(fat_volume * vol, int nthreads, fat_check_report * report)  {
+    if (vol->read_only)
+        return check_volume(vol, nthreads, report);
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = sync_volume(vol) == -1 ? -1 : check_volume(vol, nthreads, report);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
 }
 
 /**
-* Remove a directory entry and clear the required information from the FAT
-* @param path The path to the directory entry to be removed
-* @param attr The attribute of the entry to be removed 
-*   (0x10 for directory, 0x20 for file)
-* @return 1 if removed, -1 if path is invalid
-    If attr = 0x10
-        -2 if path does not refer to a file
-        -3 if directory is not empty
-    If attr = 0x20
-        -2 if file is a directory
+* Defragment a file or the files below a directory of a volume
+* @param vol The volume
+* @param path A file or directory, or NULL for the whole volume
+* @param report Where the counts are stored
+* @return 1 on success, -1 on failure
 */
-int remove_dirEnt(const char * path, char attr) {
-    if (fat_fd == -1)   {
-        int err = init_fat();
-        if (err == -1)
-            return -1;
-    }
+int fat_defrag(fat_volume * vol, const char * path, fat_defrag_report * report)    {
+    if (vol->read_only)
+        return -1;
 
-    char *filename, *pathname;
-    pathname = malloc(sizeof(char) * strlen(path));
-    filename = malloc(sizeof(char) * strlen(path));
-    separate_path(filename, pathname, path);
+    pthread_rwlock_wrlock(&vol->lock);
+    int ret = defrag_volume(vol, path, report);
+    pthread_rwlock_unlock(&vol->lock);
+    return ret;
+}
 
-    dirEnt * current = OS_readDir(pathname);
+/**
+* Run queued asynchronous requests of a volume until async_shutdown. Each
+* request goes through fat_read or fat_write, so it takes the same locks
+* as a blocking call and overlaps with the requests of other workers.
+* Requests of one descriptor run and complete in the order they were
+* queued: a worker takes the oldest request whose descriptor is not busy.
+* @param arg The volume
+* @return NULL
+*/
+void * async_worker(void * arg) {
+    fat_volume * vol = (fat_volume *) arg;
+    pthread_mutex_lock(&vol->async_lock);
+    while (1)   {
+        async_request * prev = NULL;
+        async_request * req = vol->async_head;
+        while (req != NULL && vol->async_busy[req->fildes])    {
+            prev = req;
+            req = req->next;
+        }
+        if (req == NULL)    {
+            if (vol->async_stop && vol->async_head == NULL) //Nothing is left to run
+                break;
+            pthread_cond_wait(&vol->async_cond, &vol->async_lock);
+            continue;
+        }
 
-    if (current == NULL)
-        return -1;  //Invalid path
+        if (prev != NULL)
+            prev->next = req->next;
+        else
+            vol->async_head = req->next;
+        if (vol->async_tail == req)
+            vol->async_tail = prev;
+        vol->async_busy[req->fildes] = 1;
+        pthread_mutex_unlock(&vol->async_lock);
+
+        //The reference taken by async_submit keeps the descriptor open
+        int ret;
+        if (req->write)
+            ret = fat_write(vol, req->fildes, req->buf, req->nbytes, req->offset);
+        else if (vol->read_only)
+            ret = read_file(vol, req->fildes, req->buf, req->nbytes, req->offset);
+        else
+            ret = fat_read(vol, req->fildes, req->buf, req->nbytes, req->offset);
+        fd_drop(vol, req->fildes);
+        if (req->done != NULL)
+            req->done(ret, req->arg);
+
+        pthread_mutex_lock(&vol->async_lock);
+        vol->async_busy[req->fildes] = 0;
+        if (vol->async_head != NULL || vol->async_stop) //A waiting request may be runnable now
+            pthread_cond_broadcast(&vol->async_cond);
+        free(req);
+    }
+    pthread_mutex_unlock(&vol->async_lock);
+    return NULL;
+}
 
-    dirEnt file;
-    if (!findDirEntry(&file, current, filename, 0)) {
-        return -1;  //File does not exist
+/**
+* Queue a read or write for the asynchronous workers of a volume, starting
+* FAT_ASYNC_THREADS workers on first use. The request holds a reference on
+* its descriptor until it has run, so closing the descriptor waits for it.
+* @param vol The volume
+* @param req The request, freed once it has completed
+* @return 1 if queued, -1 if the descriptor is not open or no worker runs
+*/
+int async_submit(fat_volume * vol, async_request * req)   {
+    if (fd_hold(vol, req->fildes) == -1)    {
+        free(req);
+        return -1;
     }
 
-    //If it's a file, attr & 0x20 will be true
-    //If it's a directory, attr & 0x10 will be true
-    //rmdir returns -2 if the path doesn't refer to a file
-    //rm returns -2 if the path refers to a directory
-    if (!(file.dir_attr & attr))    {
-        return -2;
+    pthread_mutex_lock(&vol->async_lock);
+    if (vol->async_nthreads == 0 && !vol->async_stop)   {
+        char * threads = getenv("FAT_ASYNC_THREADS");
+        int count = threads != NULL ? atoi(threads) : ASYNC_DEFAULT_THREADS;
+        if (count < 1)
+            count = 1;
+        if (count > ASYNC_MAX_THREADS)
+            count = ASYNC_MAX_THREADS;
+        while (vol->async_nthreads < count && pthread_create(
+            &vol->async_threads[vol->async_nthreads], NULL, async_worker, vol) == 0)
+            vol->async_nthreads ++;
+    }
+    if (vol->async_nthreads == 0 || vol->async_stop)    {
+        pthread_mutex_unlock(&vol->async_lock);
+        fd_drop(vol, req->fildes);
+        free(req);
+        return -1;
     }
-   
-    int parent_cluster = readDir_cluster;
-    int cluster = (file.dir_fstClusHI << 16) | (file.dir_fstClusLO);
 
-    if (attr & 0x10)    {
-        //check if empty
-        //Make sure that only . and .. are contained in the directory
-        dirEnt * entries = read_cluster_dirEnt(cluster);
-        char name1[12], name2[12];
-        char currname[12];
-        strcpy(name1, ".          ");
-        strcpy(name2, "..         ");
-        currname[11] = '\0';
-        int i = 0;
-        while (1)   {
-            if (entries[i].dir_name[0] == 0)
-                break;
-            if (entries[i].dir_name[0] == 0xE5) {
-                i ++;
-                continue;
-            }
-            strncpy(currname, entries[i].dir_name, 11);
-            if (strcmp(name1, currname) != 0 && strcmp(name2, currname) != 0)   {
-                return -3;
-            }
+    req->next = NULL;
+    if (vol->async_tail != NULL)
+        vol->async_tail->next = req;
+    else
+        vol->async_head = req;
+    vol->async_tail = req;
+    pthread_cond_signal(&vol->async_cond);
+    pthread_mutex_unlock(&vol->async_lock);
+    return 1;
+}
 
-            i ++;
-        }
+/**
+* Queue a read from an opened file of a volume
+* @param vol The volume
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size, untouched until done is called
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @param done Called from a worker thread with the result of fat_read
+* @param arg Passed to done
+* @return 1 if queued, -1 on failure
+*/
+int fat_read_async(fat_volume * vol, int fildes, void * buf, int nbyte, int offset,
+    fat_async_callback done, void * arg)    {
+    async_request * req = (async_request *) malloc(sizeof(async_request));
+    req->write = 0;
+    req->fildes = fildes;
+    req->buf = buf;
+    req->nbytes = nbyte;
+    req->offset = offset;
+    req->done = done;
+    req->arg = arg;
+    return async_submit(vol, req);
+}
+
+/**
+* Queue a write to an opened file of a volume
+* @param vol The volume
+* @param fildes The file descriptor
+* @param buf The bytes to be written, which must stay valid until done is called
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @param done Called from a worker thread with the result of fat_write
+* @param arg Passed to done
+* @return 1 if queued, -1 on failure
+*/
+int fat_write_async(fat_volume * vol, int fildes, const void * buf, int nbytes, int offset,
+    fat_async_callback done, void * arg)    {
+    if (vol->read_only)
+        return -1;
+
+    async_request * req = (async_request *) malloc(sizeof(async_request));
+    req->write = 1;
+    req->fildes = fildes;
+    req->buf = (void *) buf;
+    req->nbytes = nbytes;
+    req->offset = offset;
+    req->done = done;
+    req->arg = arg;
+    return async_submit(vol, req);
+}
+
+/**
+* Get the volume used by the OS_* functions, mounting the volume named by
+* FAT_FS_PATH on first use. It is mounted read-only if FAT_READ_ONLY is set
+* to anything other than 0.
+* @return The volume, or NULL if it cannot be mounted
+*/
+fat_volume * default_volume()   {
+    fat_volume * vol = __atomic_load_n(&default_vol, __ATOMIC_ACQUIRE);
+    if (vol != NULL)
+        return vol;
+
+    pthread_mutex_lock(&default_lock);
+    if (default_vol == NULL)    {
+        char * read_only = getenv("FAT_READ_ONLY");
+        __atomic_store_n(&default_vol, mount_volume(getenv("FAT_FS_PATH"),
+            read_only != NULL && strcmp(read_only, "0") != 0), __ATOMIC_RELEASE);
     }
+    vol = default_vol;
+    pthread_mutex_unlock(&default_lock);
+    return vol;
+}
 
-    //Delete directory entry and empty FAT entry
-    //Can delete directory entry by changing Name[0] to 0xE5 and overwriting
-    //Find index of file in current
-    int i = find_dirEnt_match(parent_cluster, file);
-    file.dir_name[0] = 0xE5;
-    write_cluster(parent_cluster, (void*)&file, sizeof(dirEnt), i * sizeof(dirEnt));
-    set_cluster_value(cluster, 0);
-    available_clusters ++;
+/**
+* Changes the current working directory to the specified path
+* @param path The absolute or relative path of the file
+* @return 1 on success, -1 on failure
+*/
+int OS_cd(const char * path)    {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_cd(vol, path);
+}
 
-    return 1;
+/**
+* Opens a file specified by path to be read/written to
+* @param path The absolute or relative path of the file
+* @return The file descriptor to be used, or -1 on failure
+*/
+int OS_open(const char * path)  {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_open(vol, path);
+}
+
+/**
+* Close an opened file specified by fd
+* @param fd The file descriptor of the file to be closed
+* @return 1 on success, -1 on failure
+*/
+int OS_close(int fd) {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_close(vol, fd);
+}
+
+/**
+* Read nbytes of a file from offset into buf
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @return The number of bytes read, or -1 otherwise
+*/
+int OS_read(int fildes, void * buf, int nbyte, int offset)  {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_read(vol, fildes, buf, nbyte, offset);
+}
+
+/**
+* Gives a list of directory entries contained in a directory
+* @param dirname The path to the directory
+* @return An array of dirEnts
+*/
+dirEnt * OS_readDir(const char * dirname)  {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return NULL;
+    return fat_readDir(vol, dirname);
+}
+
+/**
+* Open a stream over the entries of a directory
+* @param dirname The path to the directory
+* @return The stream, or NULL if the directory doesn't exist
+*/
+fat_dir * OS_opendir(const char * dirname)  {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return NULL;
+    return fat_opendir(vol, dirname);
+}
+
+/**
+* Get the next entry of a directory stream
+* @param dir A stream from OS_opendir
+* @param dest Where the entry and its decoded name are stored
+* @return 1 if an entry was stored, 0 at the end, -1 on failure
+*/
+int OS_readdir_next(fat_dir * dir, fat_dirent * dest)   {
+    return fat_readdir_next(dir, dest);
+}
+
+/**
+* Close a directory stream
+* @param dir A stream from OS_opendir
+* @return 1 on success, -1 on failure
+*/
+int OS_closedir(fat_dir * dir)  {
+    return fat_closedir(dir);
 }
 
 /**
@@ -1202,7 +5641,10 @@ int remove_dirEnt(const char * path, char attr) {
 *   path element already exists
 */
 int OS_mkdir(const char * path) {
-    return create_new_dirEnt(path, 0x10);
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_mkdir(vol, path);
 }
 
 /**
@@ -1213,7 +5655,10 @@ int OS_mkdir(const char * path) {
 *   -3 if directory is not empty
 */
 int OS_rmdir(const char * path) {
-    return remove_dirEnt(path, 0x10);
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_rmdir(vol, path);
 }
 
 /**
@@ -1223,7 +5668,10 @@ int OS_rmdir(const char * path) {
 *   -2 if file is a directory
 */
 int OS_rm(const char * path)    {
-    return remove_dirEnt(path, 0x20);
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_rm(vol, path);
 }
 
 /**
@@ -1233,7 +5681,10 @@ int OS_rm(const char * path)    {
 *   -2 if final path element already exists
 */
 int OS_creat(const char * path) {
-    return create_new_dirEnt(path, 0x20);
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_creat(vol, path);
 }
 
 /**
@@ -1245,23 +5696,130 @@ int OS_creat(const char * path) {
 * @return The number of bytes written, or -1 on failure
 */
 int OS_write(int fildes, const void * buf, int nbytes, int offset)  {
-    if (fat_fd == -1)   {
-        int err = init_fat();
-        if (err == -1)
-            return -1;
-    }
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_write(vol, fildes, buf, nbytes, offset);
+}
+
+/**
+* Reserve clusters for an opened file
+* @param fildes The file descriptor
+* @param length The number of bytes to reserve space for
+* @return 1 on success, -1 on failure
+*/
+int OS_fallocate(int fildes, int length)    {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_fallocate(vol, fildes, length);
+}
 
-    if (fildes < 0 || fildes > NUM_FD || fd_base[fildes] == -1)
+/**
+* Change the size of an opened file
+* @param fildes The file descriptor
+* @param length The new size in bytes
+* @return 1 on success, -1 on failure
+*/
+int OS_truncate(int fildes, int length) {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
         return -1;
+    return fat_truncate(vol, fildes, length);
+}
 
-    int bytesWritten = write_cluster(fd_base[fildes], buf, nbytes, offset);
+/**
+* Flush all cached changes to the volume
+* @return 1 on success, -1 on failure
+*/
+int OS_sync()   {
+    fat_volume * vol = __atomic_load_n(&default_vol, __ATOMIC_ACQUIRE);
+    if (vol == NULL)    //Nothing has been mounted, so nothing to flush
+        return 1;
+    return fat_sync(vol);
+}
 
-    //Need to now update the file size in its dirEnt
-    if (offset + nbytes > fd_dirEnt[fildes].dir_fileSize)
-        fd_dirEnt[fildes].dir_fileSize = offset + nbytes;
-    get_date_time(&(fd_dirEnt[fildes].dir_wrtDate), &(fd_dirEnt[fildes].dir_wrtTime));
-    write_dirEnt(fd_parent_cluster[fildes], fd_dirEnt[fildes]);
+/**
+* Flush the pending dirENT changes of an opened file, then all cached
+* changes to the volume
+* @param fildes The file descriptor
+* @return 1 on success, -1 on failure
+*/
+int OS_fsync(int fildes)    {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_fsync(vol, fildes);
+}
 
-    return bytesWritten;
+/**
+* Get the allocation statistics of the volume
+* @param stats Where the statistics are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_statfs(fat_stats * stats)    {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_statfs(vol, stats);
+}
+
+/**
+* Check the consistency of the volume
+* @param report Where the results are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_check(fat_check_report * report) {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    char * threads = getenv("FAT_CHECK_THREADS");
+    return fat_check(vol, threads != NULL ? atoi(threads) : 0, report);
+}
+
+/**
+* Defragment a file or the files below a directory
+* @param path A file or directory, or NULL for the whole volume
+* @param report Where the counts are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_defrag(const char * path, fat_defrag_report * report)   {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_defrag(vol, path, report);
+}
+
+/**
+* Queue a read of an opened file
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @param done Called with the number of bytes read, or -1
+* @param arg Passed to done
+* @return 1 if queued, -1 on failure
+*/
+int OS_read_async(int fildes, void * buf, int nbyte, int offset, fat_async_callback done, void * arg)    {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_read_async(vol, fildes, buf, nbyte, offset, done, arg);
 }
 
+/**
+* Queue a write to an opened file
+* @param fildes The file descriptor
+* @param buf The buffer of bytes to be written
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @param done Called with the number of bytes written, or -1
+* @param arg Passed to done
+* @return 1 if queued, -1 on failure
+*/
+int OS_write_async(int fildes, const void * buf, int nbytes, int offset, fat_async_callback done, void * arg)  {
+    fat_volume * vol = default_volume();
+    if (vol == NULL)
+        return -1;
+    return fat_write_async(vol, fildes, buf, nbytes, offset, done, arg);
+}
@@ -42,6 +42,155 @@ typedef struct __attribute__((packed)) {
     uint32_t dir_fileSize;           //32 bit word holding size in bytes
 } dirEnt;
 
+/**
+* A directory entry returned by a directory stream, with its decoded name
+*/
+typedef struct {
+    char name[256];             //Long name if the entry has one, otherwise NAME.EXT
+    dirEnt entry;               //The short directory entry
+} fat_dirent;
+
+/**
+* Allocation statistics of a volume, from OS_statfs or fat_statfs
+*/
+typedef struct {
+    int cluster_bytes;          //Size of a cluster in bytes
+    int total_clusters;         //Number of data clusters
+    int free_clusters;          //Number of free clusters
+    int largest_free_run;       //Longest run of consecutive free clusters
+    int chains;                 //Number of end-of-chain markers, one per file or directory
+    int contiguous_links;       //Clusters followed by the next cluster of the volume; a chain
+                                //of n clusters is in n - 1 - its contiguous links extra pieces
+} fat_stats;
+
+/**
+* Result of a consistency check, from OS_check or fat_check
+*/
+typedef struct {
+    int directories;            //Directories reached from the root, the root included
+    int files;                  //Files reached from the root
+    int used_clusters;          //Clusters reached through the chains of those
+    int free_clusters;          //Free entries in the FAT
+    int recorded_free;          //Free count of the FAT32 FSInfo sector, or -1 if there is none
+    int lost_clusters;          //Allocated clusters that no chain reaches, other than bad ones
+    int cross_links;            //Times a chain reached a cluster that was reached already
+    int bad_chains;             //Chains that lead to a free or out of range cluster
+    int size_mismatches;        //Files whose chain is too short for their size or runs past it
+    int fat_mismatches;         //Sectors of the other FATs that differ from the first FAT
+    int journal_pending;        //1 if journal transactions not yet on the image were applied in
+                                //memory for the check, 2 if they could not be and the image was
+                                //checked as it is, 0 if there are none
+} fat_check_report;
+
+/**
+* Result of defragmenting files, from OS_defrag or fat_defrag
+*/
+typedef struct {
+    int files;                  //Files with clusters that were looked at
+    int moved_files;            //Fragmented files moved to one run of clusters
+    int moved_clusters;         //Clusters copied to move them
+    int extents_before;         //Runs of contiguous clusters in the files' chains before
+    int extents_after;          //Runs of contiguous clusters in the files' chains after
+} fat_defrag_report;
+
+/**
+* An open directory stream, from OS_opendir or fat_opendir
+*/
+typedef struct fat_dir fat_dir;
+
+/**
+* A mounted FAT volume. The fat_* functions operate on the volume they are
+* given and may be called from several threads at once; lookups and reads
+* run concurrently, changes to the volume are serialized. File descriptors
+* and the current working directory belong to the volume.
+*/
+typedef struct fat_volume fat_volume;
+
+/**
+* Called from a worker thread when an asynchronous read or write completes
+* @param result What the blocking call would have returned
+* @param arg The argument given when the request was queued
+*/
+typedef void (*fat_async_callback)(int result, void * arg);
+
+/**
+* Format an image as an empty FAT16 or FAT32 volume, without an external
+* mkfs. The image is created sparse, so large volumes are made quickly.
+* @param path The path to the image, created or truncated
+* @param size The size of the volume in bytes
+* @param cluster_bytes The cluster size, a power of two from 512 to 32768
+* @param fat_type 16 or 32, or 0 to use FAT16 if the volume is small enough
+* @return 1 on success, -1 if the volume cannot be formatted as asked
+*/
+int fat_mkfs(const char * path, long long size, int cluster_bytes, int fat_type);
+
+/**
+* Mount a FAT16 or FAT32 volume. Changes are flushed on fat_unmount and
+* when the process exits normally.
+* @param path The path to the volume image
+* @return The volume, or NULL on failure
+*/
+fat_volume * fat_mount(const char * path);
+
+/**
+* Mount a FAT16 or FAT32 volume read-only. Nothing on it can change, so
+* fat_open, fat_read, fat_readDir and fat_close take no locks and scale
+* across reader threads. Calls that would change the volume return -1.
+* Journal transactions a crash left pending are applied to a private copy
+* in memory; they reach the image at the next writable mount.
+* @param path The path to the volume image
+* @return The volume, or NULL on failure
+*/
+fat_volume * fat_mount_readonly(const char * path);
+
+/**
+* Flush and release a mounted volume. Its file descriptors are closed.
+* @param vol The volume
+* @return 1 on success, -1 if the flush failed
+*/
+int fat_unmount(fat_volume * vol);
+
+/*
+* Each of the following behaves as the OS_* function of the same name,
+* on the given volume.
+*/
+int fat_cd(fat_volume * vol, const char * path);
+int fat_open(fat_volume * vol, const char * path);
+int fat_close(fat_volume * vol, int fd);
+int fat_read(fat_volume * vol, int fildes, void * buf, int nbyte, int offset);
+dirEnt * fat_readDir(fat_volume * vol, const char * dirname);
+fat_dir * fat_opendir(fat_volume * vol, const char * dirname);
+int fat_readdir_next(fat_dir * dir, fat_dirent * dest);
+int fat_closedir(fat_dir * dir);
+int fat_mkdir(fat_volume * vol, const char * path);
+int fat_rmdir(fat_volume * vol, const char * path);
+int fat_rm(fat_volume * vol, const char * path);
+int fat_creat(fat_volume * vol, const char * path);
+int fat_write(fat_volume * vol, int fildes, const void * buf, int nbytes, int offset);
+int fat_fallocate(fat_volume * vol, int fildes, int length);
+int fat_truncate(fat_volume * vol, int fildes, int length);
+int fat_sync(fat_volume * vol);
+int fat_fsync(fat_volume * vol, int fildes);
+int fat_statfs(fat_volume * vol, fat_stats * stats);
+int fat_check(fat_volume * vol, int nthreads, fat_check_report * report);
+int fat_defrag(fat_volume * vol, const char * path, fat_defrag_report * report);
+int fat_read_async(fat_volume * vol, int fildes, void * buf, int nbyte, int offset,
+    fat_async_callback done, void * arg);
+int fat_write_async(fat_volume * vol, int fildes, const void * buf, int nbytes, int offset,
+    fat_async_callback done, void * arg);
+
+/*
+* The OS_* functions operate on the volume named by the FAT_FS_PATH
+* environment variable, which is mounted on first use. Setting
+* FAT_READ_ONLY mounts it read-only.
+*
+* Setting FAT_JOURNAL keeps a write-ahead journal of FAT and directory
+* changes in a file named after the image with ".journal" appended. Each
+* sync commits all changes made since the last one with a single
+* fdatasync before any of them is written in place. A committed sync that
+* did not reach the image is replayed on the next mount. A journaled
+* volume is never mapped with FAT_MMAP.
+*/
 
 /**
 * Changes the current working directory to the specified path
@@ -70,7 +219,9 @@ int OS_close(int fd);
 * @param buf A buffer of at least nbyte size
 * @param nbyte The number of bytes to read
 * @param offset The offset in the file to begin reading
-* @return The number of bytes read, or -1 otherwise
+* @return The number of bytes read, or -1 otherwise. Once reads of a
+*   descriptor continue one another, the next FAT_READAHEAD_KB of the file
+*   (256 by default, 0 to disable) are prefetched in the background.
 */
 int OS_read(int fildes, void * buf, int nbyte, int offset);
 
@@ -81,6 +232,32 @@ int OS_read(int fildes, void * buf, int nbyte, int offset);
 */
 dirEnt * OS_readDir(const char * dirname);
 
+/**
+* Open a stream over the entries of a directory. Unlike OS_readDir, the
+* directory is read one cluster at a time as the stream advances, so large
+* directories are listed in constant memory.
+* @param dirname The path to the directory
+* @return The stream, or NULL if the directory doesn't exist
+*/
+fat_dir * OS_opendir(const char * dirname);
+
+/**
+* Get the next entry of a directory stream. Free entries are skipped and
+* long name entries are returned as the name of the entry they belong to.
+* @param dir A stream from OS_opendir
+* @param dest Where the entry and its decoded name are stored
+* @return 1 if an entry was stored, 0 at the end of the directory,
+*   -1 on failure
+*/
+int OS_readdir_next(fat_dir * dir, fat_dirent * dest);
+
+/**
+* Close a directory stream
+* @param dir A stream from OS_opendir
+* @return 1 on success, -1 on failure
+*/
+int OS_closedir(fat_dir * dir);
+
 /**
 * Creates a new directory at the specified path
 * @param path The path to the directory
@@ -120,8 +297,111 @@ int OS_creat(const char * path);
 * @param buf The buffer of bytes to be written
 * @param nbytes The number of bytes to write
 * @param offset The offset at which to write
-* @return The number of bytes written, or -1 on failure
+* @return The number of bytes written, or -1 on failure. The new size and
+*   time are written to the directory entry on OS_close, OS_fsync,
+*   OS_sync, or by a background thread of the volume once they are
+*   FAT_DIRENT_DELAY_MS old (1000 by default; 0 writes them at once).
 */
 int OS_write(int fildes, const void * buf, int nbytes, int offset);
 
+/**
+* Reserve clusters for an opened file so that later writes up to length
+* bytes do not allocate. The file size is left unchanged.
+* @param fildes The file descriptor
+* @param length The number of bytes to reserve space for
+* @return 1 on success, -1 on failure
+*/
+int OS_fallocate(int fildes, int length);
+
+/**
+* Change the size of an opened file. Clusters past the new end are freed
+* with one batched FAT update, so a large file is cut in a few sector
+* writes. Growing the file fills the new part with zeros. Other descriptors
+* of the file see the new size.
+* @param fildes The file descriptor
+* @param length The new size in bytes
+* @return 1 on success, -1 on failure
+*/
+int OS_truncate(int fildes, int length);
+
+/**
+* Flush all cached changes to the volume. Changes are also flushed when
+* the process exits normally.
+* @return 1 on success, -1 on failure
+*/
+int OS_sync();
+
+/**
+* Write the pending size and time changes of an opened file to its
+* directory entry, then flush all cached changes as OS_sync does
+* @param fildes The file descriptor
+* @return 1 on success, -1 on failure
+*/
+int OS_fsync(int fildes);
+
+/**
+* Get the allocation statistics of the volume. The first call pages in the
+* whole FAT, which is scanned with SSE2 or AVX2 when the processor has them
+* (FAT_SIMD=0 or 1 limits this to scalar or SSE2 code).
+* @param stats Where the statistics are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_statfs(fat_stats * stats);
+
+/**
+* Check the consistency of the volume. Every chain is followed from the
+* root directory and the whole FAT is scanned, spread over
+* FAT_CHECK_THREADS threads (one per processor by default); fat_check
+* takes the number of threads as an argument. Pending changes are flushed
+* first. Clusters reserved with OS_fallocate past the end of a file count
+* as a size mismatch, as they do for other FAT checkers.
+* @param report Where the results are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_check(fat_check_report * report);
+
+/**
+* Defragment a file, or every file below a directory. Each fragmented file
+* is copied into a free run of clusters that holds its whole chain, largest
+* files first, with large batched copies, then its directory entry is
+* pointed at the run and its old chain is freed. A file that is open, or
+* for which there is no long enough run, is left as it is. With
+* FAT_JOURNAL each batch of moves is committed atomically; without it the
+* copies, the directory entries and the freed chains reach the volume in
+* that order, so a crash leaves at worst lost clusters.
+* @param path A file or directory, or NULL for the whole volume
+* @param report Where the counts are stored
+* @return 1 on success, -1 on failure
+*/
+int OS_defrag(const char * path, fat_defrag_report * report);
+
+/**
+* Queue a read of an opened file and return without waiting for it. Queued
+* requests are run by FAT_ASYNC_THREADS worker threads (4 by default).
+* Requests of one descriptor run and complete in the order they were
+* queued; those of different descriptors overlap. fat_unmount waits for
+* all of them.
+* @param fildes A previously opened file
+* @param buf A buffer of at least nbyte size, untouched until done is called
+* @param nbyte The number of bytes to read
+* @param offset The offset in the file to begin reading
+* @param done Called with the number of bytes read, or -1; may be NULL
+* @param arg Passed to done
+* @return 1 if queued, -1 if fildes is not open
+*/
+int OS_read_async(int fildes, void * buf, int nbyte, int offset, fat_async_callback done, void * arg);
+
+/**
+* Queue a write to an opened file and return without waiting for it, as
+* OS_read_async does
+* @param fildes The file descriptor
+* @param buf The bytes to be written, which must stay valid until done is called
+* @param nbytes The number of bytes to write
+* @param offset The offset at which to write
+* @param done Called with the number of bytes written, or -1; may be NULL
+* @param arg Passed to done
+* @return 1 if queued, -1 if fildes is not open
+*/
+int OS_write_async(int fildes, const void * buf, int nbytes, int offset, fat_async_callback done, void * arg);
+
 #endif
@@ -0,0 +1,195 @@
+/**
+*   Cluster chain access for one FAT entry width. fat_api.c includes this
+*   file once for FAT16 and once for FAT32 after defining
+*
+*       FAT_BITS        16 or 32, appended to the name of every function
+*       FAT_ENTRY       The C type of a FAT entry
+*       FAT_VALUE_MASK  The bits of an entry that hold the next cluster
+*       FAT_EOC_MIN     The smallest end of chain value
+*       FAT_EOC         The end of chain value written to the FAT
+*
+*   so the entry width and end of chain markers are constants in the chain
+*   walks below, which never test the volume type. The result is a fat_ops
+*   table, fat_ops16 or fat_ops32, that a volume picks once at mount time.
+*   The macros are undefined at the end of this file.
+*/
+
+#define FAT_NAME_(name, bits) name##bits
+#define FAT_NAME2(name, bits) FAT_NAME_(name, bits)
+#define FAT_NAME(name) FAT_NAME2(name, FAT_BITS)
+
+/**
+* Given a FAT cluster, return the FAT entry at that cluster
+* @param vol The volume
+* @param cluster The cluster number
+* @return The value in the FAT, or an end of chain marker if the
+*   cluster lies outside of the FAT
+*/
+int FAT_NAME(fat_next)(fat_volume * vol, int cluster)  {
+    int sec = cluster * (int) sizeof(FAT_ENTRY) / vol->bpb_struct.BPB_BytsPerSec;
+    if (cluster < 0 || sec >= vol->fat_num_sec)
+        return FAT_EOC;
+
+    //Page in the sector if needed, then locate the value in the table
+    if (!vol->fat_sec_loaded[sec])
+        fat_sector(vol, sec);
+    return ((FAT_ENTRY *) vol->fat_table)[cluster] & FAT_VALUE_MASK;
+}
+
+/**
+* Given a cluster number, how many clusters does it chain to?
+* @param vol The volume
+* @param cluster The cluster number to be checked
+* @return The number of clusters in the chain
+*/
+int FAT_NAME(chain_length)(fat_volume * vol, int cluster)  {
+    int count = 1;
+    int next = FAT_NAME(fat_next)(vol, cluster);
+    while (next >= 2 && next < FAT_EOC_MIN)    {
+        count ++;
+        next = FAT_NAME(fat_next)(vol, next);
+    }
+
+    return count;
+}
+
+/**
+* Measure the run of contiguous clusters of a chain that starts at a
+* given cluster
+* @param vol The volume
+* @param cluster The first cluster of the run
+* @param max The most clusters to count
+* @param next If not NULL, set to the cluster that follows the run in the
+*   chain, or -1 at the end of the chain
+* @return The number of clusters in the run, at least 1
+*/
+int FAT_NAME(chain_run)(fat_volume * vol, int cluster, int max, int * next)    {
+    int run = 1;
+    int after = FAT_NAME(fat_next)(vol, cluster);
+    while (run < max && after == cluster + run)   {
+        run ++;
+        after = FAT_NAME(fat_next)(vol, after);
+    }
+
+    if (next != NULL)
+        *next = (after < 2 || after >= FAT_EOC_MIN) ? -1 : after;
+    return run;
+}
+
+/*
+* Set the FAT table entry for a given cluster to a specified value.
+* Only the in-memory FAT is updated; the sector is marked dirty and
+* reaches the volume on the next call to flush_fat.
+* @param vol The volume
+* @param cluster The cluster number
+* @param value The new value, of which only the bits of an entry are kept
+* @return 1 on success, -1 on failure
+*/
+int FAT_NAME(set_entry)(fat_volume * vol, int cluster, int value)    {
+    if (cluster < 0 || cluster >= vol->CountofClusters + 2)
+        return -1;
+    int sec = cluster * (int) sizeof(FAT_ENTRY) / vol->bpb_struct.BPB_BytsPerSec;
+    fat_sector(vol, sec);
+
+    //Keep the free cluster bitmap and count in step with the FAT. The bits
+    //above the value of a FAT32 entry are reserved and kept as they are
+    FAT_ENTRY * entry = &((FAT_ENTRY *) vol->fat_table)[cluster];
+    int was_free = (*entry & FAT_VALUE_MASK) == 0;
+    int is_free = (value & FAT_VALUE_MASK) == 0;
+    if (cluster >= 2 && was_free != is_free)    {
+        vol->free_bitmap[cluster / 32] ^= 1u << (cluster % 32);
+        vol->available_clusters += is_free ? 1 : -1;
+    }
+    *entry = (*entry & ~(FAT_ENTRY) FAT_VALUE_MASK) | (value & FAT_VALUE_MASK);
+
+    mark_fat_dirty(vol, sec, sec);
+    return 1;
+}
+
+/**
+* Chain a run of free clusters together in the FAT, ending the chain at the
+* last one. The entries are written straight into the FAT table and each
+* FAT sector touched is marked dirty once.
+* @param vol The volume
+* @param start The first cluster of the run, as found by find_free_run
+* @param length The number of clusters in the run
+*/
+void FAT_NAME(set_run)(fat_volume * vol, int start, int length) {
+    int bps = vol->bpb_struct.BPB_BytsPerSec;
+    int first_sec = start * (int) sizeof(FAT_ENTRY) / bps;
+    int last_sec = (start + length - 1) * (int) sizeof(FAT_ENTRY) / bps;
+    int sec;
+    for (sec = first_sec; sec <= last_sec; sec ++)
+        fat_sector(vol, sec);
+
+    FAT_ENTRY * entries = (FAT_ENTRY *) vol->fat_table;
+    int last = start + length - 1;
+    int cluster;
+    for (cluster = start; cluster < last; cluster ++)
+        entries[cluster] = (entries[cluster] & ~(FAT_ENTRY) FAT_VALUE_MASK) | (cluster + 1);
+    entries[last] = (entries[last] & ~(FAT_ENTRY) FAT_VALUE_MASK) | FAT_EOC;
+    for (cluster = start; cluster <= last; cluster ++)
+        vol->free_bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+    vol->available_clusters -= length;
+
+    mark_fat_dirty(vol, first_sec, last_sec);
+}
+
+/**
+* Free every cluster of a chain in one pass over the in-memory FAT. Each
+* FAT sector touched is marked dirty once per visit, so the whole chain
+* reaches the volume with the next flush_fat. The walk stops at an entry
+* that is already free, which also ends a chain that loops.
+* @param vol The volume
+* @param cluster The first cluster to free
+* @return The number of clusters freed
+*/
+int FAT_NAME(free_chain)(fat_volume * vol, int cluster) {
+    int per_sec = vol->bpb_struct.BPB_BytsPerSec / (int) sizeof(FAT_ENTRY);
+    FAT_ENTRY * entries = (FAT_ENTRY *) vol->fat_table;
+    int dirty_sec = -1;
+    int freed = 0;
+    while (cluster >= 2 && cluster < vol->CountofClusters + 2)   {
+        int sec = cluster / per_sec;
+        if (!vol->fat_sec_loaded[sec])
+            fat_sector(vol, sec);
+        int next = entries[cluster] & FAT_VALUE_MASK;
+        if (next == 0)
+            break;
+
+        entries[cluster] = (FAT_ENTRY) (entries[cluster] & ~FAT_VALUE_MASK);
+        vol->free_bitmap[cluster / 32] |= 1u << (cluster % 32);
+        freed ++;
+        if (sec != dirty_sec)   {
+            mark_fat_dirty(vol, sec, sec);
+            dirty_sec = sec;
+        }
+        if (next >= FAT_EOC_MIN)
+            break;
+        cluster = next;
+    }
+
+    vol->available_clusters += freed;
+    return freed;
+}
+
+const fat_ops FAT_NAME(fat_ops) = {
+    sizeof(FAT_ENTRY),
+    FAT_EOC_MIN,
+    FAT_EOC,
+    FAT_NAME(fat_next),
+    FAT_NAME(chain_length),
+    FAT_NAME(chain_run),
+    FAT_NAME(set_entry),
+    FAT_NAME(set_run),
+    FAT_NAME(free_chain),
+};
+
+#undef FAT_NAME
+#undef FAT_NAME2
+#undef FAT_NAME_
+#undef FAT_BITS
+#undef FAT_ENTRY
+#undef FAT_VALUE_MASK
+#undef FAT_EOC_MIN
+#undef FAT_EOC
@@ -0,0 +1,101 @@
+/**
+*   Compare the FAT scanning kernels selected by FAT_SIMD on a volume image.
+*   At each level the image is mounted read-only, which pages in the whole
+*   FAT and builds the free cluster bitmap with the free-entry kernel, then
+*   fat_statfs is run, which counts the free clusters, finds the largest
+*   free run and scans the chains with the chain kernel. The statistics of
+*   every level must match those of the scalar code.
+*
+*   Usage: fatbench [-r repeats] image
+*
+*   The best time of the repeats is printed for each level. Levels the
+*   processor cannot run are skipped. The exit status is 1 if any level
+*   disagrees with the scalar code. "make fatbench" compiles this program
+*   with libFAT32.so and runs it on a 4M-cluster FAT32 image made by fatgen.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fat_api.h"
+
+/**
+* Get a monotonic clock in milliseconds
+* @return Milliseconds since an arbitrary point
+*/
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/**
+* Find the widest FAT_SIMD level this processor can run
+* @return 0 for scalar, 1 for SSE2, 2 for AVX2
+*/
+int max_level() {
+#ifdef __SSE2__
+    return __builtin_cpu_supports("avx2") ? 2 : 1;
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char ** argv)    {
+    int repeats = 5;
+    const char * path = NULL;
+    int i;
+    for (i = 1; i < argc; i ++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            repeats = atoi(argv[++ i]);
+        else if (path == NULL)
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if (path == NULL || repeats < 1)    {
+        fprintf(stderr, "usage: %s [-r repeats] image\n", argv[0]);
+        return 2;
+    }
+
+    const char * names[] = { "scalar", "SSE2", "AVX2" };
+    fat_stats scalar;
+    int level, mismatches = 0;
+    for (level = 0; level <= max_level(); level ++)    {
+        char value[2] = { (char)('0' + level), 0 };
+        setenv("FAT_SIMD", value, 1);
+
+        double best_mount = 0, best_statfs = 0;
+        fat_stats stats;
+        int rep;
+        for (rep = 0; rep < repeats; rep ++)    {
+            double start = now_ms();
+            fat_volume * vol = fat_mount_readonly(path);
+            double mounted = now_ms();
+            if (vol == NULL)    {
+                fprintf(stderr, "%s: cannot mount %s\n", argv[0], path);
+                return 2;
+            }
+            fat_statfs(vol, &stats);
+            double done = now_ms();
+            fat_unmount(vol);
+
+            if (rep == 0 || mounted - start < best_mount)
+                best_mount = mounted - start;
+            if (rep == 0 || done - mounted < best_statfs)
+                best_statfs = done - mounted;
+        }
+
+        if (level == 0)
+            scalar = stats;
+        int same = memcmp(&stats, &scalar, sizeof(fat_stats)) == 0;
+        if (!same)
+            mismatches ++;
+        printf("%-6s  mount %8.2f ms  statfs %8.2f ms  free %d  largest run %d  chains %d  contiguous %d%s\n",
+            names[level], best_mount, best_statfs, stats.free_clusters, stats.largest_free_run,
+            stats.chains, stats.contiguous_links, same ? "" : "  DIFFERS FROM SCALAR");
+    }
+    printf("%s: %d clusters of %d bytes\n", path, scalar.total_clusters, scalar.cluster_bytes);
+    return mismatches > 0 ? 1 : 0;
+}
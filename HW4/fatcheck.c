@@ -0,0 +1,85 @@
+/**
+*   Check the consistency of a FAT16 or FAT32 volume image with fat_check.
+*   The image is mounted read-only and nothing on it is changed.
+*
+*   Usage: fatcheck [-j threads] image
+*
+*   The exit status is 0 if the volume is consistent, 1 if problems were
+*   found and 2 if the image could not be checked. This program can be
+*   compiled with libFAT32.so via "make fatcheck".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fat_api.h"
+
+int main(int argc, char ** argv)    {
+    int nthreads = 0;
+    const char * path = NULL;
+    int i;
+    for (i = 1; i < argc; i ++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            nthreads = atoi(argv[++ i]);
+        else if (path == NULL)
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if (path == NULL)   {
+        fprintf(stderr, "usage: %s [-j threads] image\n", argv[0]);
+        return 2;
+    }
+
+    fat_volume * vol = fat_mount_readonly(path);
+    if (vol == NULL)    {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], path);
+        return 2;
+    }
+    fat_check_report report;
+    if (fat_check(vol, nthreads, &report) == -1)    {
+        fprintf(stderr, "%s: cannot check %s\n", argv[0], path);
+        fat_unmount(vol);
+        return 2;
+    }
+    fat_unmount(vol);
+
+    printf("%s: %d directories, %d files, %d clusters used, %d free\n",
+        path, report.directories, report.files, report.used_clusters, report.free_clusters);
+    int problems = 0;
+    if (report.lost_clusters > 0)   {
+        printf("%d lost clusters\n", report.lost_clusters);
+        problems ++;
+    }
+    if (report.cross_links > 0) {
+        printf("%d cross-linked clusters\n", report.cross_links);
+        problems ++;
+    }
+    if (report.bad_chains > 0)  {
+        printf("%d broken cluster chains\n", report.bad_chains);
+        problems ++;
+    }
+    if (report.size_mismatches > 0) {
+        printf("%d files whose size does not match their chain\n", report.size_mismatches);
+        problems ++;
+    }
+    if (report.recorded_free != -1 && report.recorded_free != report.free_clusters)  {
+        printf("FSInfo free count is %d, the FAT has %d\n", report.recorded_free, report.free_clusters);
+        problems ++;
+    }
+    if (report.fat_mismatches > 0)  {
+        printf("%d FAT sectors differ between copies\n", report.fat_mismatches);
+        problems ++;
+    }
+
+    if (report.journal_pending == 1)
+        printf("the journal holds changes not yet on the image; they were checked as replayed\n");
+    else if (report.journal_pending == 2) {
+        printf("the journal holds changes that could not be read or applied; the image was checked as it is\n");
+        problems ++;
+    }
+
+    if (problems == 0)
+        printf("no problems found\n");
+    return problems > 0 ? 1 : 0;
+}
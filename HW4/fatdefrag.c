@@ -0,0 +1,39 @@
+/**
+*   Defragment the files of a FAT16 or FAT32 volume image with fat_defrag.
+*
+*   Usage: fatdefrag image [path]
+*
+*   Without a path every file on the volume is defragmented. Setting
+*   FAT_JOURNAL commits each batch of moves atomically. This program can be
+*   compiled with libFAT32.so via "make fatdefrag".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "fat_api.h"
+
+int main(int argc, char ** argv)    {
+    if (argc < 2 || argc > 3)   {
+        fprintf(stderr, "usage: %s image [path]\n", argv[0]);
+        return 2;
+    }
+
+    fat_volume * vol = fat_mount(argv[1]);
+    if (vol == NULL)    {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], argv[1]);
+        return 2;
+    }
+    fat_defrag_report report;
+    int ret = fat_defrag(vol, argc == 3 ? argv[2] : NULL, &report);
+    if (fat_unmount(vol) == -1)
+        ret = -1;
+    if (ret == -1)  {
+        fprintf(stderr, "%s: cannot defragment %s\n", argv[0], argc == 3 ? argv[2] : argv[1]);
+        return 1;
+    }
+
+    printf("%d files, %d moved (%d clusters), %d extents before, %d after\n",
+        report.files, report.moved_files, report.moved_clusters,
+        report.extents_before, report.extents_after);
+    return 0;
+}
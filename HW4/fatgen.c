@@ -0,0 +1,231 @@
+/**
+*   Format a FAT16 or FAT32 image with fat_mkfs and fill it with a synthetic
+*   tree of directories and files, to reproduce large volumes for
+*   performance testing.
+*
+*   Usage: fatgen [options] image
+*       -s size     Size of the volume, with an optional K, M or G suffix (default 64M)
+*       -c bytes    Cluster size (default 4096)
+*       -t type     16 or 32, or 0 to pick by size (default 0)
+*       -d depth    Levels of directories below the root (default 1)
+*       -w fanout   Subdirectories of each directory (default 4)
+*       -n files    Number of files, spread evenly over all directories (default 100)
+*       -z size     Mean file size, with an optional K, M or G suffix (default 16K)
+*       -Z dist     File size distribution: fixed, uniform (0 to twice the mean)
+*                   or exp (exponential) (default exp)
+*       -i files    Files written at once, a piece of each in turn, up to 64; 1
+*                   writes every file in one run of clusters (default 1)
+*       -k size     Size of the pieces written with -i (default one cluster)
+*       -r seed     Seed of the generator, so runs are repeatable (default 1)
+*
+*   Byte i of file n holds (n * 131 + i) & 0xFF, so readers can check what
+*   they read. Names are 8.3: directories Dnnnnnnn, files Fnnnnnnn.DAT.
+*   This program can be compiled with libFAT32.so via "make fatgen".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "fat_api.h"
+
+#define WRITE_CHUNK (1 << 20)  //Most bytes passed to one fat_write
+
+unsigned long long rng_state;   //State of the xorshift generator
+
+/**
+* Get the next number of the generator
+* @return A number uniform in [0, 1)
+*/
+double next_random()    {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+* Parse a size with an optional K, M or G suffix
+* @param text The size
+* @return The size in bytes
+*/
+long long parse_size(const char * text)  {
+    char * end;
+    long long size = strtoll(text, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        size <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        size <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        size <<= 30;
+    return size;
+}
+
+/**
+* Pick the size of a file
+* @param mean The mean file size
+* @param dist 'f' for fixed, 'u' for uniform, 'e' for exponential
+* @return The size in bytes, capped below 2GB
+*/
+int pick_size(long long mean, char dist)    {
+    double size = mean;
+    if (dist == 'u')
+        size = 2 * mean * next_random();
+    else if (dist == 'e')
+        size = -mean * log(1 - next_random());
+    return size > 0x7FFFFFFF ? 0x7FFFFFFF : (int) size;
+}
+
+/**
+* Write part of a generated file, WRITE_CHUNK bytes per call
+* @param vol The volume
+* @param fd The file descriptor
+* @param n The number of the file
+* @param offset The offset in the file
+* @param nbytes The number of bytes to write
+* @param pattern WRITE_CHUNK + 256 bytes counting up from 0
+* @return 1 on success, -1 on failure
+*/
+int write_range(fat_volume * vol, int fd, int n, int offset, int nbytes, const char * pattern)  {
+    while (nbytes > 0)  {
+        int len = nbytes < WRITE_CHUNK ? nbytes : WRITE_CHUNK;
+        if (fat_write(vol, fd, pattern + ((n * 131 + offset) & 0xFF), len, offset) != len)
+            return -1;
+        offset += len;
+        nbytes -= len;
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv)    {
+    long long volume_size = 64LL << 20, mean = 16 << 10;
+    int cluster_bytes = 4096, fat_type = 0, depth = 1, fanout = 4, nfiles = 100;
+    int interleave = 1, piece = 0;
+    char dist = 'e';
+    rng_state = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:t:d:w:n:z:Z:i:k:r:")) != -1)  {
+        switch (opt)    {
+            case 's': volume_size = parse_size(optarg); break;
+            case 'c': cluster_bytes = atoi(optarg); break;
+            case 't': fat_type = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'w': fanout = atoi(optarg); break;
+            case 'n': nfiles = atoi(optarg); break;
+            case 'z': mean = parse_size(optarg); break;
+            case 'Z': dist = optarg[0]; break;
+            case 'i': interleave = atoi(optarg); break;
+            case 'k': piece = parse_size(optarg); break;
+            case 'r': rng_state = strtoull(optarg, NULL, 10) * 2654435761ULL + 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-s size] [-c bytes] [-t 16|32] [-d depth] [-w fanout] "
+                    "[-n files] [-z size] [-Z fixed|uniform|exp] [-i files] [-k size] [-r seed] image\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || depth < 0 || fanout < 1 || nfiles < 0 || interleave < 1 || interleave > 64 ||
+        (dist != 'f' && dist != 'u' && dist != 'e'))  {
+        fprintf(stderr, "%s: bad arguments, see the top of fatgen.c\n", argv[0]);
+        return 2;
+    }
+    const char * image = argv[optind];
+    if (piece <= 0)
+        piece = cluster_bytes;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fat_mkfs(image, volume_size, cluster_bytes, fat_type) == -1)    {
+        fprintf(stderr, "%s: cannot format %s as asked\n", argv[0], image);
+        return 1;
+    }
+    fat_volume * vol = fat_mount(image);
+    if (vol == NULL)    {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], image);
+        return 1;
+    }
+
+    //Directories are made level by level; each path is kept so files can
+    //be spread over them
+    int ndirs = 1, level_size = 1, level;
+    for (level = 0; level < depth; level ++)    {
+        level_size *= fanout;
+        ndirs += level_size;
+    }
+    char ** dirs = (char **) malloc(sizeof(char *) * ndirs);
+    dirs[0] = strdup("");
+    int made = 1, parent = 0;
+    while (made < ndirs)    {
+        int i;
+        for (i = 0; i < fanout && made < ndirs; i ++)   {
+            dirs[made] = (char *) malloc(strlen(dirs[parent]) + 10);
+            sprintf(dirs[made], "%s/D%07d", dirs[parent], made);
+            if (fat_mkdir(vol, dirs[made]) != 1)  {
+                fprintf(stderr, "%s: cannot make %s\n", argv[0], dirs[made]);
+                return 1;
+            }
+            made ++;
+        }
+        parent ++;
+    }
+
+    //A window into a repeating pattern stands in for the bytes of any file
+    char * pattern = (char *) malloc(WRITE_CHUNK + 256);
+    int i;
+    for (i = 0; i < WRITE_CHUNK + 256; i ++)
+        pattern[i] = (char) i;
+
+    int * fds = (int *) malloc(sizeof(int) * interleave);
+    int * sizes = (int *) malloc(sizeof(int) * interleave);
+    long long written = 0;
+    int first;
+    for (first = 0; first < nfiles; first += interleave)    {
+        int count = nfiles - first < interleave ? nfiles - first : interleave;
+        int longest = 0;
+        for (i = 0; i < count; i ++)    {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/F%07d.DAT", dirs[(first + i) % ndirs], first + i);
+            if (fat_creat(vol, path) != 1 || (fds[i] = fat_open(vol, path)) == -1)   {
+                fprintf(stderr, "%s: cannot create %s\n", argv[0], path);
+                return 1;
+            }
+            sizes[i] = pick_size(mean, dist);
+            if (sizes[i] > longest)
+                longest = sizes[i];
+        }
+
+        //With more than one file at once, their pieces take turns on the volume
+        int step = interleave == 1 ? longest : piece;
+        int offset;
+        for (offset = 0; offset < longest; offset += step)  {
+            for (i = 0; i < count; i ++)    {
+                if (offset >= sizes[i])
+                    continue;
+                int nbytes = sizes[i] - offset < step ? sizes[i] - offset : step;
+                if (write_range(vol, fds[i], first + i, offset, nbytes, pattern) == -1)  {
+                    fprintf(stderr, "%s: %s is full\n", argv[0], image);
+                    return 1;
+                }
+                written += nbytes;
+            }
+        }
+        for (i = 0; i < count; i ++)
+            fat_close(vol, fds[i]);
+    }
+
+    fat_stats stats;
+    fat_statfs(vol, &stats);
+    if (fat_unmount(vol) == -1) {
+        fprintf(stderr, "%s: cannot flush %s\n", argv[0], image);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%s: FAT%d, %d clusters of %d bytes, %d free\n", image,
+        stats.total_clusters < 65525 ? 16 : 32, stats.total_clusters, stats.cluster_bytes, stats.free_clusters);
+    printf("%d directories, %d files, %lld bytes, %d chains, %d contiguous links\n",
+        ndirs, nfiles, written, stats.chains, stats.contiguous_links);
+    printf("%.2f seconds\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
@@ -0,0 +1,1013 @@
+/**
+*   Exercise the library on volumes made by fat_mkfs and check each one
+*   with fat_check afterwards.
+*
+*   Usage: fattest [directory]
+*
+*   Images are made in the directory, /tmp by default, and removed when
+*   every check of a case passed. Each failed check is printed and the exit
+*   status is 1 if any failed. The fatcheck program must sit next to this
+*   one. Both can be compiled with libFAT32.so and run via "make fattest".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "fat_api.h"
+
+int failures = 0;           //Checks failed so far
+char fatcheck_path[1024];   //The fatcheck program next to this one
+
+#define CHECK(cond) check_that((cond), #cond, __func__, __LINE__)
+
+/**
+* Count and print a failed check
+* @param ok Whether the check passed
+* @param text The condition checked
+* @param func The case it is part of
+* @param line The line of the check
+* @return ok
+*/
+int check_that(int ok, const char * text, const char * func, int line)    {
+    if (!ok)    {
+        printf("%s:%d: check failed: %s\n", func, line, text);
+        failures ++;
+    }
+    return ok;
+}
+
+/**
+* Fill a buffer with the bytes a generated file holds at an offset, as
+* fatgen writes them
+* @param buf The buffer
+* @param n The number of the file
+* @param offset The offset in the file
+* @param nbytes The number of bytes
+*/
+void fill_pattern(char * buf, int n, int offset, int nbytes)    {
+    int i;
+    for (i = 0; i < nbytes; i ++)
+        buf[i] = (char)((n * 131 + offset + i) & 0xFF);
+}
+
+/**
+* Check that a file holds the generated pattern
+* @param vol The volume
+* @param path The path of the file
+* @param n The number of the file
+* @param size The size the file should have
+* @return 1 if it does, 0 otherwise
+*/
+int file_matches(fat_volume * vol, const char * path, int n, int size)  {
+    int fd = fat_open(vol, path);
+    if (fd == -1)
+        return 0;
+    char * got = (char *) malloc(size + 1);
+    char * want = (char *) malloc(size + 1);
+    fill_pattern(want, n, 0, size);
+    int nread = fat_read(vol, fd, got, size + 1, 0);
+    int ok = nread == size && memcmp(got, want, size) == 0;
+    fat_close(vol, fd);
+    free(got);
+    free(want);
+    return ok;
+}
+
+/**
+* Create a file holding the generated pattern
+* @param vol The volume
+* @param path The path of the file
+* @param n The number of the file
+* @param size The size of the file
+* @return 1 on success, 0 on failure
+*/
+int make_file(fat_volume * vol, const char * path, int n, int size)    {
+    if (fat_creat(vol, path) != 1)
+        return 0;
+    int fd = fat_open(vol, path);
+    if (fd == -1)
+        return 0;
+    char * buf = (char *) malloc(size);
+    fill_pattern(buf, n, 0, size);
+    int ok = fat_write(vol, fd, buf, size, 0) == size;
+    fat_close(vol, fd);
+    free(buf);
+    return ok;
+}
+
+/**
+* Check a volume image with fat_check
+* @param image The path of the image
+* @return 1 if no problem was found, 0 otherwise
+*/
+int volume_clean(const char * image)    {
+    fat_volume * vol = fat_mount_readonly(image);
+    if (vol == NULL)
+        return 0;
+    fat_check_report report;
+    int ok = fat_check(vol, 0, &report) == 1 && report.lost_clusters == 0 &&
+        report.cross_links == 0 && report.bad_chains == 0 && report.size_mismatches == 0 &&
+        report.fat_mismatches == 0 &&
+        (report.recorded_free == -1 || report.recorded_free == report.free_clusters);
+    fat_unmount(vol);
+    return ok;
+}
+
+/**
+* Where the regions of a volume image lie, from its BPB
+*/
+typedef struct {
+    int bytes_per_sector;
+    int reserved_sectors;
+    int fat_count;
+    int fat_sectors;            //Sectors of one FAT copy
+    int root_entries;           //Entries of the FAT16 root directory, 0 on FAT32
+} volume_layout;
+
+/**
+* Read the layout of a volume image
+* @param image The path of the image
+* @param layout Where the layout is stored
+* @return 1 on success, 0 if the image cannot be read
+*/
+int read_layout(const char * image, volume_layout * layout) {
+    unsigned char bpb[40];
+    int fd = open(image, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    int ok = pread(fd, bpb, sizeof(bpb), 0) == sizeof(bpb);
+    close(fd);
+    if (!ok)
+        return 0;
+    layout->bytes_per_sector = bpb[11] | (bpb[12] << 8);
+    layout->reserved_sectors = bpb[14] | (bpb[15] << 8);
+    layout->fat_count = bpb[16];
+    layout->root_entries = bpb[17] | (bpb[18] << 8);
+    layout->fat_sectors = bpb[22] | (bpb[23] << 8);
+    if (layout->fat_sectors == 0)
+        layout->fat_sectors = bpb[36] | (bpb[37] << 8) | (bpb[38] << 16) | (bpb[39] << 24);
+    return 1;
+}
+
+/**
+* Get the byte offset of a FAT copy of an image
+* @param layout The layout of the image
+* @param copy The number of the copy, from 0
+* @return The offset
+*/
+long fat_offset(const volume_layout * layout, int copy)    {
+    return (long)(layout->reserved_sectors + copy * layout->fat_sectors) * layout->bytes_per_sector;
+}
+
+/**
+* Get the byte offset of the data region of a FAT16 image from its BPB
+* @param image The path of the image
+* @return The offset, or -1 if the image cannot be read
+*/
+long data_offset(const char * image)   {
+    volume_layout layout;
+    if (!read_layout(image, &layout))
+        return -1;
+    return fat_offset(&layout, layout.fat_count) + layout.root_entries * 32;
+}
+
+/**
+* Overwrite bytes of an image in place
+* @param image The path of the image
+* @param offset The byte offset
+* @param bytes The new bytes
+* @param nbytes The number of bytes
+* @return 1 on success, 0 on failure
+*/
+int patch_image(const char * image, long offset, const void * bytes, int nbytes)    {
+    int fd = open(image, O_WRONLY);
+    if (fd == -1)
+        return 0;
+    int ok = pwrite(fd, bytes, nbytes, offset) == nbytes;
+    close(fd);
+    return ok;
+}
+
+/**
+* Find an entry of the FAT16 root directory of an image
+* @param image The path of the image
+* @param name The 11 byte 8.3 name, padded with spaces
+* @return The byte offset of the entry, or -1 if it is not there
+*/
+long root_entry_offset(const char * image, const char * name)   {
+    volume_layout layout;
+    if (!read_layout(image, &layout))
+        return -1;
+    long root = fat_offset(&layout, layout.fat_count);
+    int fd = open(image, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    long found = -1;
+    int i;
+    for (i = 0; i < layout.root_entries && found == -1; i ++)   {
+        char entry[32];
+        if (pread(fd, entry, 32, root + i * 32) != 32 || entry[0] == 0)
+            break;
+        if (memcmp(entry, name, 11) == 0)
+            found = root + i * 32;
+    }
+    close(fd);
+    return found;
+}
+
+/**
+* Run the fatcheck program on an image
+* @param image The path of the image
+* @return Its exit status, or -1 if it could not be run
+*/
+int run_fatcheck(const char * image)    {
+    pid_t pid = fork();
+    if (pid == 0)   {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(fatcheck_path, fatcheck_path, image, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127)
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+/**
+* Remove an image and its journal
+* @param image The path of the image
+*/
+void remove_image(const char * image)  {
+    char jpath[1100];
+    snprintf(jpath, sizeof(jpath), "%s.journal", image);
+    unlink(image);
+    unlink(jpath);
+}
+
+/**
+* Read a whole file
+* @param path The path of the file
+* @param size Set to the size of the file
+* @return The bytes, or NULL if the file cannot be read
+*/
+char * read_whole(const char * path, long * size)   {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        return NULL;
+    char * buf = (char *) malloc(st.st_size + 1);
+    *size = pread(fd, buf, st.st_size, 0);
+    close(fd);
+    return buf;
+}
+
+/**
+* Make a journaled volume whose last changes are only in the journal. The
+* writes past the FAT16 root directory are made to fail by a file size
+* limit, so flushes fail after their commit; a smaller commit follows, then
+* the process stops without unmounting as if it had crashed.
+* @param image The path of the image
+* @return 1 on success, 0 on failure
+*/
+int crash_after_failed_flush(const char * image)  {
+    remove_image(image);
+    if (fat_mkfs(image, 16 << 20, 512, 16) != 1)
+        return 0;
+    long limit = data_offset(image);
+
+    pid_t pid = fork();
+    if (pid == 0)   {
+        setenv("FAT_JOURNAL", "1", 1);
+        signal(SIGXFSZ, SIG_IGN);
+        fat_volume * vol = fat_mount(image);
+        if (vol == NULL || fat_mkdir(vol, "/D") != 1 || !make_file(vol, "/D/BIG.DAT", 1, 2000 * 512))
+            _exit(1);
+        struct rlimit rl = { limit, limit };
+        setrlimit(RLIMIT_FSIZE, &rl);
+        if (fat_sync(vol) != -1)    //The FAT reaches the image, the block of /D cannot
+            _exit(2);
+        if (fat_creat(vol, "/NOTE.TXT") != 1 || fat_sync(vol) != -1)
+            _exit(3);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+* A flush that fails after the journal commit must leave the transaction
+* in the journal, and a later, smaller commit must not make it unreadable
+* @param dir The directory for the image
+*/
+void test_journal_failed_flush(const char * dir)    {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_journal.raw", dir);
+    int before = failures;
+    if (!CHECK(crash_after_failed_flush(image)))
+        return;
+
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(file_matches(vol, "/D/BIG.DAT", 1, 2000 * 512));
+    int fd = fat_open(vol, "/NOTE.TXT");
+    CHECK(fd != -1);
+    fat_close(vol, fd);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* A read-only mount of a volume with a pending journal must see the volume
+* as replay will leave it, without writing the image or the journal
+* @param dir The directory for the image
+*/
+void test_readonly_pending_journal(const char * dir) {
+    char image[1024], jpath[1100];
+    snprintf(image, sizeof(image), "%s/fattest_rojournal.raw", dir);
+    snprintf(jpath, sizeof(jpath), "%s.journal", image);
+    int before = failures;
+    if (!CHECK(crash_after_failed_flush(image)))
+        return;
+    long image_size, journal_size;
+    char * image_before = read_whole(image, &image_size);
+    char * journal_before = read_whole(jpath, &journal_size);
+    if (!CHECK(image_before != NULL && journal_before != NULL && journal_size > 0))
+        return;
+
+    fat_volume * vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(file_matches(vol, "/D/BIG.DAT", 1, 2000 * 512));
+    fat_check_report report;
+    CHECK(fat_check(vol, 0, &report) == 1 && report.journal_pending == 1 &&
+        report.lost_clusters == 0 && report.bad_chains == 0);
+    fat_unmount(vol);
+
+    long size;
+    char * image_after = read_whole(image, &size);
+    CHECK(size == image_size && memcmp(image_before, image_after, size) == 0);
+    free(image_after);
+    char * journal_after = read_whole(jpath, &size);
+    CHECK(size == journal_size && memcmp(journal_before, journal_after, size) == 0);
+    free(journal_after);
+    free(image_before);
+    free(journal_before);
+
+    //A writable mount then replays it for good
+    vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* State shared with the callback of an asynchronous read
+*/
+typedef struct {
+    int result;         //What the read returned
+    int done;           //1 once the callback ran
+} async_result;
+
+/**
+* Record the result of an asynchronous read
+* @param result What the read returned
+* @param arg The async_result
+*/
+void read_done(int result, void * arg)  {
+    async_result * r = (async_result *) arg;
+    r->result = result;
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+* Open and close a file over and over, so descriptors are reused
+* @param arg The read-only volume
+* @return NULL
+*/
+void * reopen_loop(void * arg)  {
+    fat_volume * vol = (fat_volume *) arg;
+    int i;
+    for (i = 0; i < 2000; i ++) {
+        int fd = fat_open(vol, "/B.DAT");
+        if (fd != -1)
+            fat_close(vol, fd);
+    }
+    return NULL;
+}
+
+/**
+* Closing a descriptor of a read-only volume right after queueing a read
+* on it must let the read finish on the file it was queued for
+* @param dir The directory for the image
+*/
+void test_readonly_close_during_read(const char * dir)  {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_roclose.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 4096, 16) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(make_file(vol, "/A.DAT", 1, 300000));
+    CHECK(make_file(vol, "/B.DAT", 2, 5000));
+    CHECK(fat_unmount(vol) != -1);
+
+    vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    pthread_t thread;
+    pthread_create(&thread, NULL, reopen_loop, vol);
+    char * want = (char *) malloc(300000);
+    char * got = (char *) malloc(300000);
+    fill_pattern(want, 1, 0, 300000);
+    int i, bad = 0;
+    for (i = 0; i < 200; i ++)  {
+        int fd = fat_open(vol, "/A.DAT");
+        async_result r = { 0, 0 };
+        if (fd == -1 || fat_read_async(vol, fd, got, 300000, 0, read_done, &r) != 1)  {
+            bad ++;
+            continue;
+        }
+        fat_close(vol, fd);
+        while (!__atomic_load_n(&r.done, __ATOMIC_ACQUIRE))
+            usleep(100);
+        if (r.result != 300000 || memcmp(got, want, 300000) != 0)
+            bad ++;
+    }
+    pthread_join(thread, NULL);
+    CHECK(bad == 0);
+    free(want);
+    free(got);
+    fat_unmount(vol);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* A torn transaction at the end of the journal must be ignored while the
+* ones before it are replayed, and a journal whose first transaction fails
+* its checksum must not be applied at all
+* @param dir The directory for the image
+*/
+void test_torn_journal(const char * dir)    {
+    char image[1024], jpath[1100];
+    snprintf(image, sizeof(image), "%s/fattest_torn.raw", dir);
+    snprintf(jpath, sizeof(jpath), "%s.journal", image);
+    int before = failures;
+    if (!CHECK(crash_after_failed_flush(image)))
+        return;
+
+    //Cut the journal inside the second transaction
+    long size;
+    char * log = read_whole(jpath, &size);
+    if (!CHECK(log != NULL && size >= 24))
+        return;
+    unsigned int count;
+    unsigned long long bytes;
+    memcpy(&count, log + 4, sizeof(count));
+    memcpy(&bytes, log + 8, sizeof(bytes));
+    long first = 24 + (long) count * 16 + (long) bytes;
+    free(log);
+    if (!CHECK(size > first + 10) || !CHECK(truncate(jpath, first + 10) == 0))
+        return;
+
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(file_matches(vol, "/D/BIG.DAT", 1, 2000 * 512));
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+
+    //Damage the records of a lone transaction: a read-only mount must
+    //neither apply it nor report it pending
+    CHECK(crash_after_failed_flush(image));
+    CHECK(truncate(jpath, first) == 0);
+    long image_size;
+    char * image_before = read_whole(image, &image_size);
+    char flipped = 0x5A;
+    CHECK(patch_image(jpath, 24, &flipped, 1));
+    vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    fat_check_report report;
+    CHECK(fat_check(vol, 0, &report) == 1 && report.journal_pending == 0);
+    fat_unmount(vol);
+    char * image_after = read_whole(image, &size);
+    CHECK(image_before != NULL && image_after != NULL && size == image_size &&
+        memcmp(image_before, image_after, size) == 0);
+    free(image_before);
+    free(image_after);
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* Count the entries a directory stream lists
+* @param vol The volume
+* @param path The path of the directory
+* @return The number of entries, or -1 if it cannot be read
+*/
+int count_entries(fat_volume * vol, const char * path)  {
+    fat_dir * dir = fat_opendir(vol, path);
+    if (dir == NULL)
+        return -1;
+    fat_dirent dest;
+    int count = 0, ret;
+    while ((ret = fat_readdir_next(dir, &dest)) == 1)
+        count ++;
+    fat_closedir(dir);
+    return ret == 0 ? count : -1;
+}
+
+/**
+* A directory made or grown over the clusters of a removed file must not
+* take the bytes the file left there for entries
+* @param dir The directory for the image
+*/
+void test_mkdir_over_removed_file(const char * dir)  {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_stale.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 2048, 16) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+
+    //Fill 200 clusters with records that read as files
+    int size = 200 * 2048;
+    dirEnt * fake = (dirEnt *) calloc(size / sizeof(dirEnt), sizeof(dirEnt));
+    int i;
+    for (i = 0; i < size / (int) sizeof(dirEnt); i ++)  {
+        char name[12];
+        snprintf(name, sizeof(name), "F%07d" "DAT", i);
+        memcpy(fake[i].dir_name, name, 11);
+        fake[i].dir_attr = 0x20;
+        fake[i].dir_fstClusLO = 2;
+        fake[i].dir_fileSize = 4096;
+    }
+    CHECK(fat_creat(vol, "/FAKE.DAT") == 1);
+    int fd = fat_open(vol, "/FAKE.DAT");
+    CHECK(fd != -1 && fat_write(vol, fd, fake, size, 0) == size);
+    fat_close(vol, fd);
+    free(fake);
+    CHECK(fat_rm(vol, "/FAKE.DAT") == 1);
+    CHECK(fat_unmount(vol) != -1);
+
+    //The new directory and the clusters it grows into all held records
+    vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_mkdir(vol, "/NEW") == 1);
+    CHECK(count_entries(vol, "/NEW") == 2);
+    for (i = 0; i < 70; i ++)   {
+        char path[64];
+        snprintf(path, sizeof(path), "/NEW/G%d.TXT", i);
+        CHECK(fat_creat(vol, path) == 1);
+    }
+    CHECK(count_entries(vol, "/NEW") == 72);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* Shrinking and growing a file through one descriptor must be seen through
+* another descriptor of the same file, free the clusters past the new end
+* and fill the grown part with zeros
+* @param dir The directory for the image
+*/
+void test_truncate_shared(const char * dir) {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_truncate.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 64 << 20, 512, 32) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(make_file(vol, "/T.DAT", 3, 100000));
+    int fd1 = fat_open(vol, "/T.DAT");
+    int fd2 = fat_open(vol, "/T.DAT");
+    if (!CHECK(fd1 != -1 && fd2 != -1))
+        return;
+
+    char * want = (char *) malloc(100000);
+    char * got = (char *) malloc(100000);
+    fat_stats stats;
+    fat_statfs(vol, &stats);
+    int free_before = stats.free_clusters;
+    CHECK(fat_truncate(vol, fd1, 30000) == 1);
+    fat_statfs(vol, &stats);
+    CHECK(stats.free_clusters - free_before == (100000 + 511) / 512 - (30000 + 511) / 512);
+    fill_pattern(want, 3, 0, 30000);
+    CHECK(fat_read(vol, fd2, got, 100000, 0) == 30000 && memcmp(got, want, 30000) == 0);
+
+    CHECK(fat_truncate(vol, fd2, 70000) == 1);
+    memset(want + 30000, 0, 40000);
+    CHECK(fat_read(vol, fd1, got, 100000, 0) == 70000 && memcmp(got, want, 70000) == 0);
+    fat_close(vol, fd1);
+    fat_close(vol, fd2);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+
+    vol = fat_mount_readonly(image);
+    if (CHECK(vol != NULL)) {
+        int fd = fat_open(vol, "/T.DAT");
+        CHECK(fd != -1 && fat_read(vol, fd, got, 100000, 0) == 70000 && memcmp(got, want, 70000) == 0);
+        fat_unmount(vol);
+    }
+    free(want);
+    free(got);
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* Every FAT copy of a volume must match the first after files were made,
+* removed and resized
+* @param dir The directory for the image
+* @param type 16 or 32
+*/
+void test_fat_mirroring(const char * dir, int type)    {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_mirror%d.raw", dir, type);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 64 << 20, type == 32 ? 512 : 2048, type) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_mkdir(vol, "/SUB") == 1);
+    int i;
+    for (i = 0; i < 20; i ++)   {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/F%d.DAT", i % 2 ? "/SUB" : "", i);
+        CHECK(make_file(vol, path, i, 3000 + i * 1500));
+    }
+    for (i = 0; i < 20; i += 3) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/F%d.DAT", i % 2 ? "/SUB" : "", i);
+        CHECK(fat_rm(vol, path) == 1);
+    }
+    int fd = fat_open(vol, "/F4.DAT");
+    CHECK(fd != -1 && fat_truncate(vol, fd, 100) == 1);
+    fat_close(vol, fd);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+
+    volume_layout layout;
+    if (!CHECK(read_layout(image, &layout) && layout.fat_count >= 2))
+        return;
+    long fat_bytes = (long) layout.fat_sectors * layout.bytes_per_sector;
+    char * first = (char *) malloc(fat_bytes);
+    char * copy = (char *) malloc(fat_bytes);
+    int fdi = open(image, O_RDONLY);
+    CHECK(pread(fdi, first, fat_bytes, fat_offset(&layout, 0)) == fat_bytes);
+    for (i = 1; i < layout.fat_count; i ++)
+        CHECK(pread(fdi, copy, fat_bytes, fat_offset(&layout, i)) == fat_bytes &&
+            memcmp(first, copy, fat_bytes) == 0);
+    close(fdi);
+    free(first);
+    free(copy);
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* With FAT32 mirroring turned off, the volume must be read and written
+* through the active FAT alone, even when that is not the first one
+* @param dir The directory for the image
+*/
+void test_active_fat(const char * dir)  {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_active.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 64 << 20, 512, 32) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(make_file(vol, "/A.DAT", 1, 30000));
+    CHECK(fat_unmount(vol) != -1);
+
+    //Make the second FAT the active one and wipe the first
+    volume_layout layout;
+    if (!CHECK(read_layout(image, &layout) && layout.fat_count >= 2))
+        return;
+    unsigned char flags[2] = { 0x81, 0 };
+    CHECK(patch_image(image, 40, flags, 2));
+    long fat_bytes = (long) layout.fat_sectors * layout.bytes_per_sector;
+    char * zeros = (char *) calloc(fat_bytes, 1);
+    CHECK(patch_image(image, fat_offset(&layout, 0), zeros, fat_bytes));
+
+    vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(file_matches(vol, "/A.DAT", 1, 30000));
+    CHECK(make_file(vol, "/B.DAT", 2, 50000));
+    CHECK(fat_rm(vol, "/A.DAT") == 1);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+
+    vol = fat_mount_readonly(image);
+    if (CHECK(vol != NULL)) {
+        CHECK(file_matches(vol, "/B.DAT", 2, 50000));
+        fat_unmount(vol);
+    }
+    char * first = (char *) malloc(fat_bytes);
+    int fd = open(image, O_RDONLY);
+    CHECK(pread(fd, first, fat_bytes, fat_offset(&layout, 0)) == fat_bytes && memcmp(first, zeros, fat_bytes) == 0);
+    close(fd);
+    free(first);
+
+    //An active FAT past the last one cannot be used
+    flags[0] = 0x83;
+    CHECK(patch_image(image, 40, flags, 2));
+    vol = fat_mount_readonly(image);
+    CHECK(vol == NULL);
+    if (vol != NULL)
+        fat_unmount(vol);
+    free(zeros);
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* The new size of a file that is written and then left open must reach its
+* directory entry once FAT_DIRENT_DELAY_MS has passed, without another
+* write, close or sync. The volume is mapped so the entry can be seen in
+* the image as soon as it is written.
+* @param dir The directory for the image
+*/
+void test_dirent_delay(const char * dir) {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_delay.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 4096, 16) == 1))
+        return;
+    char * journal = getenv("FAT_JOURNAL");    //A journaled volume is never mapped
+    journal = journal != NULL ? strdup(journal) : NULL;
+    unsetenv("FAT_JOURNAL");
+    setenv("FAT_MMAP", "1", 1);
+    setenv("FAT_DIRENT_DELAY_MS", "100", 1);
+    fat_volume * vol = fat_mount(image);
+    unsetenv("FAT_MMAP");
+    unsetenv("FAT_DIRENT_DELAY_MS");
+    if (journal != NULL)
+        setenv("FAT_JOURNAL", journal, 1);
+    free(journal);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_creat(vol, "/IDLE.DAT") == 1);
+    int fd = fat_open(vol, "/IDLE.DAT");
+    char buf[5000];
+    fill_pattern(buf, 4, 0, sizeof(buf));
+    CHECK(fd != -1 && fat_write(vol, fd, buf, sizeof(buf), 0) == sizeof(buf));
+
+    long entry = root_entry_offset(image, "IDLE    DAT");
+    unsigned int size = 0;
+    int waited;
+    for (waited = 0; entry != -1 && size != sizeof(buf) && waited < 3000; waited += 10)    {
+        usleep(10000);
+        int fdi = open(image, O_RDONLY);
+        if (pread(fdi, &size, 4, entry + 28) != 4)
+            size = 0;
+        close(fdi);
+    }
+    CHECK(entry != -1 && size == sizeof(buf));
+    fat_close(vol, fd);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* A read-only mount must refuse every change and leave the image as it was
+* @param dir The directory for the image
+*/
+void test_readonly_refuses_changes(const char * dir)  {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_readonly.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 4096, 16) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_mkdir(vol, "/SUB") == 1);
+    CHECK(make_file(vol, "/A.DAT", 1, 20000));
+    CHECK(fat_unmount(vol) != -1);
+    long image_size, size;
+    char * image_before = read_whole(image, &image_size);
+
+    vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_creat(vol, "/NEW.TXT") == -1);
+    CHECK(fat_mkdir(vol, "/NEWDIR") == -1);
+    CHECK(fat_rm(vol, "/A.DAT") == -1);
+    CHECK(fat_rmdir(vol, "/SUB") == -1);
+    int fd = fat_open(vol, "/A.DAT");
+    if (CHECK(fd != -1))    {
+        char buf[100] = { 0 };
+        CHECK(fat_write(vol, fd, buf, sizeof(buf), 0) == -1);
+        CHECK(fat_truncate(vol, fd, 100) == -1);
+        CHECK(fat_fallocate(vol, fd, 1 << 20) == -1);
+        fat_close(vol, fd);
+    }
+    CHECK(file_matches(vol, "/A.DAT", 1, 20000));
+    fat_unmount(vol);
+
+    char * image_after = read_whole(image, &size);
+    CHECK(image_before != NULL && image_after != NULL && size == image_size &&
+        memcmp(image_before, image_after, size) == 0);
+    free(image_before);
+    free(image_after);
+    if (failures == before)
+        remove_image(image);
+}
+
+#define ASYNC_WRITES 64     //Writes queued at once on one descriptor
+
+int completion_order[ASYNC_WRITES];     //Numbers of the writes as they completed
+int write_results[ASYNC_WRITES];        //What each write returned
+int completed = 0;                      //Writes completed so far
+
+/**
+* Record the completion of an asynchronous write
+* @param result What the write returned
+* @param arg The number of the write
+*/
+void write_done(int result, void * arg) {
+    int n = (int)(long) arg;
+    write_results[n] = result;
+    completion_order[__atomic_fetch_add(&completed, 1, __ATOMIC_ACQ_REL)] = n;
+}
+
+/**
+* Writes queued on one descriptor must complete in the order they were
+* queued, so the last one decides what the file holds, and a read queued
+* after them must see it
+* @param dir The directory for the image
+*/
+void test_async_order(const char * dir) {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_async.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 4096, 16) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_creat(vol, "/W.DAT") == 1);
+    int fd = fat_open(vol, "/W.DAT");
+    if (!CHECK(fd != -1))
+        return;
+
+    //Write n fills its first (n + 1) * 256 bytes with n
+    static char bufs[ASYNC_WRITES][ASYNC_WRITES * 256];
+    int i, queued = 0;
+    for (i = 0; i < ASYNC_WRITES; i ++) {
+        memset(bufs[i], i, (i + 1) * 256);
+        queued += fat_write_async(vol, fd, bufs[i], (i + 1) * 256, 0, write_done, (void *)(long) i) == 1;
+    }
+    char * got = (char *) malloc(ASYNC_WRITES * 256);
+    async_result r = { 0, 0 };
+    CHECK(fat_read_async(vol, fd, got, ASYNC_WRITES * 256, 0, read_done, &r) == 1);
+    CHECK(queued == ASYNC_WRITES);
+    while (!__atomic_load_n(&r.done, __ATOMIC_ACQUIRE))
+        usleep(100);
+
+    CHECK(__atomic_load_n(&completed, __ATOMIC_ACQUIRE) == ASYNC_WRITES);
+    int in_order = 1, all_written = 1;
+    for (i = 0; i < ASYNC_WRITES; i ++)  {
+        in_order &= completion_order[i] == i;
+        all_written &= write_results[i] == (i + 1) * 256;
+    }
+    CHECK(in_order);
+    CHECK(all_written);
+    CHECK(r.result == ASYNC_WRITES * 256 && memcmp(got, bufs[ASYNC_WRITES - 1], ASYNC_WRITES * 256) == 0);
+    free(got);
+    fat_close(vol, fd);
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(volume_clean(image));
+    if (failures == before)
+        remove_image(image);
+}
+
+/**
+* fat_check and the fatcheck program must find a lost cluster, a file
+* longer than its chain, a FAT copy that differs and a cross-linked chain
+* made by editing the image
+* @param dir The directory for the image
+*/
+void test_check_finds_damage(const char * dir)  {
+    char image[1024];
+    snprintf(image, sizeof(image), "%s/fattest_damage.raw", dir);
+    int before = failures;
+    remove_image(image);
+    if (!CHECK(fat_mkfs(image, 32 << 20, 4096, 16) == 1))
+        return;
+    fat_volume * vol = fat_mount(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(make_file(vol, "/A.DAT", 1, 20000));
+    CHECK(make_file(vol, "/B.DAT", 2, 9000));
+    CHECK(fat_unmount(vol) != -1);
+    CHECK(run_fatcheck(image) == 0);
+
+    volume_layout layout;
+    long a = root_entry_offset(image, "A       DAT");
+    long b = root_entry_offset(image, "B       DAT");
+    if (!CHECK(read_layout(image, &layout) && a != -1 && b != -1))
+        return;
+    unsigned char eoc[2] = { 0xFF, 0xFF };
+    CHECK(patch_image(image, fat_offset(&layout, 0) + 5000 * 2, eoc, 2));  //Lost in every copy
+    CHECK(patch_image(image, fat_offset(&layout, 1) + 5000 * 2, eoc, 2));
+    CHECK(patch_image(image, fat_offset(&layout, 1) + 6000 * 2, eoc, 2));  //Only in the second copy
+    unsigned int size = 1000000;
+    CHECK(patch_image(image, a + 28, &size, 4));
+
+    vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    fat_check_report report;
+    CHECK(fat_check(vol, 0, &report) == 1);
+    CHECK(report.lost_clusters == 1);
+    CHECK(report.size_mismatches == 1);
+    CHECK(report.fat_mismatches == 1);
+    CHECK(report.cross_links == 0 && report.bad_chains == 0);
+    fat_unmount(vol);
+    CHECK(run_fatcheck(image) == 1);
+
+    //Point B at the chain of A
+    unsigned char first[2];
+    int fdi = open(image, O_RDONLY);
+    CHECK(pread(fdi, first, 2, a + 26) == 2);
+    close(fdi);
+    CHECK(patch_image(image, b + 26, first, 2));
+    vol = fat_mount_readonly(image);
+    if (!CHECK(vol != NULL))
+        return;
+    CHECK(fat_check(vol, 0, &report) == 1 && report.cross_links > 0);
+    fat_unmount(vol);
+    CHECK(run_fatcheck(image) == 1);
+    if (failures == before)
+        remove_image(image);
+}
+
+int main(int argc, char ** argv)    {
+    const char * dir = argc > 1 ? argv[1] : "/tmp";
+    const char * slash = strrchr(argv[0], '/');
+    snprintf(fatcheck_path, sizeof(fatcheck_path), "%.*sfatcheck",
+        slash == NULL ? 0 : (int)(slash - argv[0] + 1), argv[0]);
+    if (slash == NULL)
+        snprintf(fatcheck_path, sizeof(fatcheck_path), "./fatcheck");
+    test_journal_failed_flush(dir);
+    test_torn_journal(dir);
+    test_readonly_pending_journal(dir);
+    test_readonly_close_during_read(dir);
+    test_mkdir_over_removed_file(dir);
+    test_truncate_shared(dir);
+    test_fat_mirroring(dir, 16);
+    test_fat_mirroring(dir, 32);
+    test_active_fat(dir);
+    test_dirent_delay(dir);
+    test_readonly_refuses_changes(dir);
+    test_async_order(dir);
+    test_check_finds_damage(dir);
+    if (failures > 0)   {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
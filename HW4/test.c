@@ -77,7 +77,7 @@ int main()  {
 
     int nbytes = 5000;
     int offset = 0;
-    char buff[nbytes];
+    char buff[nbytes + 64];    //Room for the longer read below and a terminator
 
     int fd = OS_open("/Congrats.txt");
     printf("main:\tFile Descriptor:\t%d\n\n", fd);
@@ -85,8 +85,7 @@ int main()  {
     printf("main:\tBytes Read:\t%d\n\n", bread);
     if (bread < 0)
         bread = 0;
-    if (bread < nbytes)  
-        buff[bread] = '\0';
+    buff[bread] = '\0';
      
     printf("%s\n", buff);
     
@@ -98,8 +97,7 @@ int main()  {
     printf("main:\tBytes Read:\t%d\n\n", bread);
     if (bread < 0)
         bread = 0;
-    if (bread < nbytes)
-        buff[bread] = '\0';
+    buff[bread] = '\0';
     printf("%s\n", buff);
 
     
@@ -107,14 +105,16 @@ int main()  {
     printf("main:\tFile Descriptor:\t%d\n\n", fd2);
     bread = OS_read(fd2, (void*)buff, nbytes, offset);
     printf("main:\tBytes Read:\t%d\n\n", bread);
-    if (bread < nbytes)
-        buff[bread] = '\0';
+    if (bread < 0)
+        bread = 0;
+    buff[bread] = '\0';
     printf("%s\n", buff);
    
     printf("main:\tBytes Written:\t%d\n", OS_write(fd2, buff, strlen(buff), bread));
     bread = OS_read(fd2, (void*)buff, nbytes + strlen(write_buff), 4000);
-    if (bread < nbytes)
-        buff[bread] = '\0';
+    if (bread < 0)
+        bread = 0;
+    buff[bread] = '\0';
     
     printf("main:\t%d\t%lu\n\n%s\n", bread, strlen(buff), buff);
 